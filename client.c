@@ -18,6 +18,10 @@ static void c_end_of_job(const struct Result *res);
 static void c_wait_job_send();
 static void c_wait_running_job_send();
 
+/* With --memo-inputs, the key of the inputs as the run starts. The result
+ * is of those inputs, whatever they were when the job was queued. */
+static char *run_memo_key = 0;
+
 char *build_command_string()
 {
     int size;
@@ -57,8 +61,10 @@ char *build_command_string()
 void c_new_job()
 {
     struct msg m;
+    struct msg_part parts[7];
     char *new_command;
     char *myenv;
+    char *memo;
 
     m.type = NEWJOB;
 
@@ -83,24 +89,67 @@ void c_new_job()
     m.u.newjob.command_size = strlen(new_command) + 1; /* add null */
     m.u.newjob.wait_enqueuing = command_line.wait_enqueuing;
     m.u.newjob.num_slots = command_line.num_slots;
+    m.u.newjob.mem_peak = command_line.mem_peak;
+    m.u.newjob.timeout = command_line.timeout;
+    m.u.newjob.retries = command_line.retries;
+    m.u.newjob.backoff_min = command_line.backoff_min;
+    m.u.newjob.backoff_max = command_line.backoff_max;
+    m.u.newjob.delay = command_line.delay;
+    m.u.newjob.deadline = command_line.deadline;
+    m.u.newjob.priority = command_line.priority;
+    if (command_line.gang)
+        m.u.newjob.gang_name_size = strlen(command_line.gang) + 1;
+    else
+        m.u.newjob.gang_name_size = 0;
+    m.u.newjob.gang_size = command_line.gang_size;
+    m.u.newjob.gang_teardown = command_line.gang_teardown;
+    if (command_line.queue)
+        m.u.newjob.queue_name_size = strlen(command_line.queue) + 1;
+    else
+        m.u.newjob.queue_name_size = 0;
+    m.u.newjob.unique = command_line.unique;
+    if (command_line.unique_key)
+        m.u.newjob.unique_key_size = strlen(command_line.unique_key) + 1;
+    else
+        m.u.newjob.unique_key_size = 0;
+    memo = 0;
+    if (command_line.memo_inputs_num > 0)
+        memo = memo_key();
+    m.u.newjob.memo_key_size = memo ? strlen(memo) + 1 : 0;
+    m.u.newjob.hedge = command_line.hedge;
+    m.u.newjob.ttl = command_line.ttl;
+    m.u.newjob.interactive = command_line.interactive;
+
+    /* The command, the label, the environment, the gang name, the queue
+     * name, the unique key and the memo key go with the message, in this
+     * order */
+    parts[0].data = new_command;
+    parts[0].size = m.u.newjob.command_size;
+    parts[1].data = command_line.label;
+    parts[1].size = m.u.newjob.label_size;
+    parts[2].data = myenv;
+    parts[2].size = m.u.newjob.env_size;
+    parts[3].data = command_line.gang;
+    parts[3].size = m.u.newjob.gang_name_size;
+    parts[4].data = command_line.queue;
+    parts[4].size = m.u.newjob.queue_name_size;
+    parts[5].data = command_line.unique_key;
+    parts[5].size = m.u.newjob.unique_key_size;
+    parts[6].data = memo;
+    parts[6].size = m.u.newjob.memo_key_size;
 
     /* Send the message */
-    send_msg(server_socket, &m);
-
-    /* Send the command */
-    send_bytes(server_socket, new_command, m.u.newjob.command_size);
-
-    /* Send the label */
-    send_bytes(server_socket, command_line.label, m.u.newjob.label_size);
-
-    /* Send the environment */
-    send_bytes(server_socket, myenv, m.u.newjob.env_size);
+    send_msg_parts(server_socket, &m, parts, 7);
+    free(memo);
 
     free(new_command);
     free(myenv);
 }
 
-int c_wait_newjob_ok()
+/* *done gets 1 if the job will not run: if the same job was waiting, the
+ * jobid is the one of that job; if its result was memoized, it ended
+ * already with *errorlevel. */
+int c_wait_newjob_ok(int *done, int *errorlevel)
 {
     struct msg m;
     int res;
@@ -113,7 +162,14 @@ int c_wait_newjob_ok()
         fprintf(stderr, "Error, queue full\n");
         exit(EXITCODE_QUEUE_FULL);
     }
-    if(m.type != NEWJOB_OK)
+    *done = (m.type == NEWJOB_DUP || m.type == NEWJOB_MEMO);
+    *errorlevel = 0;
+    if (m.type == NEWJOB_MEMO)
+    {
+        *errorlevel = m.u.memo.errorlevel;
+        return m.u.memo.jobid;
+    }
+    if(m.type != NEWJOB_OK && m.type != NEWJOB_DUP)
         error("Error getting the newjob_ok");
 
     return m.u.jobid;
@@ -123,6 +179,7 @@ int c_wait_server_commands()
 {
     struct msg m;
     int res;
+    int retries_left = command_line.retries;
 
     while (1)
     {
@@ -139,7 +196,8 @@ int c_wait_server_commands()
             struct Result res;
             res.skipped = 0;
             /* These will send RUNJOB_OK */
-            if (command_line.do_depend && m.u.last_errorlevel != 0)
+            if (m.u.runjob.skip
+                    || (command_line.do_depend && m.u.runjob.last_errorlevel != 0))
             {
                 res.errorlevel = -1;
                 res.user_ms = 0.;
@@ -149,14 +207,46 @@ int c_wait_server_commands()
                 c_send_runjob_ok(0, -1);
             }
             else
+            {
+                free(run_memo_key);
+                run_memo_key = 0;
+                if (command_line.memo_inputs_num > 0)
+                    run_memo_key = memo_key();
                 run_job(&res);
+            }
             c_end_of_job(&res);
+            /* The server applies the same rule, and will send
+             * another RUNJOB after the backoff */
+            if (!res.skipped && res.errorlevel != 0 && retries_left > 0)
+            {
+                --retries_left;
+                continue;
+            }
             return res.errorlevel;
         }
     }
     return -1;
 }
 
+/* The text of LIST_DATA to stdout, through a buffer kept for the next */
+static void write_list_data(const struct msg *m)
+{
+    static char *buffer = 0;
+    static int size = 0;
+
+    if (m->u.size > size)
+    {
+        free(buffer);
+        size = m->u.size;
+        buffer = (char *) malloc(size);
+        if (buffer == 0)
+            error("Cannot allocate the list data of %i", size);
+    }
+    if (recv_bytes(server_socket, buffer, m->u.size) != m->u.size)
+        error("Error receiving the list data");
+    fwrite(buffer, 1, m->u.size, stdout);
+}
+
 void c_wait_server_lines()
 {
     struct msg m;
@@ -180,48 +270,27 @@ void c_wait_server_lines()
             printf("%s", buffer);
             free(buffer);
         }
+        else if (m.type == LIST_DATA)
+            write_list_data(&m);
     }
 }
 
 void c_list_jobs()
 {
     struct msg m;
+    struct msg_part label;
 
     m.type = LIST;
+    m.u.list = command_line.list;
+    m.u.list.format = command_line.format;
+    if (command_line.list_label)
+        m.u.list.label_size = strlen(command_line.list_label) + 1;
+    else
+        m.u.list.label_size = 0;
 
-    send_msg(server_socket, &m);
-}
-
-/* Exits if wrong */
-void c_check_version()
-{
-    struct msg m;
-    int res;
-
-    m.type = GET_VERSION;
-    /* Double send, so an old ts will answer for sure at least once */
-    send_msg(server_socket, &m);
-    send_msg(server_socket, &m);
-
-    /* Set up a 2 second timeout to receive the
-    version msg. */
-
-    res = recv_msg(server_socket, &m);
-    if(res == -1)
-        error("Error calling recv_msg in c_check_version");
-    if (m.type != VERSION || m.u.version != PROTOCOL_VERSION)
-    {
-        printf("Wrong server version. Received %i, expecting %i\n",
-            m.u.version, PROTOCOL_VERSION);
-
-        error("Wrong server version. Received %i, expecting %i",
-            m.u.version, PROTOCOL_VERSION);
-    }
-
-    /* Receive also the 2nd send_msg if we got the right version */
-    res = recv_msg(server_socket, &m);
-    if(res == -1)
-        error("Error calling the 2nd recv_msg in c_check_version");
+    label.data = command_line.list_label;
+    label.size = m.u.list.label_size;
+    send_msg_parts(server_socket, &m, &label, 1);
 }
 
 void c_show_info()
@@ -230,7 +299,8 @@ void c_show_info()
     int res;
 
     m.type = INFO;
-    m.u.jobid = command_line.jobid;
+    m.u.info.jobid = command_line.jobid;
+    m.u.info.format = command_line.format;
 
     send_msg(server_socket, &m);
 
@@ -247,17 +317,14 @@ void c_show_info()
         if (m.type == INFO_DATA)
         {
             char * buffer;
-            enum { DSIZE = 1000 };
 
-            /* We're going to output data using the stdout fd */
-            fflush(stdout);
-            buffer = (char *) malloc(DSIZE);
-            do
-            {
-                res = recv(server_socket, buffer, DSIZE, 0);
-                if (res > 0)
-                    write(1, buffer, res);
-            } while(res > 0);
+            buffer = (char *) malloc(m.u.size);
+            if (buffer == 0)
+                error("Cannot allocate the job info");
+            res = recv_bytes(server_socket, buffer, m.u.size);
+            if (res != m.u.size)
+                error("Error in c_show_info - data size");
+            fwrite(buffer, 1, m.u.size, stdout);
             free(buffer);
         }
     }
@@ -266,6 +333,7 @@ void c_show_info()
 void c_send_runjob_ok(const char *ofname, int pid)
 {
     struct msg m;
+    struct msg_part parts[2];
 
     /* Prepare the message */
     m.type = RUNJOB_OK;
@@ -278,12 +346,51 @@ void c_send_runjob_ok(const char *ofname, int pid)
         m.u.output.ofilename_size = strlen(ofname) + 1;
     else
         m.u.output.ofilename_size = 0;
+    if (m.u.output.store_output && run_memo_key != 0)
+        m.u.output.memo_key_size = strlen(run_memo_key) + 1;
+    else
+        m.u.output.memo_key_size = 0;
+
+    /* With the filename, and the memo key */
+    parts[0].data = ofname;
+    parts[0].size = m.u.output.ofilename_size;
+    parts[1].data = run_memo_key;
+    parts[1].size = m.u.output.memo_key_size;
+    send_msg_parts(server_socket, &m, parts, 2);
+}
 
+/* The backup copy of --hedge started, in its process group */
+void c_send_hedge_started(int pid)
+{
+    struct msg m;
+
+    m.type = HEDGE_STARTED;
+    m.u.output.store_output = 0;
+    m.u.output.ofilename_size = 0;
+    m.u.output.memo_key_size = 0;
+    m.u.output.pid = pid;
     send_msg(server_socket, &m);
+}
 
-    /* Send the filename */
-    if (command_line.store_output)
-        send_bytes(server_socket, ofname, m.u.output.ofilename_size);
+/* The backup copy of --hedge ended before the job */
+void c_send_hedge_won(const char *ofname, int pid)
+{
+    struct msg m;
+    struct msg_part name;
+
+    m.type = HEDGE_WON;
+    m.u.output.store_output = (ofname != 0);
+    m.u.output.pid = pid;
+    m.u.output.memo_key_size = 0;
+    if (m.u.output.store_output)
+        m.u.output.ofilename_size = strlen(ofname) + 1;
+    else
+        m.u.output.ofilename_size = 0;
+
+    /* With the filename */
+    name.data = ofname;
+    name.size = m.u.output.ofilename_size;
+    send_msg_parts(server_socket, &m, &name, 1);
 }
 
 static void c_end_of_job(const struct Result *res)
@@ -296,12 +403,25 @@ static void c_end_of_job(const struct Result *res)
     send_msg(server_socket, &m);
 }
 
+/* For the requests without an answer: the server closes once it has done
+ * them, so the status page read after shows them */
+static void wait_server_close()
+{
+    struct msg m;
+
+    shutdown(server_socket, SHUT_WR);
+    while (recv_msg(server_socket, &m) > 0)
+        ;
+}
+
 void c_shutdown_server()
 {
     struct msg m;
 
     m.type = KILL_SERVER;
     send_msg(server_socket, &m);
+    /* Until it exits, with its socket and status page removed */
+    wait_server_close();
 }
 
 void c_clear_finished()
@@ -310,6 +430,7 @@ void c_clear_finished()
 
     m.type = CLEAR_FINISHED;
     send_msg(server_socket, &m);
+    wait_server_close();
 }
 
 static char * get_output_file(int *pid)
@@ -429,6 +550,8 @@ void c_kill_job()
 
     /* Send SIGTERM to the process group, as pid is for process group */
     kill(-pid, SIGTERM);
+    /* It would not act on a job stopped by preemption */
+    kill(-pid, SIGCONT);
 }
 
 void c_remove_job()
@@ -498,11 +621,22 @@ int c_wait_job_recv()
 static void c_wait_job_send()
 {
     struct msg m;
+    struct msg_part parts[2];
 
     /* Send the request */
     m.type = WAITJOB;
-    m.u.jobid = command_line.jobid;
-    send_msg(server_socket, &m);
+    m.u.wait.jobid = command_line.jobid;
+    m.u.wait.jobids_num = command_line.wait_jobids_num;
+    m.u.wait.all = command_line.wait_all;
+    m.u.wait.any = command_line.wait_any;
+    m.u.wait.label_size = 0;
+    if (command_line.label)
+        m.u.wait.label_size = strlen(command_line.label) + 1;
+    parts[0].data = command_line.wait_jobids;
+    parts[0].size = command_line.wait_jobids_num * sizeof(int);
+    parts[1].data = command_line.label;
+    parts[1].size = m.u.wait.label_size;
+    send_msg_parts(server_socket, &m, parts, 2);
 }
 
 static void c_wait_running_job_send()
@@ -537,6 +671,34 @@ void c_send_max_slots(int max_slots)
     m.type = SET_MAX_SLOTS;
     m.u.max_slots = command_line.max_slots;
     send_msg(server_socket, &m);
+    wait_server_close();
+}
+
+void c_send_start_rate()
+{
+    struct msg m;
+    struct msg_part label;
+
+    m.type = SET_START_RATE;
+    m.u.start_rate.rate = command_line.start_rate;
+    m.u.start_rate.burst = command_line.start_burst;
+    if (command_line.label)
+        m.u.start_rate.label_size = strlen(command_line.label) + 1;
+    else
+        m.u.start_rate.label_size = 0;
+    label.data = command_line.label;
+    label.size = m.u.start_rate.label_size;
+    send_msg_parts(server_socket, &m, &label, 1);
+    /* A server of another protocol answers with its version */
+    wait_server_close();
+}
+
+void c_stats()
+{
+    struct msg m;
+
+    m.type = STATS;
+    send_msg(server_socket, &m);
 }
 
 void c_get_max_slots()
@@ -672,3 +834,174 @@ void c_swap_jobs()
     /* This will never be reached */
     return;
 }
+
+/* Prints the job of an EV_SNAPSHOT or EV_ENQUEUED: the label and the
+ * command follow the message */
+static void print_event_job(const char *name, const struct msg *m)
+{
+    char *label = 0;
+    char *command;
+
+    if (m->u.event.label_size > 0)
+    {
+        label = (char *) malloc(m->u.event.label_size);
+        if (label == 0)
+            error("Cannot allocate the label of the event");
+        recv_bytes(server_socket, label, m->u.event.label_size);
+    }
+    command = (char *) malloc(m->u.event.command_size);
+    if (command == 0)
+        error("Cannot allocate the command of the event");
+    recv_bytes(server_socket, command, m->u.event.command_size);
+
+    printf("%s %i %s ", name, m->u.event.jobid,
+            jstate2string(m->u.event.state));
+    if (m->u.event.state == FINISHED || m->u.event.state == SKIPPED
+            || m->u.event.state == EXPIRED)
+        printf("%i %.2fs ", m->u.event.errorlevel, m->u.event.real_ms);
+    if (label != 0)
+        printf("[%s]", label);
+    printf("%s\n", command);
+
+    free(label);
+    free(command);
+}
+
+/* ts --watch: a line for each event, until the server closes */
+void c_watch(int snapshot)
+{
+    struct msg m;
+    int res;
+
+    m.type = SUBSCRIBE;
+    m.u.snapshot = snapshot;
+    send_msg(server_socket, &m);
+
+    while (1)
+    {
+        res = recv_msg(server_socket, &m);
+        if (res == 0)
+            break;
+        if (res != sizeof(m) || m.type != EVENT)
+            error("Error in c_watch");
+
+        switch(m.u.event.type)
+        {
+        case EV_SNAPSHOT:
+            print_event_job("job", &m);
+            break;
+        case EV_SNAPSHOT_END:
+            printf("ready %i\n", m.u.event.count);
+            break;
+        case EV_ENQUEUED:
+            print_event_job("enqueued", &m);
+            break;
+        case EV_STATE:
+            printf("state %i %s\n", m.u.event.jobid,
+                    jstate2string(m.u.event.state));
+            break;
+        case EV_FINISHED:
+            printf("finished %i %s ", m.u.event.jobid,
+                    jstate2string(m.u.event.state));
+            if (m.u.event.died_by_signal)
+                printf("signal %i", m.u.event.signal);
+            else
+                printf("%i", m.u.event.errorlevel);
+            printf(" %.2fs\n", m.u.event.real_ms);
+            break;
+        case EV_REMOVED:
+            printf("removed %i\n", m.u.event.jobid);
+            break;
+        case EV_CLEARED:
+            printf("cleared\n");
+            break;
+        case EV_REORDERED:
+            printf("moved %i after %i\n", m.u.event.jobid, m.u.event.jobid2);
+            break;
+        case EV_SLOTS:
+            printf("slots %i\n", m.u.event.count);
+            break;
+        case EV_LOST:
+            printf("lost %i\n", m.u.event.count);
+            break;
+        }
+        /* A line as it comes, unless more are already here */
+        if (!msg_pending(server_socket))
+            fflush(stdout);
+    }
+    fflush(stdout);
+}
+
+/* Many requests on the connection. The server ends the answer of each one
+ * in RESPONSE_END, and doesn't close. */
+void c_session_open()
+{
+    struct msg m;
+
+    m.type = SESSION;
+    send_msg(server_socket, &m);
+}
+
+/* Prints the answer of the next request sent in the session. Returns 0 if
+ * the server closed. */
+int c_session_answer()
+{
+    struct msg m;
+    int res;
+    char *buffer;
+
+    while (1)
+    {
+        res = recv_msg(server_socket, &m);
+        if (res == 0)
+            return 0;
+        if (res != sizeof(m))
+            error("Error in c_session_answer");
+
+        switch(m.type)
+        {
+        case RESPONSE_END:
+            return 1;
+        case LIST_DATA:
+            write_list_data(&m);
+            break;
+        case LIST_LINE:
+        case INFO_DATA:
+            buffer = (char *) malloc(m.u.size);
+            if (buffer == 0)
+                error("Cannot allocate the answer");
+            res = recv_bytes(server_socket, buffer, m.u.size);
+            if (res != m.u.size)
+                error("Error in c_session_answer - line size");
+            /* The lines have their null, the info doesn't */
+            fwrite(buffer, 1, m.type == LIST_LINE ? m.u.size - 1 : m.u.size,
+                    stdout);
+            free(buffer);
+            break;
+        case ANSWER_STATE:
+            printf("%s\n", jstate2string(m.u.state));
+            break;
+        case ANSWER_OUTPUT:
+            if (m.u.output.store_output && m.u.output.ofilename_size > 0)
+            {
+                buffer = (char *) malloc(m.u.output.ofilename_size);
+                if (buffer == 0)
+                    error("Cannot allocate the answer");
+                recv_bytes(server_socket, buffer, m.u.output.ofilename_size);
+                printf("%s\n", buffer);
+                free(buffer);
+            } else
+                printf("pid %i\n", m.u.output.pid);
+            break;
+        case GET_MAX_SLOTS_OK:
+            printf("%i\n", m.u.max_slots);
+            break;
+        case VERSION:
+            printf("%i\n", m.u.version);
+            break;
+        default:
+            /* The OKs have nothing to show */
+            break;
+        }
+    }
+}
@@ -0,0 +1,337 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Jobs with a deadline run before the rest, earliest deadline first.
+ * More exactly, by least slack: the deadline minus the expected run time,
+ * as learnt from the previous runs of the same command or label.
+ * The waiting jobs with a deadline are kept in a binary heap, so choosing
+ * and removing cost O(log n). Only those that could run go in it: the ones
+ * waiting for a dependency go once it ends. */
+
+static struct Job **heap = 0;
+static int heap_size = 0;
+static int heap_allocated = 0;
+
+/* Jobs taken apart while looking for one to run */
+static struct Job **aside = 0;
+static int aside_size = 0;
+static int aside_allocated = 0;
+
+enum
+{
+    HISTORY_BUCKETS = 1024,
+    HISTORY_MAX = 8192, /* Entries. Beyond, the stale ones get replaced */
+    HISTORY_SAMPLES = 32, /* Last runs kept, for the percentiles */
+    PERCENTILE_MIN_SAMPLES = 3
+};
+
+/* The run time history. An average of the last successful runs of each
+ * command, and of each label, and the times of the last ones. */
+struct History
+{
+    char *key; /* "c" + command, or "l" + label */
+    float seconds;
+    float samples[HISTORY_SAMPLES]; /* A ring */
+    int nsamples;
+    int next_sample;
+    time_t updated;
+    struct History *next;
+};
+
+static void add_sample(struct History *h, float seconds)
+{
+    h->samples[h->next_sample] = seconds;
+    h->next_sample = (h->next_sample + 1) % HISTORY_SAMPLES;
+    if (h->nsamples < HISTORY_SAMPLES)
+        ++h->nsamples;
+}
+
+static struct History *history[HISTORY_BUCKETS];
+static int history_count = 0;
+
+static unsigned int hash_key(const char *kind, const char *str)
+{
+    unsigned int h = 5381;
+
+    h = h * 33 + (unsigned char) *kind;
+    for (; *str != '\0'; ++str)
+        h = h * 33 + (unsigned char) *str;
+    return h % HISTORY_BUCKETS;
+}
+
+static struct History * find_history(const char *kind, const char *str)
+{
+    struct History *h;
+
+    for (h = history[hash_key(kind, str)]; h != 0; h = h->next)
+        if (h->key[0] == *kind && strcmp(h->key + 1, str) == 0)
+            return h;
+    return 0;
+}
+
+static void record_history(const char *kind, const char *str, float seconds)
+{
+    struct History *h;
+    unsigned int b;
+
+    h = find_history(kind, str);
+    if (h != 0)
+    {
+        /* Moving average, following the recent runs */
+        h->seconds = 0.7 * h->seconds + 0.3 * seconds;
+        h->updated = time(NULL);
+        add_sample(h, seconds);
+        return;
+    }
+
+    b = hash_key(kind, str);
+    if (history_count >= HISTORY_MAX)
+    {
+        struct History **ph, **oldest = 0;
+
+        /* Replace the stalest of the chain, if any */
+        for (ph = &history[b]; *ph != 0; ph = &(*ph)->next)
+            if (oldest == 0 || (*ph)->updated < (*oldest)->updated)
+                oldest = ph;
+        if (oldest == 0)
+            return;
+        h = *oldest;
+        *oldest = h->next;
+        free(h->key);
+        free(h);
+        --history_count;
+    }
+
+    h = (struct History *) malloc(sizeof(*h));
+    if (h == 0)
+        return;
+    h->key = (char *) malloc(strlen(str) + 2);
+    if (h->key == 0)
+    {
+        free(h);
+        return;
+    }
+    h->key[0] = *kind;
+    strcpy(h->key + 1, str);
+    h->seconds = seconds;
+    h->nsamples = 0;
+    h->next_sample = 0;
+    add_sample(h, seconds);
+    h->updated = time(NULL);
+    h->next = history[b];
+    history[b] = h;
+    ++history_count;
+}
+
+/* Learns from a run that ended well */
+void edf_job_ended(const struct Job *p)
+{
+    float seconds;
+
+    if (p->result.skipped || p->result.errorlevel != 0)
+        return;
+
+    seconds = pinfo_time_run(&p->info);
+    record_history("c", p->command, seconds);
+    if (p->label != 0)
+        record_history("l", p->label, seconds);
+}
+
+/* Expected seconds of run, or -1 if unknown */
+int edf_estimate(const struct Job *p)
+{
+    struct History *h;
+
+    h = find_history("c", p->command);
+    if (h == 0 && p->label != 0)
+        h = find_history("l", p->label);
+    if (h == 0)
+        return -1;
+    return (int) (h->seconds + 0.5);
+}
+
+/* The run time under which that percent of the last runs of its label
+ * ended, or of its command if it has no label. -1 if there are not enough
+ * runs to tell. */
+float edf_percentile(const struct Job *p, int percent)
+{
+    struct History *h;
+    float sorted[HISTORY_SAMPLES];
+    int i, j;
+
+    if (p->label != 0)
+        h = find_history("l", p->label);
+    else
+        h = find_history("c", p->command);
+    if (h == 0 || h->nsamples < PERCENTILE_MIN_SAMPLES)
+        return -1;
+
+    /* Insertion sort: they are few */
+    for (i = 0; i < h->nsamples; ++i)
+    {
+        float val = h->samples[i];
+        for (j = i; j > 0 && sorted[j - 1] > val; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = val;
+    }
+
+    i = (h->nsamples * percent + 99) / 100 - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= h->nsamples)
+        i = h->nsamples - 1;
+    return sorted[i];
+}
+
+/* The latest time the job can start and still meet its deadline */
+static time_t latest_start(const struct Job *p)
+{
+    return p->deadline - (p->estimate > 0 ? p->estimate : 0);
+}
+
+static int heap_less(const struct Job *a, const struct Job *b)
+{
+    time_t la = latest_start(a);
+    time_t lb = latest_start(b);
+
+    if (la != lb)
+        return la < lb;
+    return a->jobid < b->jobid;
+}
+
+static void heap_set(int i, struct Job *p)
+{
+    heap[i] = p;
+    p->heap_index = i;
+}
+
+static void sift_up(int i)
+{
+    struct Job *p = heap[i];
+
+    while (i > 0 && heap_less(p, heap[(i - 1) / 2]))
+    {
+        heap_set(i, heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(i, p);
+}
+
+static void sift_down(int i)
+{
+    struct Job *p = heap[i];
+
+    while (1)
+    {
+        int child = 2 * i + 1;
+
+        if (child >= heap_size)
+            break;
+        if (child + 1 < heap_size && heap_less(heap[child + 1], heap[child]))
+            ++child;
+        if (!heap_less(heap[child], p))
+            break;
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, p);
+}
+
+/* Adds a job with deadline, waiting to run */
+void edf_insert(struct Job *p)
+{
+    if (p->deadline == 0 || p->heap_index != -1)
+        return;
+
+    if (heap_size == heap_allocated)
+    {
+        heap_allocated = heap_allocated ? heap_allocated * 2 : 64;
+        heap = (struct Job **) realloc(heap,
+                heap_allocated * sizeof(*heap));
+        if (heap == 0)
+            error("Cannot allocate the deadline heap");
+    }
+
+    heap_set(heap_size, p);
+    ++heap_size;
+    sift_up(heap_size - 1);
+}
+
+/* Removes the job, if it was in the heap */
+void edf_remove(struct Job *p)
+{
+    int i = p->heap_index;
+
+    if (i == -1)
+        return;
+
+    p->heap_index = -1;
+    --heap_size;
+    if (i == heap_size)
+        return;
+
+    heap_set(i, heap[heap_size]);
+    if (i > 0 && heap_less(heap[i], heap[(i - 1) / 2]))
+        sift_up(i);
+    else
+        sift_down(i);
+}
+
+/* The waiting job with least slack, or 0 */
+struct Job * edf_first()
+{
+    if (heap_size == 0)
+        return 0;
+    return heap[0];
+}
+
+/* Takes apart a job that cannot run now, to look at the next ones.
+ * Call edf_put_back() when done. */
+void edf_set_aside(struct Job *p)
+{
+    edf_remove(p);
+    if (aside_size == aside_allocated)
+    {
+        aside_allocated = aside_allocated ? aside_allocated * 2 : 64;
+        aside = (struct Job **) realloc(aside,
+                aside_allocated * sizeof(*aside));
+        if (aside == 0)
+            error("Cannot allocate the deadline heap");
+    }
+    aside[aside_size++] = p;
+}
+
+void edf_put_back()
+{
+    int i;
+
+    for (i = 0; i < aside_size; ++i)
+        edf_insert(aside[i]);
+    aside_size = 0;
+}
+
+/* Whether the job will likely end after its deadline */
+int edf_will_miss(const struct Job *p, time_t now)
+{
+    time_t start;
+
+    if (p->deadline == 0)
+        return 0;
+
+    if (p->state == RUNNING)
+        start = p->info.start_time.tv_sec;
+    else
+        start = now;
+
+    return start + (p->estimate > 0 ? p->estimate : 0) > p->deadline;
+}
@@ -0,0 +1,270 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* The event stream of SUBSCRIBE. The events go out as the jobs change,
+ * without blocking: each subscriber has its socket non blocking, and a
+ * buffer for what it could not take yet, flushed when select() says it
+ * can write. A subscriber too slow to keep up gets up to SUB_MAX_BUFFER
+ * bytes buffered. Beyond that, its events are dropped, and it gets an
+ * EV_LOST with how many, once the buffer is empty again. The server never
+ * waits for it. */
+
+enum
+{
+    SUB_MAX_BUFFER = 1024 * 1024
+};
+
+struct Subscriber
+{
+    int socket;
+    char *buffer;
+    int size;
+    int len; /* Of the buffer, not sent yet */
+    int lost;
+};
+
+static struct Subscriber *subscribers = 0;
+static int nsubscribers = 0;
+
+static struct Subscriber * find_subscriber(int s)
+{
+    int i;
+
+    for (i = 0; i < nsubscribers; ++i)
+        if (subscribers[i].socket == s)
+            return &subscribers[i];
+    return 0;
+}
+
+void events_subscribe(int s)
+{
+    struct Subscriber *sub;
+    int flags;
+
+    if (find_subscriber(s) != 0)
+        return;
+
+    flags = fcntl(s, F_GETFL);
+    if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        warning("Cannot make the subscriber %i non blocking", s);
+        return;
+    }
+
+    subscribers = (struct Subscriber *) realloc(subscribers,
+            (nsubscribers + 1) * sizeof(*subscribers));
+    if (subscribers == 0)
+        error("Cannot allocate a subscriber");
+    sub = &subscribers[nsubscribers++];
+    sub->socket = s;
+    sub->buffer = 0;
+    sub->size = 0;
+    sub->len = 0;
+    sub->lost = 0;
+}
+
+void events_unsubscribe(int s)
+{
+    struct Subscriber *sub = find_subscriber(s);
+
+    if (sub == 0)
+        return;
+
+    free(sub->buffer);
+    *sub = subscribers[--nsubscribers];
+}
+
+int events_subscribed(int s)
+{
+    return find_subscriber(s) != 0;
+}
+
+/* Sends what it can of the buffer */
+static void flush_subscriber(struct Subscriber *sub)
+{
+    while (sub->len > 0)
+    {
+        int res = send(sub->socket, sub->buffer, sub->len, 0);
+
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            /* Full, or gone. Its close will unsubscribe it. */
+            return;
+        memmove(sub->buffer, sub->buffer + res, sub->len - res);
+        sub->len -= res;
+    }
+}
+
+static void post(struct Subscriber *sub, const struct msg *m,
+        const struct msg_part *parts, int nparts);
+
+static void post_lost(struct Subscriber *sub)
+{
+    struct msg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = EVENT;
+    m.u.event.type = EV_LOST;
+    m.u.event.jobid = -1;
+    m.u.event.jobid2 = -1;
+    m.u.event.count = sub->lost;
+    sub->lost = 0;
+    post(sub, &m, 0, 0);
+}
+
+static void post(struct Subscriber *sub, const struct msg *m,
+        const struct msg_part *parts, int nparts)
+{
+    int bytes;
+
+    if (sub->len == 0 && sub->lost > 0)
+        post_lost(sub);
+
+    bytes = frame_msg_parts(0, 0, m, parts, nparts);
+    if (sub->len + bytes > SUB_MAX_BUFFER)
+    {
+        ++sub->lost;
+        return;
+    }
+    if (sub->len + bytes > sub->size)
+    {
+        int new_size = sub->len + bytes > 4096 ? sub->len + bytes : 4096;
+        char *new_buffer = (char *) realloc(sub->buffer, new_size);
+
+        if (new_buffer == 0)
+        {
+            ++sub->lost;
+            return;
+        }
+        sub->buffer = new_buffer;
+        sub->size = new_size;
+    }
+    frame_msg_parts(sub->buffer + sub->len, bytes, m, parts, nparts);
+    sub->len += bytes;
+    flush_subscriber(sub);
+}
+
+static void post_all(int s, const struct msg *m,
+        const struct msg_part *parts, int nparts)
+{
+    int i;
+
+    for (i = 0; i < nsubscribers; ++i)
+        if (s == -1 || subscribers[i].socket == s)
+            post(&subscribers[i], m, parts, nparts);
+}
+
+/* An event about the job, to the subscriber s, or to all if -1 */
+void event_job(int s, enum Event type, const struct Job *p)
+{
+    struct msg m;
+    struct msg_part parts[2];
+    int nparts = 0;
+
+    if (nsubscribers == 0)
+        return;
+
+    memset(&m, 0, sizeof(m));
+    m.type = EVENT;
+    m.u.event.type = type;
+    m.u.event.jobid = p->jobid;
+    m.u.event.jobid2 = -1;
+    m.u.event.state = p->state;
+    if (p->state == FINISHED || p->state == SKIPPED || p->state == EXPIRED)
+    {
+        m.u.event.errorlevel = p->result.errorlevel;
+        m.u.event.died_by_signal = p->result.died_by_signal;
+        m.u.event.signal = p->result.signal;
+        m.u.event.real_ms = p->result.real_ms;
+    }
+
+    /* What the job is, for the new ones */
+    if (type == EV_SNAPSHOT || type == EV_ENQUEUED)
+    {
+        m.u.event.label_size = p->label ? strlen(p->label) + 1 : 0;
+        m.u.event.command_size = strlen(p->command) + 1;
+        parts[0].data = p->label;
+        parts[0].size = m.u.event.label_size;
+        parts[1].data = p->command;
+        parts[1].size = m.u.event.command_size;
+        nparts = 2;
+    }
+
+    post_all(s, &m, parts, nparts);
+}
+
+void event_reordered(int jobid, int jobid2)
+{
+    struct msg m;
+
+    if (nsubscribers == 0)
+        return;
+
+    memset(&m, 0, sizeof(m));
+    m.type = EVENT;
+    m.u.event.type = EV_REORDERED;
+    m.u.event.jobid = jobid;
+    m.u.event.jobid2 = jobid2;
+    post_all(-1, &m, 0, 0);
+}
+
+/* An event without a job, to the subscriber s, or to all if -1: EV_SLOTS,
+ * EV_CLEARED or EV_SNAPSHOT_END */
+void event_count(int s, enum Event type, int count)
+{
+    struct msg m;
+
+    if (nsubscribers == 0)
+        return;
+
+    memset(&m, 0, sizeof(m));
+    m.type = EVENT;
+    m.u.event.type = type;
+    m.u.event.jobid = -1;
+    m.u.event.jobid2 = -1;
+    m.u.event.count = count;
+    post_all(s, &m, 0, 0);
+}
+
+/* Adds the subscribers with data to send. Returns the new maxfd. */
+int events_writeset(fd_set *writeset, int maxfd)
+{
+    int i;
+
+    for (i = 0; i < nsubscribers; ++i)
+        if (subscribers[i].len > 0)
+        {
+            FD_SET(subscribers[i].socket, writeset);
+            if (subscribers[i].socket > maxfd)
+                maxfd = subscribers[i].socket;
+        }
+    return maxfd;
+}
+
+void events_flush(fd_set *writeset)
+{
+    int i;
+
+    for (i = 0; i < nsubscribers; ++i)
+        if (FD_ISSET(subscribers[i].socket, writeset))
+        {
+            flush_subscriber(&subscribers[i]);
+            if (subscribers[i].len == 0 && subscribers[i].lost > 0)
+                post_lost(&subscribers[i]);
+        }
+}
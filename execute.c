@@ -18,25 +18,27 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "main.h"
 
 /* from signals.c */
 extern int signals_child_pid; /* 0, not set. otherwise, set. */
 
-/* Returns errorlevel */
-static void run_parent(int fd_read_filename, int pid, struct Result *result)
+/* For --hedge: the SIGCHLD handler writes here, so select() can wait for
+ * the copies of the job and the server at once */
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void run_child(int fd_send_filename);
+
+/* Reads what run_child() sends: the output filename, if any, and the start
+ * time. Returns the filename. */
+static char * read_child_start(int fd_read_filename, struct timeval *starttv)
 {
-    int status;
     char *ofname = 0;
     int namesize;
     int res;
-    char *command;
-    struct timeval starttv;
-    struct timeval endtv;
-    struct tms cpu_times;
 
-    /* Read the filename */
     /* This is linked with the write() in this same file, in run_child() */
     if (command_line.store_output) {
         res = read(fd_read_filename, &namesize, sizeof(namesize));
@@ -49,18 +51,200 @@ static void run_parent(int fd_read_filename, int pid, struct Result *result)
         if (res != namesize)
             error("Reading the out file name");
     }
-    res = read(fd_read_filename, &starttv, sizeof(starttv));
-    if (res != sizeof(starttv))
+    res = read(fd_read_filename, starttv, sizeof(*starttv));
+    if (res != sizeof(*starttv))
         error("Reading the the struct timeval");
     close(fd_read_filename);
 
+    return ofname;
+}
+
+static void sigchld_handler(int val)
+{
+    int saved_errno = errno;
+
+    write(sigchld_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+static void program_hedge_signal()
+{
+    struct sigaction act;
+    int i;
+
+    /* Once, for all the retries of the job */
+    if (sigchld_pipe[0] != -1)
+        return;
+
+    if (pipe(sigchld_pipe) == -1)
+        error("Cannot create the SIGCHLD pipe");
+    for (i = 0; i < 2; ++i)
+    {
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    act.sa_handler = sigchld_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &act, NULL);
+}
+
+/* Starts the backup copy of the job. Returns its pid. */
+static int run_backup(char **ofname)
+{
+    struct timeval starttv;
+    int pid;
+    int p[2];
+
+    pipe(p);
+
+    pid = fork();
+
+    switch(pid)
+    {
+        case 0:
+            restore_sigmask();
+            close(server_socket);
+            close(sigchld_pipe[0]);
+            close(sigchld_pipe[1]);
+            close(p[0]);
+            run_child(p[1]);
+            fprintf(stderr, "ts could not run the command\n");
+            exit(-1);
+        case -1:
+            warning("Cannot fork the backup copy of the job");
+            close(p[0]);
+            close(p[1]);
+            return -1;
+        default:
+            close(p[1]);
+            *ofname = read_child_start(p[0], &starttv);
+            break;
+    }
+
+    return pid;
+}
+
+/* Waits for the job, starting its backup copy if the server says so. The
+ * first copy to end wins, and the other is killed. Returns the pid of the
+ * winner, and its output filename in *ofname. */
+static int wait_hedged(int pid, int *status, char **ofname)
+{
+    int backup = 0;
+    char *backup_ofname = 0;
+    int watch_server = 1;
+    int winner;
+    int loser;
+    char *loser_ofname;
+
+    while (1)
+    {
+        fd_set readset;
+        struct timeval zero;
+        int maxfd;
+        int pending;
+        char c;
+
+        if (waitpid(pid, status, WNOHANG) == pid)
+        {
+            winner = pid;
+            loser = backup;
+            loser_ofname = backup_ofname;
+            break;
+        }
+        if (backup > 0 && waitpid(backup, status, WNOHANG) == backup)
+        {
+            winner = backup;
+            loser = pid;
+            loser_ofname = *ofname;
+            *ofname = backup_ofname;
+            break;
+        }
+
+        FD_ZERO(&readset);
+        FD_SET(sigchld_pipe[0], &readset);
+        maxfd = sigchld_pipe[0];
+        if (watch_server)
+        {
+            FD_SET(server_socket, &readset);
+            if (server_socket > maxfd)
+                maxfd = server_socket;
+        }
+        /* A message already received would not wake select() */
+        pending = watch_server && msg_pending(server_socket);
+        zero.tv_sec = 0;
+        zero.tv_usec = 0;
+        if (select(maxfd + 1, &readset, NULL, NULL, pending ? &zero : NULL)
+                == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("select in wait_hedged");
+        }
+
+        while (read(sigchld_pipe[0], &c, 1) == 1)
+            ;
+
+        if (watch_server && (pending || FD_ISSET(server_socket, &readset)))
+        {
+            struct msg m;
+
+            if (recv_msg(server_socket, &m) <= 0)
+                watch_server = 0;
+            else if (m.type == HEDGE && backup == 0)
+            {
+                backup = run_backup(&backup_ofname);
+                if (backup == -1)
+                    backup = 0;
+                else
+                    c_send_hedge_started(backup);
+            }
+        }
+    }
+
+    if (loser > 0)
+    {
+        int loser_status;
+
+        kill(-loser, SIGKILL);
+        kill(loser, SIGKILL);
+        waitpid(loser, &loser_status, 0);
+        if (loser_ofname != 0)
+            unlink(loser_ofname);
+    }
+    free(loser_ofname);
+
+    return winner;
+}
+
+/* Returns errorlevel */
+static void run_parent(int fd_read_filename, int pid, struct Result *result)
+{
+    int status;
+    char *ofname;
+    char *command;
+    struct timeval starttv;
+    struct timeval endtv;
+    struct tms cpu_times;
+
+    /* Read the filename */
+    ofname = read_child_start(fd_read_filename, &starttv);
+
     /* All went fine - prepare the SIGINT and send runjob_ok */
     signals_child_pid = pid;
     unblock_sigint_and_install_handler();
 
     c_send_runjob_ok(ofname, pid);
 
-    wait(&status);
+    if (command_line.hedge)
+    {
+        int winner = wait_hedged(pid, &status, &ofname);
+        if (winner != pid)
+            c_send_hedge_won(ofname, winner);
+    }
+    else
+        wait(&status);
 
     /* Set the errorlevel */
     if (WIFEXITED(status))
@@ -236,6 +420,11 @@ static void run_child(int fd_send_filename)
         write(fd_send_filename, (char *)&namesize, sizeof(namesize));
         write(fd_send_filename, outfname_full, namesize);
     }
+    /* We create a new session, so we can kill process groups as:
+         kill -- -`ts -p`
+       Before telling the start, so the group is there for the server */
+    setsid();
+
     /* Times */
     gettimeofday(&starttv, NULL);
     write(fd_send_filename, &starttv, sizeof(starttv));
@@ -245,9 +434,6 @@ static void run_child(int fd_send_filename)
     if (command_line.should_go_background)
         create_closed_read_on(0);
 
-    /* We create a new session, so we can kill process groups as:
-         kill -- -`ts -p` */
-    setsid();
     execvp(command_line.command.array[0], command_line.command.array);
 }
 
@@ -266,6 +452,9 @@ int run_job(struct Result *res)
     /* Prepare the output filename sending */
     pipe(p);
 
+    if (command_line.hedge)
+        program_hedge_signal();
+
     pid = fork();
 
     switch(pid)
@@ -273,6 +462,11 @@ int run_job(struct Result *res)
         case 0:
             restore_sigmask();
             close(server_socket);
+            if (command_line.hedge)
+            {
+                close(sigchld_pipe[0]);
+                close(sigchld_pipe[1]);
+            }
             close(p[0]);
             run_child(p[1]);
             /* Not reachable, if the 'exec' of the command
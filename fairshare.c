@@ -0,0 +1,512 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#ifdef __linux__
+  /* For struct ucred */
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Fair share of the slots among the users of a shared queue.
+ * The jobs are grouped in flows: a flow per user, and, if TS_FAIRSHARE is
+ * "labels", a flow per label inside each user. The dispatcher takes the
+ * first runnable job of each flow as its candidate, and chooses among them
+ * by deficit round robin: each flow visited gets its weight as credit, and
+ * each job started costs its slots. Inside a flow, the order is the queue
+ * order.
+ * The usage of each flow is accounted in slot-seconds, decaying with a
+ * half-life, for the stats.
+ * A flow goes away once it has no jobs and its usage decayed, so the lists
+ * keep only the users and labels of late. */
+
+struct Flow
+{
+    int uid;
+    char *label; /* Only for label flows. 0 for the jobs without label */
+    int weight;
+    int deficit;
+    int visited; /* Got its credit in this visit of the round robin */
+    struct Flow *parent;
+    struct Flow *children;
+    struct Flow *cur; /* Of the round robin among the children */
+    struct Flow *next;
+
+    struct Job *candidate; /* Valid in the pass active_pass */
+    unsigned int active_pass;
+
+    double usage; /* Slot-seconds, decayed until usage_time */
+    time_t usage_time;
+
+    int queued; /* Only for the stats */
+    int running;
+
+    int jobs; /* Queued or running, in it or in its children */
+};
+
+enum
+{
+    FLOW_IDLE_USAGE = 1 /* Slot-seconds. Less is as if it never ran */
+};
+
+enum Fairshare_mode
+{
+    FS_OFF,
+    FS_USERS,
+    FS_LABELS
+};
+
+static enum Fairshare_mode mode = FS_USERS;
+static struct Flow root;
+static unsigned int pass = 0;
+static int halflife = 60 * 60; /* Seconds */
+static const char *weights_str = 0;
+
+/* The uid of the process at the other side of the unix socket,
+ * or -1 if we cannot know. */
+int fs_peer_uid(int s)
+{
+#if defined(__linux__) && defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return -1;
+    return (int) cred.uid;
+#else
+    return -1;
+#endif
+}
+
+/* Weight of the user in TS_FAIRSHARE_WEIGHTS, like "alice:3,1001:2".
+ * 1 if not there. */
+static int user_weight(int uid)
+{
+    const char *p = weights_str;
+
+    while (p != 0 && *p != '\0')
+    {
+        char name[100];
+        int len = strcspn(p, ":,");
+        int weight;
+
+        if (len < (int) sizeof(name) && p[len] == ':')
+        {
+            struct passwd *pw;
+            int this_uid;
+
+            strncpy(name, p, len);
+            name[len] = '\0';
+            pw = getpwnam(name);
+            this_uid = pw ? (int) pw->pw_uid : atoi(name);
+            weight = atoi(p + len + 1);
+            if (this_uid == uid && weight > 0)
+                return weight;
+        }
+
+        p = strchr(p, ',');
+        if (p != 0)
+            ++p;
+    }
+
+    return 1;
+}
+
+void fs_init()
+{
+    const char *str;
+
+    str = getenv("TS_FAIRSHARE");
+    if (str != NULL)
+    {
+        if (strcmp(str, "off") == 0)
+            mode = FS_OFF;
+        else if (strcmp(str, "users") == 0)
+            mode = FS_USERS;
+        else if (strcmp(str, "labels") == 0)
+            mode = FS_LABELS;
+        else
+            warning("Wrong TS_FAIRSHARE value \"%s\"", str);
+    }
+
+    str = getenv("TS_FAIRSHARE_HALFLIFE");
+    if (str != NULL)
+    {
+        int seconds = parse_duration(str);
+        if (seconds > 0)
+            halflife = seconds;
+        else
+            warning("Wrong TS_FAIRSHARE_HALFLIFE value \"%s\"", str);
+    }
+
+    weights_str = getenv("TS_FAIRSHARE_WEIGHTS");
+}
+
+int fs_enabled()
+{
+    return mode != FS_OFF;
+}
+
+static struct Flow * new_flow(struct Flow *parent, int uid, const char *label)
+{
+    struct Flow *f;
+
+    f = (struct Flow *) malloc(sizeof(*f));
+    if (f == 0)
+        error("Cannot allocate a fair share flow");
+    memset(f, 0, sizeof(*f));
+    f->uid = uid;
+    if (label != 0)
+    {
+        f->label = (char *) malloc(strlen(label) + 1);
+        if (f->label == 0)
+            error("Cannot allocate a fair share flow");
+        strcpy(f->label, label);
+    }
+    f->weight = parent == &root ? user_weight(uid) : 1;
+    f->usage_time = time(NULL);
+    f->parent = parent;
+
+    /* Append, so the round robin goes in order of arrival */
+    if (parent->children == 0)
+        parent->children = f;
+    else
+    {
+        struct Flow *last = parent->children;
+        while (last->next != 0)
+            last = last->next;
+        last->next = f;
+    }
+
+    return f;
+}
+
+static double flow_usage(struct Flow *f, time_t now);
+
+static int same_label(const char *a, const char *b)
+{
+    if (a == 0 || b == 0)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static int flow_idle(struct Flow *f, time_t now)
+{
+    return f->jobs == 0 && flow_usage(f, now) < FLOW_IDLE_USAGE;
+}
+
+/* With its children, that are idle too if it is */
+static void free_flow(struct Flow *f)
+{
+    struct Flow **pp;
+
+    for (pp = &f->parent->children; *pp != 0; pp = &(*pp)->next)
+        if (*pp == f)
+        {
+            *pp = f->next;
+            break;
+        }
+    if (f->parent->cur == f)
+        f->parent->cur = f->next;
+
+    while (f->children != 0)
+        free_flow(f->children);
+    free(f->label);
+    free(f);
+}
+
+/* The flow where the jobs of that user and label go. It counts the job,
+ * until fs_job_gone(). The idle flows passed by go away. */
+struct Flow * fs_job_flow(int uid, const char *label)
+{
+    struct Flow *user;
+    struct Flow *f;
+    struct Flow *next;
+    time_t now = time(NULL);
+
+    for (user = root.children; user != 0; user = next)
+    {
+        next = user->next;
+        if (user->uid == uid)
+            break;
+        if (flow_idle(user, now))
+            free_flow(user);
+    }
+    if (user == 0)
+        user = new_flow(&root, uid, 0);
+    ++user->jobs;
+
+    if (mode != FS_LABELS)
+        return user;
+
+    for (f = user->children; f != 0; f = next)
+    {
+        next = f->next;
+        if (same_label(f->label, label))
+            break;
+        if (flow_idle(f, now))
+            free_flow(f);
+    }
+    if (f == 0)
+        f = new_flow(user, uid, label);
+    ++f->jobs;
+    return f;
+}
+
+/* The job left the queue: it does not hold its flow any more */
+void fs_job_gone(struct Job *p)
+{
+    struct Flow *f;
+    struct Flow *parent;
+    time_t now = time(NULL);
+
+    if (p->flow == 0)
+        return;
+
+    for (f = p->flow; f != &root; f = f->parent)
+        --f->jobs;
+
+    for (f = p->flow; f != &root && flow_idle(f, now); f = parent)
+    {
+        parent = f->parent;
+        free_flow(f);
+    }
+    p->flow = 0;
+}
+
+/* Call it before offering the candidates of a dispatch pass */
+void fs_begin_pass()
+{
+    ++pass;
+}
+
+/* Whether the flow has already a candidate in this pass. Then the rest of
+ * its jobs don't need to be considered. */
+int fs_has_candidate(const struct Flow *f)
+{
+    return f->active_pass == pass && f->candidate != 0;
+}
+
+/* Offers a runnable job as candidate of its flow */
+void fs_offer(struct Job *p)
+{
+    struct Flow *f = p->flow;
+
+    if (fs_has_candidate(f))
+        return;
+    f->candidate = p;
+    for (; f != 0 && f != &root; f = f->parent)
+        f->active_pass = pass;
+}
+
+static int flow_active(const struct Flow *f)
+{
+    return f->active_pass == pass;
+}
+
+/* Deficit round robin among the children of the flow. The credit may get
+ * negative by a job of many slots; then the flow waits for some rounds. */
+static struct Job * drr_pick(struct Flow *parent)
+{
+    struct Flow *f;
+    int any = 0;
+
+    if (parent->children == 0)
+        return parent->candidate;
+
+    for (f = parent->children; f != 0; f = f->next)
+        if (flow_active(f))
+            any = 1;
+    if (!any)
+        return 0;
+
+    f = parent->cur ? parent->cur : parent->children;
+    while (1)
+    {
+        if (flow_active(f))
+        {
+            if (!f->visited)
+            {
+                f->deficit += f->weight;
+                f->visited = 1;
+            }
+            if (f->deficit > 0)
+            {
+                parent->cur = f;
+                return drr_pick(f);
+            }
+        }
+        else if (f->deficit > 0)
+            f->deficit = 0; /* Idle flows don't keep credit */
+
+        f->visited = 0;
+        f = f->next ? f->next : parent->children;
+    }
+}
+
+/* Returns the job to start among the candidates offered, or 0 */
+struct Job * fs_pick()
+{
+    struct Job *p;
+    struct Flow *f;
+
+    p = drr_pick(&root);
+    if (p == 0)
+        return 0;
+
+    for (f = p->flow; f != &root; f = f->parent)
+        f->deficit -= p->num_slots;
+    return p;
+}
+
+/* 2^(-halflives) without libm: whole halvings, and a short series
+ * for the fraction */
+static double decay_factor(double halflives)
+{
+    double factor = 1.;
+    double x, term, sum;
+    int i;
+
+    while (halflives >= 1.)
+    {
+        factor /= 2.;
+        halflives -= 1.;
+        if (factor < 1e-30)
+            return 0.;
+    }
+
+    /* e^-x, x = halflives * ln 2 < 0.7 */
+    x = halflives * 0.69314718056;
+    term = 1.;
+    sum = 1.;
+    for (i = 1; i < 10; ++i)
+    {
+        term *= -x / i;
+        sum += term;
+    }
+
+    return factor * sum;
+}
+
+static double flow_usage(struct Flow *f, time_t now)
+{
+    if (now > f->usage_time)
+    {
+        f->usage *= decay_factor((double) (now - f->usage_time) / halflife);
+        f->usage_time = now;
+    }
+    return f->usage;
+}
+
+/* Accounts the run of the job, once it ended */
+void fs_job_ended(struct Job *p)
+{
+    struct Flow *f;
+    time_t now = time(NULL);
+    double slot_seconds;
+
+    if (p->flow == 0)
+        return;
+
+    slot_seconds = pinfo_time_run(&p->info) * p->num_slots;
+    for (f = p->flow; f != &root; f = f->parent)
+        f->usage = flow_usage(f, now) + slot_seconds;
+}
+
+static void flow_name(const struct Flow *f, char *buf, int size)
+{
+    struct passwd *pw = 0;
+
+    if (f->uid != -1)
+        pw = getpwuid((uid_t) f->uid);
+
+    if (pw != 0)
+        snprintf(buf, size, "%s", pw->pw_name);
+    else if (f->uid != -1)
+        snprintf(buf, size, "%i", f->uid);
+    else
+        snprintf(buf, size, "unknown");
+}
+
+static void send_flow_line(int s, const struct Flow *f, const char *name,
+        time_t now)
+{
+    char line[200];
+
+    snprintf(line, sizeof(line), "%-20s %6i %6i %7i %12.0f\n",
+            name, f->weight, f->queued, f->running,
+            flow_usage((struct Flow *) f, now));
+    send_list_line(s, line);
+}
+
+/* The fair share section of the stats. 'first' is the first queued or
+ * running job, for the counts. */
+void fs_send_stats(int s, const struct Job *first)
+{
+    const struct Job *p;
+    struct Flow *user;
+    struct Flow *f;
+    time_t now = time(NULL);
+    char name[100];
+    const char *mode_str;
+
+    for (user = root.children; user != 0; user = user->next)
+    {
+        user->queued = user->running = 0;
+        for (f = user->children; f != 0; f = f->next)
+            f->queued = f->running = 0;
+    }
+
+    for (p = first; p != 0; p = p->next)
+    {
+        if (p->flow == 0)
+            continue;
+        for (f = p->flow; f != &root; f = f->parent)
+        {
+            if (p->state == RUNNING || p->state == PREEMPTED)
+                ++f->running;
+            else
+                ++f->queued;
+        }
+    }
+
+    switch(mode)
+    {
+        case FS_OFF:
+            mode_str = "off";
+            break;
+        case FS_LABELS:
+            mode_str = "users and labels";
+            break;
+        case FS_USERS:
+        default:
+            mode_str = "users";
+            break;
+    }
+    snprintf(name, sizeof(name), "Fair share: %s. Usage half-life: %is\n",
+            mode_str, halflife);
+    send_list_line(s, name);
+    send_list_line(s, "User                 Weight Queued Running Usage(slot-s)\n");
+
+    for (user = root.children; user != 0; user = user->next)
+    {
+        flow_name(user, name, sizeof(name));
+        send_flow_line(s, user, name, now);
+        for (f = user->children; f != 0; f = f->next)
+        {
+            snprintf(name, sizeof(name), "  [%s]",
+                    f->label ? f->label : "");
+            send_flow_line(s, f, name, now);
+        }
+    }
+}
@@ -0,0 +1,191 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Gangs: jobs that start together or not at all. The jobs join a gang by
+ * its name as they are queued. Once it has all its members, and they all
+ * can run, they take their slots at once, and the server starts them in the
+ * same pass. Meanwhile no gang member runs alone. */
+
+struct Gang
+{
+    char *name;
+    int size;
+    int members; /* Jobs that joined, and did not leave */
+    int started;
+    int teardown; /* Kill the rest if one member fails */
+    unsigned int pass; /* Of next_run_job(), when last looked at */
+    struct Gang *next;
+};
+
+static struct Gang *first_gang = 0;
+
+/* Members taken, waiting for next_run_job() to hand them to the server */
+static int *dispatch = 0;
+static int dispatch_size = 0;
+static int dispatch_allocated = 0;
+
+/* The gang the job joins: the one of that name still gathering members,
+ * or a new one. */
+struct Gang * gang_join(const char *name, int size, int teardown)
+{
+    struct Gang *g;
+
+    for (g = first_gang; g != 0; g = g->next)
+        if (!g->started && g->members < g->size
+                && strcmp(g->name, name) == 0)
+            break;
+
+    if (g == 0)
+    {
+        g = (struct Gang *) malloc(sizeof(*g));
+        if (g == 0)
+            error("Cannot allocate a gang");
+        g->name = (char *) malloc(strlen(name) + 1);
+        if (g->name == 0)
+            error("Cannot allocate a gang");
+        strcpy(g->name, name);
+        g->size = size < 1 ? 1 : size;
+        g->members = 0;
+        g->started = 0;
+        g->teardown = teardown;
+        g->pass = 0;
+        g->next = first_gang;
+        first_gang = g;
+    }
+
+    ++g->members;
+    return g;
+}
+
+/* The job does not need its gang anymore */
+void gang_leave(struct Job *p)
+{
+    struct Gang *g = p->gang;
+    struct Gang **pg;
+
+    if (g == 0)
+        return;
+    p->gang = 0;
+
+    if (--g->members > 0)
+        return;
+
+    for (pg = &first_gang; *pg != 0; pg = &(*pg)->next)
+        if (*pg == g)
+        {
+            *pg = g->next;
+            break;
+        }
+    free(g->name);
+    free(g);
+}
+
+/* Whether the gang has gathered all its members */
+int gang_complete(const struct Gang *g)
+{
+    return g->members >= g->size;
+}
+
+int gang_started(const struct Gang *g)
+{
+    return g->started;
+}
+
+int gang_size(const struct Gang *g)
+{
+    return g->size;
+}
+
+const char * gang_name(const struct Gang *g)
+{
+    return g->name;
+}
+
+/* Returns 1 only the first time it's called for the gang in the pass */
+int gang_first_visit(struct Gang *g, unsigned int pass)
+{
+    if (g->pass == pass)
+        return 0;
+    g->pass = pass;
+    return 1;
+}
+
+/* Marks the gang started, and queues its members for dispatch */
+void gang_start(struct Gang *g, struct Job *first)
+{
+    struct Job *p;
+
+    g->started = 1;
+    for (p = first; p != 0; p = p->next)
+    {
+        if (p->gang != g)
+            continue;
+        if (dispatch_size == dispatch_allocated)
+        {
+            dispatch_allocated = dispatch_allocated ? dispatch_allocated * 2
+                : 16;
+            dispatch = (int *) realloc(dispatch,
+                    dispatch_allocated * sizeof(*dispatch));
+            if (dispatch == 0)
+                error("Cannot allocate the gang dispatch list");
+        }
+        dispatch[dispatch_size++] = p->jobid;
+    }
+}
+
+/* A member of a started gang to hand to the server, or -1 */
+int gang_next_dispatch()
+{
+    int jobid;
+
+    if (dispatch_size == 0)
+        return -1;
+    jobid = dispatch[0];
+    --dispatch_size;
+    memmove(dispatch, dispatch + 1, dispatch_size * sizeof(*dispatch));
+    return jobid;
+}
+
+/* A member ended. If it failed and the gang wants, we ask the rest of the
+ * running members to finish, and mark those not started yet, so they
+ * never run. 'first' is the first queued or running job. */
+void gang_member_ended(const struct Job *p, struct Job *first)
+{
+    struct Job *r;
+
+    if (p->gang == 0 || !p->gang->teardown || !p->gang->started)
+        return;
+    if (!p->result.died_by_signal && p->result.errorlevel == 0)
+        return;
+
+    for (r = first; r != 0; r = r->next)
+    {
+        if (r == p || r->gang != p->gang)
+            continue;
+        if (r->pid <= 0)
+        {
+            /* Its runner did not tell the pid yet, or it waits to attach */
+            pinfo_addinfo(&r->info, 100,
+                    "Gang member %i failed: it will not start\n", p->jobid);
+            r->gang_torn = 1;
+            continue;
+        }
+        if (r->state != RUNNING && r->state != PREEMPTED)
+            continue;
+        pinfo_addinfo(&r->info, 100, "Gang member %i failed: sending SIGTERM\n",
+                p->jobid);
+        kill(-r->pid, SIGTERM);
+        /* In case it was preempted */
+        kill(-r->pid, SIGCONT);
+    }
+}
@@ -23,6 +23,7 @@ void pinfo_init(struct Procinfo *p)
     p->end_time.tv_usec = 0;
     p->enqueue_time.tv_sec = 0;
     p->enqueue_time.tv_usec = 0;
+    p->suspended = 0;
 }
 
 void pinfo_free(struct Procinfo *p)
@@ -105,6 +106,7 @@ void pinfo_set_start_time(struct Procinfo *p)
     gettimeofday(&p->start_time, 0);
     p->end_time.tv_sec = 0;
     p->end_time.tv_usec = 0;
+    p->suspended = 0;
 }
 
 void pinfo_set_end_time(struct Procinfo *p)
@@ -122,7 +124,7 @@ float pinfo_time_until_now(const struct Procinfo *p)
     t = now.tv_sec - p->start_time.tv_sec;
     t += (float) (now.tv_usec - p->start_time.tv_usec) / 1000000.;
 
-    return t;
+    return t - p->suspended;
 }
 
 float pinfo_time_run(const struct Procinfo *p)
@@ -132,5 +134,21 @@ float pinfo_time_run(const struct Procinfo *p)
     t = p->end_time.tv_sec - p->start_time.tv_sec;
     t += (float) (p->end_time.tv_usec - p->start_time.tv_usec) / 1000000.;
 
-    return t;
+    return t - p->suspended;
+}
+
+void pinfo_suspend(struct Procinfo *p)
+{
+    gettimeofday(&p->suspend_time, 0);
+}
+
+void pinfo_resume(struct Procinfo *p)
+{
+    struct timeval now;
+
+    gettimeofday(&now, 0);
+
+    p->suspended += now.tv_sec - p->suspend_time.tv_sec;
+    p->suspended += (float) (now.tv_usec - p->suspend_time.tv_usec)
+        / 1000000.;
 }
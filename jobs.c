@@ -10,21 +10,38 @@
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#include <signal.h>
+#include <fnmatch.h>
 #include "main.h"
 
 /* The list will access them */
 int busy_slots = 0;
 int max_slots = 1;
 
-struct Notify
+/* A client in -w, waiting on its connection for one job or many */
+struct Waiter
 {
     int socket;
-    int jobid;
-    struct Notify *next;
+    int any; /* Answered when the first job ends, instead of the last */
+    int left; /* Jobs not ended yet */
+    int errorlevel; /* Of the first job that failed; with any, that ended */
+    struct Notify *notifies;
+    int notifies_num;
+    struct Waiter *next;
+};
+
+/* A job waited, in the list of the job. So a job ending looks only at its
+ * waiters. */
+struct Notify
+{
+    struct Waiter *waiter;
+    struct Job *job; /* 0 once ended */
+    struct Notify *next; /* Of the same job */
 };
 
 /* Globals */
 static struct Job *firstjob = 0;
+static struct Job *lastjob = 0; /* Where newjobptr() appends */
 static struct Job *first_finished_job = 0;
 static int jobids = 0;
 /* This is used for dependencies from jobs
@@ -34,25 +51,145 @@ static int last_errorlevel = 0; /* Before the first job, let's consider
 /* We need this to handle well "-d" after a "-nf" run */
 static int last_finished_jobid;
 
-static struct Notify *first_notify = 0;
+static struct Waiter *first_waiter = 0;
 
-int max_jobs;
+/* Jobs deferred by memory are retried with this, as the memory gets
+ * freed without any event we can wait for. */
+static struct Timer deferred_retry_timer;
+static int deferred_retry_timer_ready = 0;
+
+/* Run time allowed to jobs not asking for any. 0 means no limit. */
+static int default_timeout = 0;
+
+/* Seconds for the runner of a job from the ring to attach */
+enum
+{
+    RING_ATTACH_WAIT = 30
+};
+
+/* Slots that only the interactive jobs can take, out of max_slots */
+static int interactive_slots = 0;
+static int interactive_busy = 0; /* Slots taken by interactive jobs */
+
+/* The queued interactive jobs, in the order of the queue, for
+ * next_run_job() to try first without walking the queue. If jobs moved in
+ * the queue, it takes the order again from the queue before using it. */
+static struct Job *first_interactive = 0;
+static int interactive_unsorted = 0;
 
+int max_jobs;
 static struct Job * get_job(int jobid);
+static int depend_pending(const struct Job *p);
 void notify_errorlevel(struct Job *p);
 
-static void send_list_line(int s, const char * str)
+/* The reserved slots not taken by interactive jobs */
+static int reserved_idle()
+{
+    int reserved = interactive_slots;
+
+    if (reserved > max_slots)
+        reserved = max_slots;
+    reserved -= interactive_busy;
+    return reserved > 0 ? reserved : 0;
+}
+
+/* The free slots the job can take */
+static int slots_free_for(const struct Job *p)
+{
+    int free_slots = max_slots - busy_slots;
+
+    if (!p->interactive)
+        free_slots -= reserved_idle();
+    return free_slots;
+}
+
+/* The job takes (or gives back, if negative) slots */
+static void use_slots(const struct Job *p, int slots)
+{
+    busy_slots = busy_slots + slots;
+    if (p->interactive)
+        interactive_busy = interactive_busy + slots;
+}
+
+/* The lines of LIST and STATS gather here, and go out in LIST_DATA
+ * messages of up to LIST_CHUNK bytes, instead of a message each. The
+ * buffer stays for the next list. */
+enum
+{
+    LIST_CHUNK = 64 * 1024
+};
+
+static char *list_buffer = 0;
+static int list_len = 0;
+static int list_size = 0;
+static int list_socket = -1;
+
+static void list_flush()
+{
+    struct msg m;
+    struct msg_part data;
+
+    if (list_len == 0)
+        return;
+
+    m.type = LIST_DATA;
+    m.u.size = list_len;
+    data.data = list_buffer;
+    data.size = list_len;
+    send_msg_parts(list_socket, &m, &data, 1);
+    list_len = 0;
+}
+
+static void list_begin(int s)
+{
+    list_socket = s;
+    list_len = 0;
+}
+
+static void list_end()
+{
+    list_flush();
+    list_socket = -1;
+}
+
+static void list_add(const char *data, int len)
+{
+    if (list_len + len > list_size)
+    {
+        int new_size = list_len + len > LIST_CHUNK ? list_len + len
+            : LIST_CHUNK;
+        char *new_buffer = (char *) realloc(list_buffer, new_size);
+
+        if (new_buffer == 0)
+            error("Cannot allocate the list buffer of %i", new_size);
+        list_buffer = new_buffer;
+        list_size = new_size;
+    }
+    memcpy(list_buffer + list_len, data, len);
+    list_len += len;
+    if (list_len >= LIST_CHUNK)
+        list_flush();
+}
+
+void send_list_line(int s, const char * str)
 {
     struct msg m;
+    struct msg_part line;
+
+    if (s == list_socket)
+    {
+        list_add(str, strlen(str));
+        return;
+    }
 
     /* Message */
     m.type = LIST_LINE;
     m.u.size = strlen(str) + 1;
 
-    send_msg(s, &m);
-
-    /* Send the line */
-    send_bytes(s, str, m.u.size);
+    /* With the line */
+    line.data = str;
+    line.size = m.u.size;
+    send_msg_parts(s, &m, &line, 1);
 }
 
 static void send_urgent_ok(int s)
@@ -91,6 +228,12 @@ static struct Job * find_previous_job(const struct Job *final)
     return 0;
 }
 
+/* To the subscribers: the job goes now right after the one before it */
+static void event_moved(const struct Job *p)
+{
+    event_reordered(p->jobid, find_previous_job(p)->jobid);
+}
+
 static struct Job * findjob(int jobid)
 {
     struct Job *p;
@@ -139,19 +282,128 @@ static struct Job * find_finished_job(int jobid)
     return 0;
 }
 
-static int count_not_finished_jobs()
+/* Jobs in each state, for count_not_finished_jobs() and the counts of
+ * LIST, without walking the lists */
+static int state_count[EXPIRED + 1];
+
+/* Jobs from the ring still queued. They hold no connection, so they do not
+ * count in max_jobs. */
+static int ring_queued = 0;
+
+/* Jobs queued with a priority over the default one. While there are none,
+ * next_run_job() does not look for them. */
+static int priority_queued = 0;
+
+/* A job queued again, out of a delay, goes in the middle of the queue */
+static void interactive_add(struct Job *p)
+{
+    struct Job **pp;
+
+    if (p != lastjob)
+        interactive_unsorted = 1;
+    for (pp = &first_interactive; *pp != 0; pp = &(*pp)->interactive_next)
+        ;
+    *pp = p;
+    p->interactive_next = 0;
+}
+
+static void interactive_remove(struct Job *p)
+{
+    struct Job **pp;
+
+    for (pp = &first_interactive; *pp != 0; pp = &(*pp)->interactive_next)
+        if (*pp == p)
+        {
+            *pp = p->interactive_next;
+            break;
+        }
+}
+
+/* The list again in the order of the queue, after moves in it */
+static void interactive_sort()
 {
-    int count=0;
     struct Job *p;
+    struct Job **pp = &first_interactive;
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
-    while(p != 0)
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->interactive && p->state == QUEUED)
+        {
+            *pp = p;
+            pp = &p->interactive_next;
+        }
+    *pp = 0;
+    interactive_unsorted = 0;
+}
+
+/* The job goes in (n = 1) or out (n = -1) of the counts of its state */
+static void count_state(struct Job *p, int n)
+{
+    state_count[p->state] += n;
+    if (p->state != QUEUED)
+        return;
+    if (p->ring_argc > 0)
+        ring_queued += n;
+    if (p->priority > 0)
+        priority_queued += n;
+    if (p->interactive)
     {
-        ++count;
-        p = p->next;
+        if (n > 0)
+            interactive_add(p);
+        else
+            interactive_remove(p);
     }
-    return count;
+}
+
+/* A job with deadline goes in the heap only once it could run: queued,
+ * not waiting for a dependency, and not in a gang, that starts apart. So
+ * next_run_job() does not take out and put back the blocked ones on each
+ * call. It leaves the heap when it starts or ends. */
+static void edf_queue(struct Job *p)
+{
+    if (p->deadline != 0 && p->state == QUEUED && p->gang == 0
+            && !depend_pending(p))
+        edf_insert(p);
+}
+
+/* The job p ended or went away: the jobs depending on it may run */
+static void edf_queue_dependents(const struct Job *p)
+{
+    int i;
+
+    for (i = 0; i < p->notify_errorlevel_to_size; ++i)
+    {
+        struct Job *d = findjob(p->notify_errorlevel_to[i]);
+
+        if (d != 0)
+            edf_queue(d);
+    }
+}
+
+static void set_state(struct Job *p, enum Jobstate state)
+{
+    count_state(p, -1);
+    p->state = state;
+    count_state(p, 1);
+    if (state == QUEUED)
+        edf_queue(p);
+    status_job(p, state_count);
+    /* The final states go with the result, in job_finished() */
+    if (state != FINISHED && state != SKIPPED && state != EXPIRED)
+        event_job(-1, EV_STATE, p);
+}
+
+/* The job leaves the lists: out of the counts and of the status page */
+static void uncount_job(struct Job *p)
+{
+    count_state(p, -1);
+    status_job_gone(p, state_count);
+}
+
+static int count_not_finished_jobs()
+{
+    return state_count[QUEUED] + state_count[RUNNING]
+        + state_count[HOLDING_CLIENT] + state_count[DELAYED]
+        + state_count[PREEMPTED];
 }
 
 static void add_notify_errorlevel_to(struct Job *job, int jobid)
@@ -178,7 +430,151 @@ void s_mark_job_running(int jobid)
     p = findjob(jobid);
     if (!p)
         error("Cannot mark the jobid %i RUNNING.", jobid);
-    p->state = RUNNING;
+    set_state(p, RUNNING);
+    ++p->attempts;
+    timer_del(&p->ttl_timer);
+    unique_remove(p);
+}
+
+/* The jobs depending on p, that is replaced, depend on the job that
+ * replaces it, as it runs in its place. If that one depended on p, it
+ * takes the dependency of p. */
+static void move_dependents(struct Job *p, struct Job *by)
+{
+    int i;
+
+    for (i = 0; i < p->notify_errorlevel_to_size; ++i)
+    {
+        struct Job *d = findjob(p->notify_errorlevel_to[i]);
+
+        if (d == 0 || d->depend_on != p->jobid)
+            continue;
+        if (d != by)
+        {
+            d->depend_on = by->jobid;
+            add_notify_errorlevel_to(by, d->jobid);
+            continue;
+        }
+
+        d->depend_on = p->depend_on;
+        d->dependency_errorlevel = p->do_depend ? p->dependency_errorlevel : 0;
+        if (p->depend_on >= 0)
+        {
+            struct Job *q = findjob(p->depend_on);
+
+            if (q != 0)
+                add_notify_errorlevel_to(q, d->jobid);
+        }
+    }
+    p->notify_errorlevel_to_size = 0;
+}
+
+/* The waiting job is replaced by a newer one, queued with --debounce.
+ * It ends as skipped, but its dependents wait for the new one. */
+void s_job_replaced(int jobid, int by)
+{
+    struct Job *p;
+    struct Job *by_job;
+    struct Result r;
+
+    p = findjob(jobid);
+    if (p == 0)
+        return;
+
+    by_job = findjob(by);
+    if (by_job != 0)
+        move_dependents(p, by_job);
+    pinfo_addinfo(&p->info, 100, "Replaced by job %i\n", by);
+    r.errorlevel = -1;
+    r.died_by_signal = 0;
+    r.signal = 0;
+    r.user_ms = 0;
+    r.system_ms = 0;
+    r.real_ms = 0;
+    r.skipped = 1;
+    job_finished(&r, jobid);
+}
+
+/* The job did not start within its TTL. It ends as expired, and its
+ * dependents see it failed. */
+void s_job_expired(int jobid)
+{
+    struct Job *p;
+    struct Result r;
+
+    p = findjob(jobid);
+    if (p == 0)
+        return;
+
+    pinfo_addinfo(&p->info, 100, "Expired: not started by %s",
+            ctime(&p->expires));
+    r.errorlevel = -1;
+    r.died_by_signal = 0;
+    r.signal = 0;
+    r.user_ms = 0;
+    r.system_ms = 0;
+    r.real_ms = 0;
+    r.skipped = 1;
+    job_finished(&r, jobid);
+}
+
+/* For a job queued with --memo-inputs: if a run with the same key ended
+ * well, the job ends now with its result and output. Returns 1 then. */
+int s_memo_lookup(int jobid, int *errorlevel)
+{
+    struct Job *p;
+    struct Result r;
+    const char *output;
+    int memo_jobid;
+
+    p = findjob(jobid);
+    if (p == 0 || p->memo_key == 0 || depend_pending(p))
+        return 0;
+
+    if (!memo_lookup(p->memo_key, errorlevel, &output, &memo_jobid))
+        return 0;
+
+    p->output_filename = (char *) malloc(strlen(output) + 1);
+    if (p->output_filename == 0)
+        error("Cannot allocate the memoized output filename");
+    strcpy(p->output_filename, output);
+    pinfo_addinfo(&p->info, 100, "Memoized: the result of job %i\n",
+            memo_jobid);
+    /* It ends as it starts */
+    pinfo_set_start_time(&p->info);
+
+    r.errorlevel = *errorlevel;
+    r.died_by_signal = 0;
+    r.signal = 0;
+    r.user_ms = 0;
+    r.system_ms = 0;
+    r.real_ms = 0;
+    r.skipped = 0;
+    job_finished(&r, jobid);
+    return 1;
+}
+
+/* For a job queued with --unique or --debounce: the jobid of the job with
+ * the same key waiting to run, or -1. If there is none, the new job gets
+ * into the index. */
+int s_find_duplicate(int jobid)
+{
+    struct Job *p;
+    struct Job *dup;
+
+    p = findjob(jobid);
+    if (p == 0 || p->unique_key == 0)
+        return -1;
+
+    dup = unique_find(p->unique_key);
+    if (dup == 0)
+    {
+        unique_insert(p);
+        return -1;
+    }
+    if (dup == p)
+        return -1;
+    return dup->jobid;
 }
 
 /* -1 means nothing awaken, otherwise returns the jobid awaken */
@@ -188,69 +584,735 @@ int wake_hold_client()
     p = findjob_holding_client();
     if (p)
     {
-        p->state = QUEUED;
+        /* A --at/--after job may still have to wait */
+        if (timer_pending(&p->delay_timer))
+            set_state(p, DELAYED);
+        else
+            set_state(p, QUEUED);
+        return p->jobid;
+    }
+    return -1;
+}
+
+const char * jstate2string(enum Jobstate s)
+{
+    const char * jobstate;
+    switch(s)
+    {
+        case QUEUED:
+            jobstate = "queued";
+            break;
+        case RUNNING:
+            jobstate = "running";
+            break;
+        case FINISHED:
+            jobstate = "finished";
+            break;
+        case SKIPPED:
+            jobstate = "skipped";
+            break;
+        case HOLDING_CLIENT:
+            jobstate = "skipped";
+            break;
+        case DELAYED:
+            jobstate = "delayed";
+            break;
+        case PREEMPTED:
+            jobstate = "preempted";
+            break;
+        case EXPIRED:
+            jobstate = "expired";
+            break;
+    }
+    return jobstate;
+}
+
+const char * defer2string(enum Defer d)
+{
+    const char * reason;
+    switch(d)
+    {
+        case DEFER_MEMORY:
+            reason = "not enough memory for the declared peak";
+            break;
+        case DEFER_MEMPRESSURE:
+            reason = "host under memory pressure";
+            break;
+        case DEFER_RATE:
+            reason = "start rate limit of the queue";
+            break;
+        case DEFER_LABEL_RATE:
+            reason = "start rate limit of its label";
+            break;
+        case DEFER_GANG:
+            reason = "waiting to start with its gang";
+            break;
+        case DEFER_QUOTA:
+            reason = "slots reserved for other queues";
+            break;
+        case DEFER_NONE:
+        default:
+            reason = "not deferred";
+            break;
+    }
+    return reason;
+}
+
+/* Nothing to do: the server loop will call next_run_job() after it */
+static void fire_deferred_retry(struct Timer *t)
+{
+}
+
+static void retry_deferred_later()
+{
+    if (!deferred_retry_timer_ready)
+    {
+        timer_init(&deferred_retry_timer, fire_deferred_retry, 0);
+        deferred_retry_timer_ready = 1;
+    }
+    if (!timer_pending(&deferred_retry_timer))
+        timer_add(&deferred_retry_timer, 1000);
+}
+
+/* The jobs whose TTL passed, for the server to end. Only those, so it
+ * does not look through the queue on each loop. */
+static struct Job *first_expired = 0;
+
+/* The TTL of a job passed. The server ends it, if it did not start. */
+static void fire_ttl(struct Timer *t)
+{
+    struct Job *p = (struct Job *) t->data;
+
+    if (p->state == QUEUED || p->state == DELAYED)
+    {
+        p->expired = 1;
+        p->expired_next = first_expired;
+        first_expired = p;
+    }
+}
+
+/* For a job that goes, in case it is in the list still */
+static void expired_remove(struct Job *p)
+{
+    struct Job **pp;
+
+    if (!p->expired)
+        return;
+    for (pp = &first_expired; *pp != 0; pp = &(*pp)->expired_next)
+        if (*pp == p)
+        {
+            *pp = p->expired_next;
+            break;
+        }
+}
+
+/* A job whose TTL passed before it started, or -1 */
+int next_expired_job()
+{
+    struct Job *p;
+
+    while (first_expired != 0)
+    {
+        p = first_expired;
+        first_expired = p->expired_next;
+        if (p->state == QUEUED || p->state == DELAYED)
+            return p->jobid;
+    }
+    return -1;
+}
+
+/* A job from the ring that could not be run. It ends with an error,
+ * giving back its slots. */
+void s_ring_failed(int jobid, const char *why)
+{
+    struct Job *p;
+    struct Result r;
+
+    p = findjob(jobid);
+    if (p == 0)
+        return;
+
+    warning("The job %i could not run: %s", jobid, why);
+    pinfo_addinfo(&p->info, strlen(why) + 100, "Not run: %s\n", why);
+    /* It ends as it starts */
+    pinfo_set_start_time(&p->info);
+
+    memset(&r, 0, sizeof(r));
+    r.errorlevel = -1;
+    job_finished(&r, jobid);
+    /* For the dependencies */
+    check_notify_list(jobid);
+}
+
+/* The runner of a job from the ring did not attach: it could not be run,
+ * or it died before */
+static void fire_attach(struct Timer *t)
+{
+    struct Job *p = (struct Job *) t->data;
+
+    if (p->state == RUNNING && p->pid == 0)
+        s_ring_failed(p->jobid, "its runner did not attach");
+}
+
+/* The delay of a DELAYED job is over */
+static void fire_delay(struct Timer *t)
+{
+    struct Job *p = (struct Job *) t->data;
+
+    if (p->state == DELAYED)
+        set_state(p, QUEUED);
+}
+
+void s_set_default_timeout(int seconds)
+{
+    default_timeout = seconds;
+}
+
+static int get_timeout_grace()
+{
+    const char *str;
+    int grace;
+
+    str = getenv("TS_TIMEOUT_GRACE");
+    if (str == NULL)
+        return 10;
+    grace = parse_duration(str);
+    if (grace < 0)
+    {
+        warning("Wrong TS_TIMEOUT_GRACE value \"%s\"", str);
+        return 10;
+    }
+    return grace;
+}
+
+/* The job ran out of its time. First we ask it to finish (SIGTERM to
+ * its process group), and if it still runs after the grace period, we
+ * kill it. The client will send the ENDJOB as usual. */
+static void fire_timeout(struct Timer *t)
+{
+    struct Job *p = (struct Job *) t->data;
+
+    if (p->state != RUNNING || p->pid <= 0)
+        return;
+
+    if (!p->timed_out)
+    {
+        int grace = get_timeout_grace();
+
+        p->timed_out = 1;
+        pinfo_addinfo(&p->info, 100, "Timed out after %is: sending SIGTERM\n",
+                p->timeout);
+        if (kill(-p->pid, SIGTERM) == -1)
+            warning("Cannot send SIGTERM to the job %i, pgid %i", p->jobid,
+                    p->pid);
+        /* And its backup copy, that would not win after the time */
+        if (p->backup_pid > 0)
+            kill(-p->backup_pid, SIGTERM);
+        timer_add(t, (unsigned long) grace * 1000);
+    } else
+    {
+        pinfo_addinfo(&p->info, 100, "Still running after the grace time:"
+                " sending SIGKILL\n");
+        if (kill(-p->pid, SIGKILL) == -1)
+            warning("Cannot send SIGKILL to the job %i, pgid %i", p->jobid,
+                    p->pid);
+        if (p->backup_pid > 0)
+            kill(-p->backup_pid, SIGKILL);
+    }
+}
+
+/* The jobs due for a backup copy that did not start yet. Only those, so
+ * the server does not look through the queue on each loop. */
+static struct Job *first_hedge_due = 0;
+
+/* The job runs longer than most of its runs */
+static void fire_hedge(struct Timer *t)
+{
+    struct Job *p = (struct Job *) t->data;
+
+    if (p->state == RUNNING)
+    {
+        p->hedge_due = 1;
+        p->hedge_next = first_hedge_due;
+        first_hedge_due = p;
+    }
+}
+
+/* Out of the list of those due */
+static void hedge_not_due(struct Job *p)
+{
+    struct Job **pp;
+
+    for (pp = &first_hedge_due; *pp != 0; pp = &(*pp)->hedge_next)
+        if (*pp == p)
+        {
+            *pp = p->hedge_next;
+            break;
+        }
+}
+
+/* The backup copy ended, or it never started */
+static void hedge_end(struct Job *p)
+{
+    timer_del(&p->hedge_timer);
+    if (p->hedge_due && !p->hedged)
+        hedge_not_due(p);
+    if (p->hedged)
+        use_slots(p, -p->num_slots);
+    p->hedged = 0;
+    p->hedge_due = 0;
+    p->backup_pid = 0;
+}
+
+/* A job running past its percentile, to start a backup copy of it in the
+ * idle slots, that it takes. Returns -1 if there is none. */
+int next_hedge_job()
+{
+    struct Job *p;
+
+    if (first_hedge_due == 0 || busy_slots >= max_slots)
+        return -1;
+
+    for (p = first_hedge_due; p != 0; p = p->hedge_next)
+    {
+        if (p->state != RUNNING || p->pid <= 0)
+            continue;
+        if (slots_free_for(p) < p->num_slots)
+            continue;
+
+        hedge_not_due(p);
+        p->hedged = 1;
+        use_slots(p, p->num_slots);
+        pinfo_addinfo(&p->info, 100, "Backup copy started after %.2fs\n",
+                pinfo_time_until_now(&p->info));
         return p->jobid;
     }
+
     return -1;
 }
 
-const char * jstate2string(enum Jobstate s)
+/* Stops a running job, giving back its slots until resume_job() */
+static void preempt_job(struct Job *p)
+{
+    if (kill(-p->pid, SIGSTOP) == -1)
+    {
+        warning("Cannot send SIGSTOP to the job %i, pgid %i", p->jobid,
+                p->pid);
+        return;
+    }
+    set_state(p, PREEMPTED);
+    use_slots(p, -p->num_slots);
+    ++p->preemptions;
+    /* The timeout counts only the run time */
+    timer_del(&p->timeout_timer);
+    pinfo_suspend(&p->info);
+}
+
+static void resume_job(struct Job *p)
+{
+    if (kill(-p->pid, SIGCONT) == -1)
+        warning("Cannot send SIGCONT to the job %i, pgid %i", p->jobid,
+                p->pid);
+    set_state(p, RUNNING);
+    use_slots(p, p->num_slots);
+    pinfo_resume(&p->info);
+
+    if (p->timed_out)
+        timer_add(&p->timeout_timer,
+                (unsigned long) get_timeout_grace() * 1000);
+    else if (p->timeout > 0)
+    {
+        float left = p->timeout - pinfo_time_until_now(&p->info);
+        if (left < 0)
+            left = 0;
+        timer_add(&p->timeout_timer, (unsigned long) (left * 1000));
+    }
+}
+
+/* Whether a running job may be stopped for the job p. Not a gang member:
+ * the rest of its gang would go on without it. */
+static int can_preempt(const struct Job *victim, const struct Job *p)
+{
+    return victim->state == RUNNING && victim->pid > 0
+        && !victim->timed_out && !victim->hedged && victim->gang == 0
+        && victim->priority < p->priority;
+}
+
+/* Stops running jobs of lower priority than p, to free the slots it needs
+ * beyond the free ones. The lowest priority first, and among them the
+ * last started, as it lost less by waiting. Nothing is stopped if it
+ * would not be enough. Returns the slots freed. */
+static int preempt_for(struct Job *p, int needed)
+{
+    struct Job *r;
+    int available = 0;
+    int freed = 0;
+
+    for (r = firstjob; r != 0; r = r->next)
+        if (can_preempt(r, p))
+            available += r->num_slots;
+    if (available < needed)
+        return 0;
+
+    while (freed < needed)
+    {
+        struct Job *victim = 0;
+
+        for (r = firstjob; r != 0; r = r->next)
+        {
+            if (!can_preempt(r, p))
+                continue;
+            if (victim == 0 || r->priority < victim->priority
+                    || (r->priority == victim->priority
+                        && r->info.start_time.tv_sec
+                            > victim->info.start_time.tv_sec))
+                victim = r;
+        }
+        if (victim == 0)
+            break;
+
+        preempt_job(victim);
+        if (victim->state != PREEMPTED)
+            break; /* It could not be stopped */
+        pinfo_addinfo(&victim->info, 100, "Preempted by job %i\n", p->jobid);
+        freed += victim->num_slots;
+    }
+
+    return freed;
+}
+
+/* The server ends: the preempted jobs go on, as the running ones do,
+ * instead of staying stopped with nobody to resume them */
+void s_continue_preempted()
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (p->state == PREEMPTED && p->pid > 0)
+            kill(-p->pid, SIGCONT);
+}
+
+/* Resumes the preempted jobs that fit in the free slots, unless they would
+ * take the slots of the waiting job of higher priority, 'top'. */
+static void resume_preempted(const struct Job *top)
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+    {
+        int keep = 0;
+
+        if (p->state != PREEMPTED)
+            continue;
+        if (top != 0 && top->priority > p->priority)
+            keep = top->num_slots;
+        if (slots_free_for(p) - p->num_slots >= keep)
+            resume_job(p);
+    }
+}
+
+/* Whether the job waits for an unfinished job it depends on */
+static int depend_pending(const struct Job *p)
+{
+    struct Job *do_depend_job;
+
+    if (p->depend_on < 0)
+        return 0;
+
+    do_depend_job = get_job(p->depend_on);
+    return do_depend_job != NULL &&
+        (do_depend_job->state == QUEUED
+         || do_depend_job->state == RUNNING
+         || do_depend_job->state == PREEMPTED
+         || do_depend_job->state == DELAYED);
+}
+
+/* For the quotas: whether the queued job only waits for slots */
+static int depend_ready(const struct Job *p)
+{
+    return !depend_pending(p);
+}
+
+/* The queued job of highest priority, among those over the default one,
+ * that does not wait for a dependency. The first in the queue if many. */
+static struct Job * priority_candidate()
+{
+    struct Job *p;
+    struct Job *best = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+    {
+        if (p->state != QUEUED || p->priority <= 0)
+            continue;
+        if (best != 0 && p->priority <= best->priority)
+            continue;
+        if (depend_pending(p))
+            continue;
+        best = p;
+    }
+
+    return best;
+}
+
+/* Whether the job is in the list asked */
+static int list_match(const struct List_query *q, const char *label,
+        const struct Job *p)
+{
+    if (p->state == HOLDING_CLIENT)
+        return 0;
+    if (q->states != 0 && !(q->states & (1 << p->state)))
+        return 0;
+    if (q->jobid_range && (p->jobid < q->jobid_min || p->jobid > q->jobid_max))
+        return 0;
+    if (q->elevel != ELEVEL_ANY)
+    {
+        if (p->state != FINISHED)
+            return 0;
+        if (q->elevel == ELEVEL_EQUAL
+                && (p->result.died_by_signal
+                    || p->result.errorlevel != q->errorlevel))
+            return 0;
+        if (q->elevel == ELEVEL_FAILED && !p->result.died_by_signal
+                && p->result.errorlevel == 0)
+            return 0;
+    }
+    if (label != 0 && (p->label == 0 || fnmatch(label, p->label, 0) != 0))
+        return 0;
+    return 1;
+}
+
+/* Only by state, the counters have the answer */
+static int list_count(const struct List_query *q, const char *label)
+{
+    struct Job *p;
+    int count = 0;
+
+    if (!q->jobid_range && q->elevel == ELEVEL_ANY && label == 0)
+    {
+        int state;
+
+        for (state = QUEUED; state <= EXPIRED; ++state)
+            if (state != HOLDING_CLIENT
+                    && (q->states == 0 || (q->states & (1 << state))))
+                count += state_count[state];
+        return count;
+    }
+
+    for (p = firstjob; p != 0; p = p->next)
+        count += list_match(q, label, p);
+    for (p = first_finished_job; p != 0; p = p->next)
+        count += list_match(q, label, p);
+    return count;
+}
+
+static double job_runtime(const struct Job *p)
+{
+    if (p->state == FINISHED)
+        return p->result.real_ms;
+    if (p->state == RUNNING)
+        return pinfo_time_until_now(&p->info);
+    return 0;
+}
+
+static const struct List_query *sort_query;
+
+static int compare_jobs(const void *a, const void *b)
 {
-    const char * jobstate;
-    switch(s)
+    const struct Job *p1 = *(const struct Job **) a;
+    const struct Job *p2 = *(const struct Job **) b;
+    int res = 0;
+
+    switch(sort_query->sort)
     {
-        case QUEUED:
-            jobstate = "queued";
+        case SORT_STATE:
+            res = (int) p1->state - (int) p2->state;
             break;
-        case RUNNING:
-            jobstate = "running";
+        case SORT_LABEL:
+            res = strcmp(p1->label ? p1->label : "",
+                    p2->label ? p2->label : "");
             break;
-        case FINISHED:
-            jobstate = "finished";
+        case SORT_ELEVEL:
+            /* The jobs not finished go first */
+            res = (p1->state == FINISHED ? p1->result.errorlevel : -1)
+                - (p2->state == FINISHED ? p2->result.errorlevel : -1);
             break;
-        case SKIPPED:
-            jobstate = "skipped";
+        case SORT_RUNTIME:
+            if (job_runtime(p1) != job_runtime(p2))
+                res = job_runtime(p1) < job_runtime(p2) ? -1 : 1;
             break;
-        case HOLDING_CLIENT:
-            jobstate = "skipped";
+        case SORT_ENQUEUE:
+            if (p1->info.enqueue_time.tv_sec != p2->info.enqueue_time.tv_sec)
+                res = p1->info.enqueue_time.tv_sec
+                    < p2->info.enqueue_time.tv_sec ? -1 : 1;
+            break;
+        default:
             break;
     }
-    return jobstate;
+    if (res == 0)
+        res = p1->jobid - p2->jobid;
+    return sort_query->reverse ? -res : res;
 }
 
-void s_list(int s)
+/* The matching jobs sorted, in an array to free */
+static struct Job ** list_sorted(const struct List_query *q, const char *label,
+        int *num)
+{
+    struct Job **jobs;
+    struct Job *p;
+    int n = 0;
+
+    jobs = (struct Job **) malloc((list_count(q, label) + 1) * sizeof(*jobs));
+    if (jobs == 0)
+        error("Cannot allocate the list to sort");
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (list_match(q, label, p))
+            jobs[n++] = p;
+    for (p = first_finished_job; p != 0; p = p->next)
+        if (list_match(q, label, p))
+            jobs[n++] = p;
+
+    sort_query = q;
+    qsort(jobs, n, sizeof(*jobs), compare_jobs);
+    *num = n;
+    return jobs;
+}
+
+/* Sends the line of the job, if within the page. Returns 0 after the page. */
+static int list_page_line(int s, const struct List_query *q, int *index,
+        const struct Job *p)
+{
+    int i = (*index)++;
+
+    if (i < q->offset)
+        return 1;
+    if (q->limit > 0 && i >= q->offset + q->limit)
+        return 0;
+
+    if (q->format == FORMAT_JSON)
+    {
+        if (i > q->offset)
+            send_list_line(s, ",\n");
+        send_list_line(s, joblist_json(p, 0));
+    } else if (q->format == FORMAT_BINARY)
+    {
+        int size;
+        const char *record = joblist_binary(p, &size);
+        list_add(record, size);
+    } else
+        send_list_line(s, joblist_line(p));
+    return 1;
+}
+
+void s_list(int s, const struct List_query *q, const char *label)
 {
     struct Job *p;
     char *buffer;
+    time_t now;
+    int index = 0;
 
-    /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/ 
-    buffer = joblist_headers();
-    send_list_line(s,buffer);
-    free(buffer);
+    list_begin(s);
 
-    /* Show Queued or Running jobs */
-    p = firstjob;
-    while(p != 0)
+    if (q->count)
     {
-        if (p->state != HOLDING_CLIENT)
+        char tmp[50];
+        int count = list_count(q, label);
+
+        if (q->format == FORMAT_BINARY)
+            list_add((const char *) &count, sizeof(count));
+        else
         {
-            buffer = joblist_line(p);
-            send_list_line(s,buffer);
-            free(buffer);
+            sprintf(tmp, q->format == FORMAT_JSON ? "{\"count\":%i}\n"
+                    : "%i\n", count);
+            send_list_line(s, tmp);
         }
-        p = p->next;
+        list_end();
+        return;
     }
 
-    p = first_finished_job;
-
-    /* Show Finished jobs */
-    while(p != 0)
+    if (q->format == FORMAT_JSON)
+        send_list_line(s, "[\n");
+    else if (q->format == FORMAT_TEXT)
     {
-        buffer = joblist_line(p);
+        /* Times:   0.00/0.00/0.00 - 4+4+4+2 = 14*/ 
+        buffer = joblist_headers();
         send_list_line(s,buffer);
         free(buffer);
-        p = p->next;
     }
+
+    if (q->sort != SORT_NONE)
+    {
+        struct Job **jobs;
+        int num, i;
+
+        jobs = list_sorted(q, label, &num);
+        for (i = 0; i < num; ++i)
+            if (!list_page_line(s, q, &index, jobs[i]))
+                break;
+        free(jobs);
+    } else
+    {
+        /* Show Queued or Running jobs, and then the finished ones */
+        for (p = firstjob; p != 0; p = p->next)
+            if (list_match(q, label, p)
+                    && !list_page_line(s, q, &index, p))
+                break;
+        if (p == 0)
+            for (p = first_finished_job; p != 0; p = p->next)
+                if (list_match(q, label, p)
+                        && !list_page_line(s, q, &index, p))
+                    break;
+    }
+
+    if (q->format == FORMAT_JSON)
+        send_list_line(s, index > q->offset ? "\n]\n" : "]\n");
+
+    /* Warn about the deadlines at risk, in the full list */
+    now = time(NULL);
+    if (q->format == FORMAT_TEXT && q->states == 0 && !q->jobid_range && q->elevel == ELEVEL_ANY
+            && label == 0 && q->limit == 0 && q->offset == 0)
+        for (p = firstjob; p != 0; p = p->next)
+            if (edf_will_miss(p, now))
+            {
+                char tmp[100];
+                sprintf(tmp, "Warning: job %i may miss its deadline, %s",
+                        p->jobid, ctime(&p->deadline));
+                send_list_line(s, tmp);
+            }
+
+    list_end();
+}
+
+/* The slots in the status page, after each loop of the server. The counts
+ * by state go with each change of state. */
+void s_update_status()
+{
+    status_slots(busy_slots, max_slots);
+}
+
+/* The jobs as they are now, to a new subscriber, in the order of the list */
+void s_snapshot(int s)
+{
+    struct Job *p;
+
+    for (p = firstjob; p != 0; p = p->next)
+        event_job(s, EV_SNAPSHOT, p);
+    for (p = first_finished_job; p != 0; p = p->next)
+        event_job(s, EV_SNAPSHOT, p);
+    event_count(s, EV_SNAPSHOT_END, max_slots);
+}
+
+/* Frees the job and all it holds, once out of the lists */
+static void free_job(struct Job *p)
+{
+    fs_job_gone(p);
+    free(p->memo_key);
+    free(p->notify_errorlevel_to);
+    free(p->command);
+    free(p->output_filename);
+    pinfo_free(&p->info);
+    free(p->label);
+    free(p);
 }
 
 static struct Job * newjobptr()
@@ -263,17 +1325,16 @@ static struct Job * newjobptr()
         firstjob->next = 0;
         firstjob->output_filename = 0;
         firstjob->command = 0;
+        lastjob = firstjob;
         return firstjob;
     }
 
-    p = firstjob;
-    while(p->next != 0)
-        p = p->next;
-
+    p = lastjob;
     p->next = (struct Job *) malloc(sizeof(*p));
     p->next->next = 0;
     p->next->output_filename = 0;
     p->next->command = 0;
+    lastjob = p->next;
 
     return p->next;
 }
@@ -313,7 +1374,26 @@ static int find_last_stored_jobid_finished()
     return last_jobid;
 }
 
-/* Returns job id or -1 on error */
+/* The parts of a job from the ring, instead of the socket */
+static const char *ring_data;
+
+static int newjob_recv(int s, char *buf, int size)
+{
+    if (s != -1)
+        return recv_bytes(s, buf, size);
+    memcpy(buf, ring_data, size);
+    ring_data += size;
+    return size;
+}
+
+/* A job from the ring, that has its parts in data. ring.c checked them. */
+int s_newjob_ring(struct msg *m, const char *data)
+{
+    ring_data = data;
+    return s_newjob(-1, m);
+}
+
+/* Returns job id or -1 on error. The socket is -1 for a job from the ring. */
 int s_newjob(int s, struct msg *m)
 {
     struct Job *p;
@@ -322,11 +1402,49 @@ int s_newjob(int s, struct msg *m)
     p = newjobptr();
 
     p->jobid = jobids++;
-    if (count_not_finished_jobs() < max_jobs)
-        p->state = QUEUED;
+    p->ring_argc = s == -1 ? m->u.newjob.argc : 0;
+    /* Not counting itself */
+    if (s == -1 || count_not_finished_jobs() - ring_queued + 1 < max_jobs)
+        p->state = m->u.newjob.delay > 0 ? DELAYED : QUEUED;
     else
         p->state = HOLDING_CLIENT;
     p->num_slots = m->u.newjob.num_slots;
+    p->mem_peak = m->u.newjob.mem_peak;
+    p->defer = DEFER_NONE;
+    p->timeout = m->u.newjob.timeout;
+    if (p->timeout == 0)
+        p->timeout = default_timeout;
+    p->timed_out = 0;
+    timer_init(&p->timeout_timer, fire_timeout, p);
+    p->retries = m->u.newjob.retries;
+    p->backoff_min = m->u.newjob.backoff_min;
+    p->backoff_max = m->u.newjob.backoff_max;
+    p->attempts = 0;
+    timer_init(&p->delay_timer, fire_delay, p);
+    p->hedge = m->u.newjob.hedge;
+    p->hedge_due = 0;
+    p->hedged = 0;
+    p->backup_pid = 0;
+    timer_init(&p->hedge_timer, fire_hedge, p);
+    p->hedge_next = 0;
+    p->expires = 0;
+    p->expired = 0;
+    timer_init(&p->ttl_timer, fire_ttl, p);
+    p->expired_next = 0;
+    timer_init(&p->attach_timer, fire_attach, p);
+    p->interactive = m->u.newjob.interactive;
+    p->interactive_next = 0;
+    p->uid = s == -1 ? (int) getuid() : fs_peer_uid(s);
+    p->pid = 0;
+    p->waiters = 0;
+    p->status_index = -1;
+    p->flow = 0;
+    p->delayed_until = 0;
+    if (m->u.newjob.delay > 0)
+    {
+        p->delayed_until = time(NULL) + m->u.newjob.delay;
+        timer_add(&p->delay_timer, (unsigned long) m->u.newjob.delay * 1000);
+    }
     p->store_output = m->u.newjob.store_output;
     p->should_keep_finished = m->u.newjob.should_keep_finished;
     p->notify_errorlevel_to = 0;
@@ -425,7 +1543,7 @@ int s_newjob(int s, struct msg *m)
     if (p->command == 0)
         error("Cannot allocate memory in s_newjob command_size (%i)",
                 m->u.newjob.command_size);
-    res = recv_bytes(s, p->command, m->u.newjob.command_size);
+    res = newjob_recv(s, p->command, m->u.newjob.command_size);
     if (res == -1)
         error("wrong bytes received");
 
@@ -438,11 +1556,27 @@ int s_newjob(int s, struct msg *m)
         if (ptr == 0)
             error("Cannot allocate memory in s_newjob env_size(%i)",
                     m->u.newjob.env_size);
-        res = recv_bytes(s, ptr, m->u.newjob.label_size);
+        res = newjob_recv(s, ptr, m->u.newjob.label_size);
         if (res == -1)
             error("wrong bytes received");
         p->label = ptr;
     }
+    p->flow = fs_job_flow(p->uid, p->label);
+
+    p->priority = m->u.newjob.priority;
+    p->preemptions = 0;
+    p->gang = 0;
+    p->gang_torn = 0;
+    p->quota = 0;
+    p->unique_key = 0;
+    p->unique_indexed = 0;
+    p->unique_next = 0;
+    p->memo_key = 0;
+    p->deadline = 0;
+    p->estimate = edf_estimate(p);
+    p->heap_index = -1;
+    if (m->u.newjob.deadline > 0)
+        p->deadline = time(NULL) + m->u.newjob.deadline;
 
     /* load the info */
     if (m->u.newjob.env_size > 0)
@@ -452,7 +1586,7 @@ int s_newjob(int s, struct msg *m)
         if (ptr == 0)
             error("Cannot allocate memory in s_newjob env_size(%i)",
                     m->u.newjob.env_size);
-        res = recv_bytes(s, ptr, m->u.newjob.env_size);
+        res = newjob_recv(s, ptr, m->u.newjob.env_size);
         if (res == -1)
             error("wrong bytes received");
         pinfo_addinfo(&p->info, m->u.newjob.env_size+100,
@@ -460,54 +1594,380 @@ int s_newjob(int s, struct msg *m)
         free(ptr);
     }
 
+    /* join the gang */
+    if (m->u.newjob.gang_name_size > 0)
+    {
+        char *ptr;
+        ptr = (char *) malloc(m->u.newjob.gang_name_size);
+        if (ptr == 0)
+            error("Cannot allocate memory in s_newjob gang_name_size(%i)",
+                    m->u.newjob.gang_name_size);
+        res = newjob_recv(s, ptr, m->u.newjob.gang_name_size);
+        if (res == -1)
+            error("wrong bytes received");
+        p->gang = gang_join(ptr, m->u.newjob.gang_size,
+                m->u.newjob.gang_teardown);
+        free(ptr);
+    }
+
+    /* find the queue */
+    if (m->u.newjob.queue_name_size > 0)
+    {
+        char *ptr;
+        ptr = (char *) malloc(m->u.newjob.queue_name_size);
+        if (ptr == 0)
+            error("Cannot allocate memory in s_newjob queue_name_size(%i)",
+                    m->u.newjob.queue_name_size);
+        res = newjob_recv(s, ptr, m->u.newjob.queue_name_size);
+        if (res == -1)
+            error("wrong bytes received");
+        p->quota = quota_find(ptr);
+        free(ptr);
+    }
+
+    /* The TTL, or the default of its queue */
+    {
+        int ttl = m->u.newjob.ttl;
+
+        if (ttl == 0)
+            ttl = quota_ttl(p->quota);
+        if (ttl > 0)
+        {
+            p->expires = time(NULL) + ttl;
+            timer_add(&p->ttl_timer, (unsigned long) ttl * 1000);
+        }
+    }
+
+    /* get the unique key */
+    if (m->u.newjob.unique != UNIQUE_NONE)
+    {
+        char *ptr = 0;
+        if (m->u.newjob.unique_key_size > 0)
+        {
+            ptr = (char *) malloc(m->u.newjob.unique_key_size);
+            if (ptr == 0)
+                error("Cannot allocate memory in s_newjob unique_key_size(%i)",
+                        m->u.newjob.unique_key_size);
+            res = newjob_recv(s, ptr, m->u.newjob.unique_key_size);
+            if (res == -1)
+                error("wrong bytes received");
+        }
+        unique_set_key(p, ptr);
+        free(ptr);
+    }
+
+    /* get the memo key */
+    if (m->u.newjob.memo_key_size > 0)
+    {
+        p->memo_key = (char *) malloc(m->u.newjob.memo_key_size);
+        if (p->memo_key == 0)
+            error("Cannot allocate memory in s_newjob memo_key_size(%i)",
+                    m->u.newjob.memo_key_size);
+        res = newjob_recv(s, p->memo_key, m->u.newjob.memo_key_size);
+        if (res == -1)
+            error("wrong bytes received");
+    }
+
+    count_state(p, 1);
+    edf_queue(p);
+    status_job(p, state_count);
+    event_job(-1, EV_ENQUEUED, p);
+
     return p->jobid;
 }
 
+/* The argv of a job from the ring, after its command. 0 if from a client. */
+const char * s_ring_argv(int jobid, int *argc)
+{
+    struct Job *p = findjob(jobid);
+
+    if (p == 0 || p->ring_argc == 0)
+        return 0;
+    *argc = p->ring_argc;
+    return p->command + strlen(p->command) + 1;
+}
+
+/* The runner of a job from the ring was spawned. If it does not attach in
+ * time, the job ends. */
+void s_ring_wait_attach(int jobid)
+{
+    struct Job *p = findjob(jobid);
+
+    if (p != 0)
+        timer_add(&p->attach_timer, (unsigned long) RING_ATTACH_WAIT * 1000);
+}
+
+/* The runner of a job from the ring attaches to it. Returns 0 if the job
+ * does not wait for one. */
+int s_ring_attach(int jobid)
+{
+    struct Job *p = findjob(jobid);
+
+    if (p == 0 || p->ring_argc == 0 || p->state != RUNNING || p->pid != 0
+            || !timer_pending(&p->attach_timer))
+        return 0;
+    timer_del(&p->attach_timer);
+    return 1;
+}
+
+/* The job leaves the queue, to end or to go away: out of its timers and of
+ * the indexes of the scheduler. Whatever holds a queued job goes here. */
+static void job_leave_queue(struct Job *p)
+{
+    timer_del(&p->timeout_timer);
+    timer_del(&p->delay_timer);
+    timer_del(&p->ttl_timer);
+    expired_remove(p);
+    timer_del(&p->attach_timer);
+    hedge_end(p);
+    edf_remove(p);
+    unique_remove(p);
+}
+
 /* This assumes the jobid exists */
 void s_removejob(int jobid)
 {
     struct Job *p;
-    struct Job *newnext;
+    struct Job *prev = 0;
+
+    for (p = firstjob; p != 0 && p->jobid != jobid; p = p->next)
+        prev = p;
+    if (p == 0)
+        error("Job to be removed not found. jobid=%i", jobid);
+
+    event_job(-1, EV_REMOVED, p);
+    uncount_job(p);
+    job_leave_queue(p);
+    gang_leave(p);
+
+    if (prev == 0)
+        firstjob = p->next;
+    else
+        prev->next = p->next;
+    if (lastjob == p)
+        lastjob = prev;
+    edf_queue_dependents(p);
+    free_job(p);
+}
 
-    if (firstjob->jobid == jobid)
+/* Checks the peak memory declared by p against what the host has free.
+ * The headroom is computed once per pass (*known == -1 means not yet), as
+ * it needs reading /proc. Sets p->defer if it cannot start. */
+static int job_mem_admissible(struct Job *p, int *headroom, int *known)
+{
+    if (*known == -1)
     {
-        struct Job *newfirst;
+        struct Job *r;
+
+        *known = mem_get_headroom(headroom);
+        /* The running jobs may not have reached their peak yet */
+        if (*known)
+            for (r = firstjob; r != 0; r = r->next)
+                if (r->state == RUNNING || r->state == PREEMPTED)
+                    *headroom -= mem_outstanding_kb(r);
+    }
 
-        /* First job is to be removed */
-        newfirst = firstjob->next;
-        free(firstjob->command);
-        free(firstjob->output_filename);
-        pinfo_free(&firstjob->info);
-        free(firstjob->label);
-        free(firstjob);
-        firstjob = newfirst;
-        return;
+    /* Without data, we cannot take any decision */
+    if (!*known)
+        return 1;
+
+    if (p->mem_peak > *headroom)
+    {
+        if (p->mem_peak > 0)
+            p->defer = DEFER_MEMORY;
+        else
+            p->defer = DEFER_MEMPRESSURE;
+        return 0;
     }
 
-    p = firstjob;
-    /* Not first job */
-    while (p->next != 0)
+    return 1;
+}
+
+/* Takes what the job needs to run, and returns its jobid */
+static int take_job(struct Job *p)
+{
+    edf_remove(p);
+    rate_consume(p->label);
+    use_slots(p, p->num_slots);
+    return p->jobid;
+}
+
+/* Whether the queued job p could start now, leaving its gang apart.
+ * Returns -1 if no job can. The headroom is for job_mem_admissible(). */
+static int job_can_start(struct Job *p, int free_slots, int *headroom,
+        int *headroom_known)
+{
+    p->defer = DEFER_NONE;
+
+    if (p->state != QUEUED)
+        return 0;
+
+    /* We won't try to run any job do_depending on an unfinished
+     * job */
+    if (depend_pending(p))
+        return 0;
+
+    /* The batch jobs leave the reserved slots to the interactive ones */
+    if (!p->interactive)
+        free_slots -= reserved_idle();
+    if (free_slots < p->num_slots)
+        return 0;
+
+    if (!quota_admissible(p, free_slots))
     {
-        if (p->next->jobid == jobid)
-            break;
-        p = p->next;
+        p->defer = DEFER_QUOTA;
+        return 0;
     }
-    if (p->next == 0)
-        error("Job to be removed not found. jobid=%i", jobid);
 
-    newnext = p->next->next;
+    /* The limits arm their timer to retry */
+    p->defer = rate_admissible(p->label);
+    if (p->defer == DEFER_RATE)
+        return -1; /* No job can start */
+    if (p->defer != DEFER_NONE)
+        return 0;
+
+    if (!job_mem_admissible(p, headroom, headroom_known))
+    {
+        retry_deferred_later();
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Whether the queued job p can start now. Returns -1 if no job can.
+ * The members of a gang only start all together, from start_gang(). */
+static int job_runnable(struct Job *p, int free_slots, int *headroom,
+        int *headroom_known)
+{
+    int res;
+
+    res = job_can_start(p, free_slots, headroom, headroom_known);
+    if (res == 1 && p->gang != 0)
+    {
+        p->defer = DEFER_GANG;
+        return 0;
+    }
+    return res;
+}
+
+/* Starts the first gang whose members can all start now, taking their
+ * slots at once. Returns the jobid of the first of them, or -1.
+ * If a gang only lacks free slots, *free_slots gets 0, so the smaller jobs
+ * don't take the slots it waits for. */
+static int start_gang(int *free_slots, int *headroom, int *headroom_known)
+{
+    static unsigned int pass = 0;
+    struct Job *p, *r;
+
+    ++pass;
+    for (p = firstjob; p != 0; p = p->next)
+    {
+        struct Gang *g = p->gang;
+        int slots = 0;
+        int mem = 0; /* Taken from the headroom by the members */
+        int ready = 1;
+        int res;
+
+        if (g == 0 || p->state != QUEUED || gang_started(g)
+                || !gang_complete(g) || !gang_first_visit(g, pass))
+            continue;
+
+        for (r = p; r != 0; r = r->next)
+        {
+            if (r->gang != g)
+                continue;
+            res = job_can_start(r, max_slots, headroom, headroom_known);
+            if (res == -1)
+            {
+                *headroom += mem;
+                return -1;
+            }
+            if (res == 0)
+                ready = 0;
+            else if (*headroom_known == 1)
+            {
+                /* The next members get what this one leaves */
+                *headroom -= r->mem_peak;
+                mem += r->mem_peak;
+            }
+            slots += r->num_slots;
+        }
+
+        if (ready && slots <= *free_slots
+                - (p->interactive ? 0 : reserved_idle()))
+        {
+            for (r = p; r != 0; r = r->next)
+                if (r->gang == g)
+                    take_job(r);
+            gang_start(g, p);
+            return gang_next_dispatch();
+        }
+
+        *headroom += mem;
+        for (r = p; r != 0; r = r->next)
+            if (r->gang == g && r->defer == DEFER_NONE)
+                r->defer = DEFER_GANG;
+
+        if (ready && slots <= max_slots)
+        {
+            *free_slots = 0;
+            return -1;
+        }
+    }
 
-    free(p->next->command);
-    free(p->next);
-    p->next = newnext;
+    return -1;
 }
 
-/* -1 if no one should be run. */
+/* -1 if no one should be run.
+ * The queued job of highest priority goes first, stopping running jobs of
+ * lower priority if it needs their slots. Then the gangs complete, all
+ * their members at once. Then the jobs with a deadline,
+ * by least slack. For the rest: without
+ * fair share, the first runnable job in the queue runs. With it, the first
+ * runnable job of every flow is a candidate, and fs_pick() chooses among
+ * them. */
 int next_run_job()
 {
     struct Job *p;
+    int headroom;
+    int headroom_known = -1;
+    int res;
+    int free_slots;
+
+    /* The rest of a gang just started */
+    res = gang_next_dispatch();
+    if (res != -1)
+        return res;
+
+    /* If there are no jobs to run... */
+    if (firstjob == 0)
+        return -1;
+
+    quota_begin_pass(firstjob, depend_ready);
+
+    p = priority_queued > 0 ? priority_candidate() : 0;
+    if (state_count[PREEMPTED] > 0)
+        resume_preempted(p);
+    free_slots = max_slots - busy_slots;
 
-    const int free_slots = max_slots - busy_slots;
+    if (p != 0)
+    {
+        /* Could it run, if it had the slots? */
+        res = job_runnable(p, max_slots, &headroom, &headroom_known);
+        if (res == -1)
+            return -1;
+        if (res == 1)
+        {
+            int slots = slots_free_for(p);
+
+            if (slots < p->num_slots)
+                slots += preempt_for(p, p->num_slots - slots);
+            if (slots >= p->num_slots)
+                return take_job(p);
+            free_slots = max_slots - busy_slots;
+        }
+    }
 
     /* busy_slots may be bigger than the maximum slots,
      * if the user was running many jobs, and suddenly
@@ -515,39 +1975,76 @@ int next_run_job()
     if (free_slots <= 0)
         return -1;
 
-    /* If there are no jobs to run... */
-    if (firstjob == 0)
+    /* The interactive jobs go first, in any free slot */
+    if (interactive_unsorted)
+        interactive_sort();
+    for (p = first_interactive; p != 0; p = p->interactive_next)
+    {
+        res = job_runnable(p, free_slots, &headroom, &headroom_known);
+        if (res == -1)
+            return -1;
+        if (res == 1)
+            return take_job(p);
+    }
+
+    res = start_gang(&free_slots, &headroom, &headroom_known);
+    if (res != -1 || free_slots <= 0)
+        return res;
+
+    while ((p = edf_first()) != 0)
+    {
+        res = job_runnable(p, free_slots, &headroom, &headroom_known);
+        if (res == 1)
+            break;
+        edf_set_aside(p);
+        if (res == -1)
+            break;
+    }
+    edf_put_back();
+    if (p != 0 && res == 1)
+        return take_job(p);
+    if (p != 0)
         return -1;
 
+    if (fs_enabled())
+        fs_begin_pass();
+
     /* Look for a runnable task */
     p = firstjob;
     while(p != 0)
     {
-        if (p->state == QUEUED)
+        /* Those with deadline were already considered */
+        if (p->state != QUEUED || p->deadline != 0)
         {
-            if (p->depend_on >= 0)
-            {
-                struct Job *do_depend_job = get_job(p->depend_on);
-                /* We won't try to run any job do_depending on an unfinished
-                 * job */
-                if (do_depend_job != NULL &&
-                    (do_depend_job->state == QUEUED || do_depend_job->state == RUNNING))
-                {
-                    /* Next try */
-                    p = p->next;
-                    continue;
-                }
-            }
-
-            if (free_slots >= p->num_slots)
-            {
-                busy_slots = busy_slots + p->num_slots;
-                return p->jobid;
-            }
+            p = p->next;
+            continue;
+        }
+        if (fs_enabled() && fs_has_candidate(p->flow))
+        {
+            p->defer = DEFER_NONE;
+            p = p->next;
+            continue;
+        }
+
+        res = job_runnable(p, free_slots, &headroom, &headroom_known);
+        if (res == -1)
+            return -1;
+        if (res == 1)
+        {
+            if (!fs_enabled())
+                return take_job(p);
+            fs_offer(p);
         }
         p = p->next;
     }
 
+    if (fs_enabled())
+    {
+        p = fs_pick();
+        if (p != 0)
+            return take_job(p);
+    }
+
     return -1;
 }
 
@@ -593,11 +2090,9 @@ static void new_finished_job(struct Job *j)
         struct Job *tmp;
         tmp = first_finished_job;
         first_finished_job = first_finished_job->next;
-        free(tmp->command);
-        free(tmp->output_filename);
-        pinfo_free(&tmp->info);
-        free(tmp->label);
-        free(tmp);
+        event_job(-1, EV_REMOVED, tmp);
+        uncount_job(tmp);
+        free_job(tmp);
     }
     p->next = j;
     p->next->next = 0;
@@ -627,27 +2122,10 @@ int job_is_holding_client(int jobid)
     return job_is_in_state(jobid, HOLDING_CLIENT);
 }
 
-static int in_notify_list(int jobid)
-{
-    struct Notify *n, *tmp;
-
-    n = first_notify;
-    while (n != 0)
-    {
-        tmp = n;
-        n = n->next;
-        if (tmp->jobid == jobid)
-            return 1;
-    }
-    return 0;
-}
-
 void job_finished(const struct Result *result, int jobid)
 {
     struct Job *p;
-
-    if (busy_slots <= 0)
-        error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
+    int was_running;
 
     p = findjob(jobid);
     if (p == 0)
@@ -656,19 +2134,56 @@ void job_finished(const struct Result *result, int jobid)
     /* The job may be not only in running state, but also in other states, as
      * we call this to clean up the jobs list in case of the client closing the
      * connection. */
+    was_running = (p->state == RUNNING || p->state == PREEMPTED);
     if (p->state == RUNNING)
-        busy_slots = busy_slots - p->num_slots;
+    {
+        if (busy_slots <= 0)
+            error("Wrong state in the server. busy_slots = %i instead of greater than 0", busy_slots);
+        use_slots(p, -p->num_slots);
+    }
+    else if (p->state == PREEMPTED)
+    {
+        /* Its slots were given back already. It may be still stopped, if
+         * its client went away. */
+        kill(-p->pid, SIGCONT);
+        pinfo_resume(&p->info);
+    }
+
+    job_leave_queue(p);
 
     /* Mark state */
     if (result->skipped)
-        p->state = SKIPPED;
+        set_state(p, p->expired ? EXPIRED : SKIPPED);
     else
-        p->state = FINISHED;
+        set_state(p, FINISHED);
     p->result = *result;
+    /* The client counted also the time stopped. (real_ms are seconds) */
+    p->result.real_ms -= p->info.suspended;
+    if (p->result.real_ms < 0)
+        p->result.real_ms = 0;
+    event_job(-1, EV_FINISHED, p);
     last_finished_jobid = p->jobid;
     notify_errorlevel(p);
+    edf_queue_dependents(p);
     pinfo_set_end_time(&p->info);
-
+    if (was_running)
+    {
+        fs_job_ended(p);
+        edf_job_ended(p);
+        if (p->memo_key != 0 && !result->skipped
+                && !result->died_by_signal && result->errorlevel == 0
+                && p->output_filename != 0)
+            memo_store(p->memo_key, result->errorlevel, p->output_filename,
+                    p->jobid);
+    }
+    fs_job_gone(p);
+    free(p->memo_key);
+    p->memo_key = 0;
+    gang_member_ended(p, firstjob);
+    gang_leave(p);
+
+    if (p->timed_out)
+        pinfo_addinfo(&p->info, 100, "Result: timed out\n");
     if (p->result.died_by_signal)
         pinfo_addinfo(&p->info, 100, "Exit status: killed by signal %i\n", p->result.signal);
     else
@@ -679,6 +2194,7 @@ void job_finished(const struct Result *result, int jobid)
     {
         struct Job **jpointer = 0;
         struct Job *newfirst = p->next;
+        struct Job *prev = 0;
         if (firstjob == p)
             jpointer = &firstjob;
         else
@@ -690,6 +2206,7 @@ void job_finished(const struct Result *result, int jobid)
                 if (p2->next == p)
                 {
                     jpointer = &(p2->next);
+                    prev = p2;
                     break;
                 }
                 p2 = p2->next;
@@ -697,8 +2214,12 @@ void job_finished(const struct Result *result, int jobid)
         }
 
         /* Add it to the finished queue (maybe temporarily) */
-        if (p->should_keep_finished || in_notify_list(p->jobid))
+        if (p->should_keep_finished || p->waiters != 0)
             new_finished_job(p);
+        else
+        {
+            uncount_job(p);
+        }
 
         /* Remove it from the run queue */
         if (jpointer == 0)
@@ -706,9 +2227,71 @@ void job_finished(const struct Result *result, int jobid)
                 "queue list (jobid=%i)", p->jobid);
 
         *jpointer = newfirst;
+        if (lastjob == p)
+            lastjob = prev;
     }
 }
 
+/* Seconds to wait before the next run, doubling on each failure */
+static int backoff_delay(const struct Job *p)
+{
+    int delay = p->backoff_min;
+    int i;
+
+    for (i = 1; i < p->attempts && delay < p->backoff_max; ++i)
+        delay *= 2;
+    if (delay > p->backoff_max)
+        delay = p->backoff_max;
+    return delay;
+}
+
+/* Called on ENDJOB, before job_finished(). If the run failed and the job has
+ * retries left, it goes back to the queue after the backoff delay, keeping
+ * its client connection, and we return 1. The dependencies will only know
+ * about the final result. The client follows the same rule, waiting for the
+ * next RUNJOB. */
+int s_job_retry(const struct Result *result, int jobid)
+{
+    struct Job *p;
+    int delay;
+
+    p = findjob(jobid);
+    if (p == 0 || (p->state != RUNNING && p->state != PREEMPTED))
+        return 0;
+
+    if (result->skipped || result->errorlevel == 0
+            || p->attempts > p->retries)
+        return 0;
+
+    if (p->state == RUNNING)
+        use_slots(p, -p->num_slots);
+    else
+        pinfo_resume(&p->info); /* Killed while stopped. No slots to free */
+    timer_del(&p->timeout_timer);
+    hedge_end(p);
+
+    delay = backoff_delay(p);
+    pinfo_set_end_time(&p->info);
+    fs_job_ended(p);
+    if (result->died_by_signal)
+        pinfo_addinfo(&p->info, 200, "Attempt %i failed%s (killed by signal %i)"
+                " after %.2fs. Retrying in %is\n", p->attempts,
+                p->timed_out ? ", timed out," : "",
+                result->signal, pinfo_time_run(&p->info), delay);
+    else
+        pinfo_addinfo(&p->info, 200, "Attempt %i failed%s (exit code %i)"
+                " after %.2fs. Retrying in %is\n", p->attempts,
+                p->timed_out ? ", timed out," : "",
+                result->errorlevel, pinfo_time_run(&p->info), delay);
+
+    p->timed_out = 0;
+    set_state(p, DELAYED);
+    p->delayed_until = time(NULL) + delay;
+    timer_add(&p->delay_timer, (unsigned long) delay * 1000);
+
+    return 1;
+}
+
 void s_clear_finished()
 {
     struct Job *p;
@@ -723,16 +2306,16 @@ void s_clear_finished()
     {
         struct Job *tmp;
         tmp = p->next;
-        free(p->command);
-        free(p->output_filename);
-        pinfo_free(&p->info);
-        free(p->label);
-        free(p);
+        uncount_job(p);
+        free_job(p);
         p = tmp;
     }
+    event_count(-1, EV_CLEARED, 0);
 }
 
-void s_process_runjob_ok(int jobid, char *oname, int pid)
+/* The memo key comes from the runner, hashing the inputs as the run
+ * starts. Without it, the result is not memoized. */
+void s_process_runjob_ok(int jobid, char *oname, int pid, char *memo_key)
 {
     struct Job *p;
     p = findjob(jobid);
@@ -743,8 +2326,58 @@ void s_process_runjob_ok(int jobid, char *oname, int pid)
                 p->state);
 
     p->pid = pid;
+    /* Its gang was torn down after the RUNJOB went out */
+    if (p->gang_torn && pid > 0)
+        kill(-pid, SIGTERM);
+    /* There may be one from a previous attempt */
+    free(p->output_filename);
     p->output_filename = oname;
+    free(p->memo_key);
+    p->memo_key = memo_key;
     pinfo_set_start_time(&p->info);
+
+    /* pid is -1 for the skipped jobs */
+    if (p->timeout > 0 && pid > 0)
+        timer_add(&p->timeout_timer, (unsigned long) p->timeout * 1000);
+
+    if (p->hedge > 0 && pid > 0)
+    {
+        float limit = edf_percentile(p, p->hedge);
+        if (limit >= 0)
+            timer_add(&p->hedge_timer, (unsigned long) (limit * 1000));
+    }
+}
+
+/* The backup copy ended first. Its output is the one of the job. */
+void s_hedge_won(int jobid, char *oname, int pid)
+{
+    struct Job *p;
+
+    p = findjob(jobid);
+    if (p == 0)
+    {
+        free(oname);
+        return;
+    }
+
+    p->pid = pid;
+    p->backup_pid = 0;
+    if (oname != 0)
+    {
+        free(p->output_filename);
+        p->output_filename = oname;
+    }
+    pinfo_addinfo(&p->info, 100, "The backup copy ended first\n");
+}
+
+/* The backup copy runs: the timeout has to stop it too */
+void s_hedge_started(int jobid, int pid)
+{
+    struct Job *p;
+
+    p = findjob(jobid);
+    if (p != 0 && p->hedged)
+        p->backup_pid = pid;
 }
 
 void s_send_runjob(int s, int jobid)
@@ -764,15 +2397,85 @@ void s_send_runjob(int s, int jobid)
      * Then, on finish, these could set the errorlevel to send to its dependency childs.
      * We cannot consider that the jobs will leave traces in the finished job list (-nf?) . */
 
-    m.u.last_errorlevel = p->dependency_errorlevel;
+    m.u.runjob.last_errorlevel = p->dependency_errorlevel;
+    m.u.runjob.skip = p->gang_torn;
 
     send_msg(s, &m);
 }
 
-void s_job_info(int s, int jobid)
+/* The text of -i */
+static void job_info_text(struct Procinfo *out, const struct Job *p)
+{
+    if (pinfo_size(&p->info) > 0)
+        pinfo_addinfo(out, pinfo_size(&p->info) + 1, "%.*s",
+                pinfo_size(&p->info), p->info.ptr);
+    pinfo_addinfo(out, 100, "Command: ");
+    if (p->depend_on != -1)
+        pinfo_addinfo(out, 100, "[%i]&& ", p->depend_on);
+    pinfo_addinfo(out, strlen(p->command) + 1, "%s", p->command);
+    pinfo_addinfo(out, 100, "\n");
+    pinfo_addinfo(out, 100, "Slots required: %i\n", p->num_slots);
+    if (p->mem_peak > 0)
+        pinfo_addinfo(out, 100, "Memory peak declared: %i KiB\n", p->mem_peak);
+    if (p->timeout > 0)
+        pinfo_addinfo(out, 100, "Timeout: %is\n", p->timeout);
+    if (p->retries > 0)
+        pinfo_addinfo(out, 100, "Attempts: %i of %i\n", p->attempts,
+                p->retries + 1);
+    if (p->priority != 0)
+        pinfo_addinfo(out, 100, "Priority: %i\n", p->priority);
+    if (p->preemptions > 0)
+        pinfo_addinfo(out, 100, "Preemptions: %i, stopped %.2fs\n",
+                p->preemptions, p->info.suspended);
+    if (p->quota != 0)
+        pinfo_addinfo(out, strlen(quota_name(p->quota)) + 100, "Queue: %s\n",
+                quota_name(p->quota));
+    if (p->gang != 0)
+        pinfo_addinfo(out, strlen(gang_name(p->gang)) + 100,
+                "Gang: %s, of %i jobs\n", gang_name(p->gang),
+                gang_size(p->gang));
+    if (p->state == QUEUED && p->defer != DEFER_NONE)
+        pinfo_addinfo(out, 100, "Deferred: %s\n", defer2string(p->defer));
+    if ((p->state == DELAYED || p->state == HOLDING_CLIENT)
+            && timer_pending(&p->delay_timer))
+        pinfo_addinfo(out, 100, "Delayed until: %s", ctime(&p->delayed_until));
+    if (p->deadline != 0)
+        pinfo_addinfo(out, 100, "Deadline: %s", ctime(&p->deadline));
+    if (p->expires != 0 && (p->state == QUEUED || p->state == DELAYED))
+        pinfo_addinfo(out, 100, "Expires: %s", ctime(&p->expires));
+    if (p->estimate >= 0)
+        pinfo_addinfo(out, 100, "Estimated run time: %is\n", p->estimate);
+    pinfo_addinfo(out, 100, "Enqueue time: %s",
+            ctime(&p->info.enqueue_time.tv_sec));
+    if (p->state == RUNNING)
+    {
+        pinfo_addinfo(out, 100, "Start time: %s",
+                ctime(&p->info.start_time.tv_sec));
+        pinfo_addinfo(out, 100, "Time running: %fs\n",
+                pinfo_time_until_now(&p->info));
+    } else if (p->state == PREEMPTED)
+    {
+        pinfo_addinfo(out, 100, "Start time: %s",
+                ctime(&p->info.start_time.tv_sec));
+        pinfo_addinfo(out, 100, "Preempted since: %s",
+                ctime(&p->info.suspend_time.tv_sec));
+    } else if (p->state == FINISHED)
+    {
+        pinfo_addinfo(out, 100, "Start time: %s",
+                ctime(&p->info.start_time.tv_sec));
+        pinfo_addinfo(out, 100, "End time: %s",
+                ctime(&p->info.end_time.tv_sec));
+        pinfo_addinfo(out, 100, "Time run: %fs\n",
+                pinfo_time_run(&p->info));
+    }
+}
+
+void s_job_info(int s, int jobid, enum Format format)
 {
     struct Job *p = 0;
     struct msg m;
+    struct Procinfo out;
+    struct msg_part text;
 
     if (jobid == -1)
     {
@@ -819,38 +2522,37 @@ void s_job_info(int s, int jobid)
         return;
     }
 
-    m.type = INFO_DATA;
-    send_msg(s, &m);
-    pinfo_dump(&p->info, s);
-    fd_nprintf(s, 100, "Command: ");
-    if (p->depend_on != -1)
-        fd_nprintf(s, 100, "[%i]&& ", p->depend_on);
-    write(s, p->command, strlen(p->command));
-    fd_nprintf(s, 100, "\n");
-    fd_nprintf(s, 100, "Slots required: %i\n", p->num_slots);
-    fd_nprintf(s, 100, "Enqueue time: %s",
-            ctime(&p->info.enqueue_time.tv_sec));
-    if (p->state == RUNNING)
-    {
-        fd_nprintf(s, 100, "Start time: %s",
-                ctime(&p->info.start_time.tv_sec));
-        fd_nprintf(s, 100, "Time running: %fs\n",
-                pinfo_time_until_now(&p->info));
-    } else if (p->state == FINISHED)
+    if (format == FORMAT_BINARY)
     {
-        fd_nprintf(s, 100, "Start time: %s",
-                ctime(&p->info.start_time.tv_sec));
-        fd_nprintf(s, 100, "End time: %s",
-                ctime(&p->info.end_time.tv_sec));
-        fd_nprintf(s, 100, "Time run: %fs\n",
-                pinfo_time_run(&p->info));
+        m.type = INFO_DATA;
+        text.data = joblist_binary(p, &text.size);
+        m.u.size = text.size;
+        send_msg_parts(s, &m, &text, 1);
+        return;
     }
+
+    /* All goes in one message */
+    pinfo_init(&out);
+    if (format == FORMAT_JSON)
+    {
+        const char *json = joblist_json(p, 1);
+        pinfo_addinfo(&out, strlen(json) + 2, "%s\n", json);
+    } else
+        job_info_text(&out, p);
+
+    m.type = INFO_DATA;
+    m.u.size = pinfo_size(&out);
+    text.data = out.ptr;
+    text.size = m.u.size;
+    send_msg_parts(s, &m, &text, 1);
+    pinfo_free(&out);
 }
 
 void s_send_output(int s, int jobid)
 {
     struct Job *p = 0;
     struct msg m;
+    struct msg_part name;
 
     if (jobid == -1)
     {
@@ -878,8 +2580,10 @@ void s_send_output(int s, int jobid)
     {
         p = get_job(jobid);
         if (p != 0 && p->state != RUNNING
+            && p->state != PREEMPTED
             && p->state != FINISHED
-            && p->state != SKIPPED)
+            && p->state != SKIPPED
+            && p->state != EXPIRED)
             p = 0;
     }
 
@@ -906,6 +2610,17 @@ void s_send_output(int s, int jobid)
         return;
     }
 
+    if (p->state == EXPIRED)
+    {
+        char tmp[50];
+        if (jobid == -1)
+            sprintf(tmp, "The last job expired before it started.\n");
+        else
+            sprintf(tmp, "Job %i expired before it started.\n", jobid);
+        send_list_line(s, tmp);
+        return;
+    }
+
     m.type = ANSWER_OUTPUT;
     m.u.output.store_output = p->store_output;
     m.u.output.pid = p->pid;
@@ -913,9 +2628,9 @@ void s_send_output(int s, int jobid)
         m.u.output.ofilename_size = strlen(p->output_filename) + 1;
     else
         m.u.output.ofilename_size = 0;
-    send_msg(s, &m);
-    if (m.u.output.ofilename_size > 0)
-        send_bytes(s, p->output_filename, m.u.output.ofilename_size);
+    name.data = p->output_filename;
+    name.size = m.u.output.ofilename_size;
+    send_msg_parts(s, &m, &name, 1);
 }
 
 void notify_errorlevel(struct Job *p)
@@ -942,6 +2657,7 @@ int s_remove_job(int s, int *jobid)
     struct Job *p = 0;
     struct msg m;
     struct Job *before_p = 0;
+    int in_queue;
 
     if (*jobid == -1)
     {
@@ -997,7 +2713,9 @@ int s_remove_job(int s, int *jobid)
         }
     }
 
-    if (p == 0 || p->state == RUNNING || p == firstjob)
+    /* A preempted job runs too, only stopped */
+    if (p == 0 || p->state == RUNNING || p->state == PREEMPTED
+            || p == firstjob)
     {
         char tmp[50];
         if (*jobid == -1)
@@ -1010,57 +2728,42 @@ int s_remove_job(int s, int *jobid)
 
     /* Return the jobid found */
     *jobid = p->jobid;
+    in_queue = p->state != FINISHED && p->state != SKIPPED
+        && p->state != EXPIRED;
 
     /* Tricks for the check_notify_list */
-    p->state = FINISHED;
+    set_state(p, FINISHED);
     p->result.errorlevel = -1;
     notify_errorlevel(p);
         
     /* Notify the clients in wait_job */
-    check_notify_list(m.u.jobid);
+    check_notify_list(p->jobid);
+
+    event_job(-1, EV_REMOVED, p);
+    uncount_job(p);
 
     /* Update the list pointers */
     if (p == first_finished_job)
         first_finished_job = p->next;
     else
         before_p->next = p->next;
+    if (lastjob == p)
+        lastjob = before_p;
 
-    free(p->notify_errorlevel_to);
-    free(p->command);
-    free(p->output_filename);
-    pinfo_free(&p->info);
-    free(p->label);
-    free(p);
+    /* The finished ones left it already */
+    if (in_queue)
+    {
+        job_leave_queue(p);
+        edf_queue_dependents(p);
+    }
+    gang_leave(p);
+    free_job(p);
 
     m.type = REMOVEJOB_OK;
     send_msg(s, &m);
     return 1;
 }
 
-static void add_to_notify_list(int s, int jobid)
-{
-    struct Notify *n;
-    struct Notify *new;
-
-    new = (struct Notify *) malloc(sizeof(*new));
-
-    new->socket = s;
-    new->jobid = jobid;
-    new->next = 0;
-
-    n = first_notify;
-    if (n == 0)
-    {
-        first_notify = new;
-        return;
-    }
-
-    while(n->next != 0)
-        n = n->next;
-
-    n->next = new;
-}
-
 static void send_waitjob_ok(int s, int errorlevel)
 {
     struct msg m;
@@ -1087,32 +2790,107 @@ get_job(int jobid)
     return 0;
 }
 
-/* Don't complain, if the socket doesn't exist */
-void s_remove_notification(int s)
+/* Out of the lists of the jobs it still waits for, and freed */
+static void waiter_free(struct Waiter *w)
 {
-    struct Notify *n;
-    struct Notify *previous;
-    n = first_notify;
-    while (n != 0 && n->socket != s)
-        n = n->next;
-    if (n == 0 || n->socket != s)
-        return;
+    struct Waiter **pw;
+    int i;
 
-    /* Remove the notification */
-    previous = first_notify;
-    if (n == previous)
+    for (i = 0; i < w->notifies_num; ++i)
     {
-        first_notify = n->next;
-        free(n);
-        return;
+        struct Notify *n = &w->notifies[i];
+        struct Notify **pn;
+
+        if (n->job == 0)
+            continue;
+        for (pn = &n->job->waiters; *pn != n; pn = &(*pn)->next)
+            ;
+        *pn = n->next;
+    }
+
+    for (pw = &first_waiter; *pw != w; pw = &(*pw)->next)
+        ;
+    *pw = w->next;
+    free(w->notifies);
+    free(w);
+}
+
+/* One of its jobs ended. Returns 1 if that was the answer, and the waiter
+ * is gone. */
+static int waiter_job_ended(struct Waiter *w, const struct Job *p)
+{
+    --w->left;
+    if (w->any || w->errorlevel == 0)
+        w->errorlevel = p->result.errorlevel;
+
+    if (w->any || w->left == 0)
+    {
+        send_waitjob_ok(w->socket, w->errorlevel);
+        waiter_free(w);
+        return 1;
+    }
+    return 0;
+}
+
+/* The client s waits for the jobs. Those ended count at once. */
+static void waiter_new(int s, struct Job **jobs, int num, int any)
+{
+    struct Waiter *w;
+    int i;
+
+    w = (struct Waiter *) malloc(sizeof(*w));
+    if (w == 0)
+        error("Cannot allocate a waiter");
+    w->notifies = (struct Notify *) malloc(num * sizeof(*w->notifies));
+    if (w->notifies == 0)
+        error("Cannot allocate the jobs of a waiter");
+    w->socket = s;
+    w->any = any;
+    w->left = num;
+    w->errorlevel = 0;
+    w->notifies_num = 0;
+    w->next = first_waiter;
+    first_waiter = w;
+
+    for (i = 0; i < num; ++i)
+    {
+        struct Job *p = jobs[i];
+        struct Notify *n;
+
+        if (p->state == FINISHED || p->state == SKIPPED
+                || p->state == EXPIRED)
+        {
+            if (waiter_job_ended(w, p))
+                return;
+            continue;
+        }
+
+        /* Given twice. Its entry would be the first, as the last added. */
+        if (p->waiters != 0 && p->waiters->waiter == w)
+        {
+            --w->left;
+            continue;
+        }
+
+        n = &w->notifies[w->notifies_num++];
+        n->waiter = w;
+        n->job = p;
+        n->next = p->waiters;
+        p->waiters = n;
     }
+}
 
-    /* if not the first... */
-    while(previous->next != n)
-        previous = previous->next;
+/* Don't complain, if the socket doesn't exist */
+void s_remove_notification(int s)
+{
+    struct Waiter *w;
 
-    previous->next = n->next;
-    free(n);
+    for (w = first_waiter; w != 0; w = w->next)
+        if (w->socket == s)
+        {
+            waiter_free(w);
+            return;
+        }
 }
 
 static void destroy_finished_job(struct Job *j)
@@ -1122,7 +2900,7 @@ static void destroy_finished_job(struct Job *j)
     else
     {
         struct Job *i;
-        for(i = first_finished_job; i != 0; ++i)
+        for(i = first_finished_job; i != 0; i = i->next)
         {
             if (i->next == j)
             {
@@ -1135,12 +2913,8 @@ static void destroy_finished_job(struct Job *j)
         }
     }
 
-    free(j->notify_errorlevel_to);
-    free(j->command);
-    free(j->output_filename);
-    pinfo_free(&j->info);
-    free(j->label);
-    free(j);
+    uncount_job(j);
+    free_job(j);
 }
 
 /* This is called when a job finishes */
@@ -1149,35 +2923,34 @@ void check_notify_list(int jobid)
     struct Notify *n, *tmp;
     struct Job *j;
 
-    n = first_notify;
+    j = get_job(jobid);
+    if (j == 0 || !(j->state == FINISHED || j->state == SKIPPED
+                || j->state == EXPIRED))
+        return;
+
+    /* Out of the job first, as the waiters answered leave the lists of the
+     * jobs they wait for */
+    n = j->waiters;
+    j->waiters = 0;
+    for (tmp = n; tmp != 0; tmp = tmp->next)
+        tmp->job = 0;
+
+    /* Notify the waiters. Each one has an entry only in the list. */
     while (n != 0)
     {
         tmp = n;
         n = n->next;
-        if (tmp->jobid == jobid)
-        {
-            j = get_job(jobid);
-            /* If the job finishes, notify the waiter */
-            if (j->state == FINISHED || j->state == SKIPPED)
-            {
-                send_waitjob_ok(tmp->socket, j->result.errorlevel);
-                /* We want to get the next Nofity* before we remove
-                 * the actual 'n'. As s_remove_notification() simply
-                 * removes the element from the linked list, we can
-                 * safely follow on the list from n->next. */
-                s_remove_notification(tmp->socket);
-
-                /* Remove the jobs that were temporarily in the finished list,
-                 * just for their notifiers. */
-                if (!in_notify_list(jobid) && !j->should_keep_finished) {
-                    destroy_finished_job(j);
-                }
-            }
-        }
+        waiter_job_ended(tmp->waiter, j);
     }
+
+    /* Remove the jobs that were temporarily in the finished list,
+     * just for their waiters. */
+    if (!j->should_keep_finished && find_finished_job(jobid) == j)
+        destroy_finished_job(j);
 }
 
-void s_wait_job(int s, int jobid)
+/* The job of the id, or the last added for -1 */
+static struct Job * find_waited_job(int jobid)
 {
     struct Job *p = 0;
 
@@ -1200,37 +2973,105 @@ void s_wait_job(int s, int jobid)
         }
     }
     else
-    {
-        p = firstjob;
-        while (p != 0 && p->jobid != jobid)
-            p = p->next;
+        p = get_job(jobid);
 
-        /* Look in finished jobs if needed */
-        if (p == 0)
-        {
-            p = first_finished_job;
-            while (p != 0 && p->jobid != jobid)
-                p = p->next;
-        }
-    }
+    return p;
+}
 
-    if (p == 0)
+/* The jobs of the list, all of them or those of the label */
+static int find_waited_jobs(struct Job **jobs, const char *label)
+{
+    struct Job *p;
+    int num = 0;
+
+    for (p = firstjob; p != 0; p = p->next)
+        if (label == 0 || (p->label != 0 && strcmp(p->label, label) == 0))
+            jobs[num++] = p;
+    for (p = first_finished_job; p != 0; p = p->next)
+        if (label == 0 || (p->label != 0 && strcmp(p->label, label) == 0))
+            jobs[num++] = p;
+    return num;
+}
+
+/* -w: one job, a list of them, those of a label, or all. The answer comes
+ * when all end, or with any, when the first ends. */
+void s_wait_job(int s, const struct msg *m)
+{
+    struct Job **jobs;
+    struct Job *p;
+    int *jobids = 0;
+    char *label = 0;
+    int num = 0;
+    int i;
+
+    if (m->u.wait.jobids_num > 0)
     {
-        char tmp[50];
-        if (jobid == -1)
-            sprintf(tmp, "The last job cannot be waited.\n");
-        else
-            sprintf(tmp, "The job %i cannot be waited.\n", jobid);
-        send_list_line(s, tmp);
-        return;
+        jobids = (int *) malloc(m->u.wait.jobids_num * sizeof(int));
+        if (jobids == 0)
+            error("Cannot allocate the jobids waited (%i)",
+                    m->u.wait.jobids_num);
+        if (recv_bytes(s, (char *) jobids, m->u.wait.jobids_num * sizeof(int))
+                == -1)
+            error("wrong bytes received");
+    }
+    if (m->u.wait.label_size > 0)
+    {
+        label = (char *) malloc(m->u.wait.label_size);
+        if (label == 0)
+            error("Cannot allocate the label waited (%i)",
+                    m->u.wait.label_size);
+        if (recv_bytes(s, label, m->u.wait.label_size) == -1)
+            error("wrong bytes received");
     }
 
-    if (p->state == FINISHED || p->state == SKIPPED)
+    if (m->u.wait.all || label != 0)
     {
-        send_waitjob_ok(s, p->result.errorlevel);
+        int size = 1;
+
+        for (i = 0; i <= EXPIRED; ++i)
+            size += state_count[i];
+        jobs = (struct Job **) malloc(size * sizeof(*jobs));
+        if (jobs == 0)
+            error("Cannot allocate the jobs waited (%i)", size);
+        num = find_waited_jobs(jobs, label);
     }
     else
-        add_to_notify_list(s, p->jobid);
+    {
+        jobs = (struct Job **) malloc((m->u.wait.jobids_num + 1)
+                * sizeof(*jobs));
+        if (jobs == 0)
+            error("Cannot allocate the jobs waited (%i)",
+                    m->u.wait.jobids_num + 1);
+        for (i = -1; i < m->u.wait.jobids_num; ++i)
+        {
+            int jobid = i == -1 ? m->u.wait.jobid : jobids[i];
+
+            p = find_waited_job(jobid);
+            if (p == 0)
+            {
+                char tmp[50];
+                if (jobid == -1)
+                    sprintf(tmp, "The last job cannot be waited.\n");
+                else
+                    sprintf(tmp, "The job %i cannot be waited.\n", jobid);
+                send_list_line(s, tmp);
+                num = -1;
+                break;
+            }
+            jobs[num++] = p;
+        }
+    }
+
+    if (num == 0 && label != 0)
+        send_list_line(s, "No job has the label waited.\n");
+    else if (num == 0)
+        send_waitjob_ok(s, 0);
+    else if (num > 0)
+        waiter_new(s, jobs, num, m->u.wait.any);
+
+    free(jobs);
+    free(jobids);
+    free(label);
 }
 
 void s_wait_running_job(int s, int jobid)
@@ -1288,22 +3129,48 @@ void s_wait_running_job(int s, int jobid)
         return;
     }
 
-    if (p->state == FINISHED || p->state == SKIPPED)
+    if (p->state == FINISHED || p->state == SKIPPED || p->state == EXPIRED)
     {
         send_waitjob_ok(s, p->result.errorlevel);
     }
     else
-        add_to_notify_list(s, p->jobid);
+        waiter_new(s, &p, 1, 0);
 }
 
 void s_set_max_slots(int new_max_slots)
 {
     if (new_max_slots > 0)
+    {
         max_slots = new_max_slots;
+        event_count(-1, EV_SLOTS, max_slots);
+    }
     else
         warning("Received new_max_slots=%i", new_max_slots);
 }
 
+void s_set_interactive_slots(int slots)
+{
+    interactive_slots = slots;
+}
+
+void s_stats(int s)
+{
+    list_begin(s);
+    if (interactive_slots > 0)
+    {
+        char line[100];
+
+        snprintf(line, sizeof(line), "Interactive slots: %i reserved, %i"
+                " taken by interactive jobs\n", interactive_slots,
+                interactive_busy);
+        send_list_line(s, line);
+    }
+    fs_send_stats(s, firstjob);
+    quota_send_stats(s);
+    memo_send_stats(s);
+    list_end();
+}
+
 void s_get_max_slots(int s)
 {
     struct msg m;
@@ -1350,9 +3217,16 @@ void s_move_urgent(int s, int jobid)
     /* Interchange the pointers */
     tmp1 = find_previous_job(p);
     tmp1->next = p->next;
+    if (lastjob == p)
+        lastjob = tmp1;
     p->next = firstjob->next;
     firstjob->next = p;
+    if (p->next == 0)
+        lastjob = p;
+    if (p->interactive)
+        interactive_unsorted = 1;
 
+    event_moved(p);
 
     send_urgent_ok(s);
 }
@@ -1382,6 +3256,18 @@ void s_swap_jobs(int s, int jobid1, int jobid2)
     tmp = p1->next;
     p1->next = p2->next;
     p2->next = tmp;
+    if (p1->next == 0)
+        lastjob = p1;
+    else if (p2->next == 0)
+        lastjob = p2;
+    if (p1->interactive || p2->interactive)
+        interactive_unsorted = 1;
+
+    /* The first in the queue first, as the subscribers apply them in order */
+    for (tmp = firstjob; tmp != p1 && tmp != p2; tmp = tmp->next)
+        ;
+    event_moved(tmp);
+    event_moved(tmp == p1 ? p2 : p1);
 
     send_swap_jobs_ok(s);
 }
@@ -1475,25 +3361,29 @@ void dump_jobs_struct(FILE *out)
     }
 }
 
-static void dump_notify_struct(FILE *out, const struct Notify *n)
+static void dump_waiter_struct(FILE *out, const struct Waiter *w)
 {
+    int i;
+
     fprintf(out, "  notify\n");
-    fprintf(out, "    jobid %i\n", n->jobid);
-    fprintf(out, "    socket \"%i\"\n", n->socket);
+    fprintf(out, "    socket \"%i\"\n", w->socket);
+    fprintf(out, "    any %i\n", w->any);
+    fprintf(out, "    left %i\n", w->left);
+    fprintf(out, "    jobids");
+    for (i = 0; i < w->notifies_num; ++i)
+        if (w->notifies[i].job != 0)
+            fprintf(out, " %i", w->notifies[i].job->jobid);
+    fprintf(out, "\n");
 }
 
 void dump_notifies_struct(FILE *out)
 {
-    const struct Notify *n;
+    const struct Waiter *w;
 
     fprintf(out, "New_notifies\n");
 
-    n = first_notify;
-    while (n != 0)
-    {
-        dump_notify_struct(out, n);
-        n = n->next;
-    }
+    for (w = first_waiter; w != 0; w = w->next)
+        dump_waiter_struct(out, w);
 }
 
 void joblist_dump(int fd)
@@ -1514,10 +3404,9 @@ void joblist_dump(int fd)
     p = first_finished_job;
     while(p != 0)
     {
-        buffer = joblist_line(p);
+        const char *line = joblist_line(p);
         write(fd, "# ", 2);
-        write(fd,buffer, strlen(buffer));
-        free(buffer);
+        write(fd, line, strlen(line));
         p = p->next;
     }
 
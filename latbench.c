@@ -0,0 +1,132 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Benchmark of the latency of short ts commands, each a run of ts from
+ * start to end: the connection, the request and its answer. It starts its
+ * own server, on a socket of its own, with a job running for the queries,
+ * and a free slot for the jobs it queues. The ts to run can be given, to
+ * compare builds. */
+
+static char socket_path[100];
+static char socket_env[120];
+static const char *ts_path = "./ts";
+
+static void error(const char *str, const char *arg)
+{
+    fprintf(stderr, str, arg);
+    fputc('\n', stderr);
+    exit(-1);
+}
+
+static double now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* Runs ts with the arguments, with the output to /dev/null */
+static void run_ts(char **args)
+{
+    int pid;
+    int status;
+
+    pid = fork();
+    if (pid == -1)
+        error("fork", "");
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd == -1)
+            error("open /dev/null", "");
+        dup2(fd, 1);
+        args[0] = (char *) ts_path;
+        execv(ts_path, args);
+        error("Cannot run %s", ts_path);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        error("%s failed", ts_path);
+}
+
+int main(int argc, char **argv)
+{
+    static char *setup[][4] = {
+        { 0, "-S", "2", 0 },
+        { 0, "sleep", "1000", 0 }
+    };
+    static char *commands[][4] = {
+        { 0, "-s", 0, 0 },
+        { 0, "-l", 0, 0 },
+        { 0, "-i", 0, 0 },
+        { 0, "-nf", "true", 0 }
+    };
+    int runs = 500;
+    int i, j;
+
+    if (argc > 1)
+        runs = atoi(argv[1]);
+    if (argc > 2)
+        ts_path = argv[2];
+    if (runs <= 0)
+    {
+        fprintf(stderr, "usage: latbench [runs [ts]]\n");
+        return 1;
+    }
+
+    sprintf(socket_path, "/tmp/latbench.%i", (int) getpid());
+    sprintf(socket_env, "TS_SOCKET=%s", socket_path);
+    putenv(socket_env);
+    /* Only the last finished job, so -l stays short */
+    putenv("TS_MAXFINISHED=1");
+    unlink(socket_path);
+
+    /* Starts the server, and a job for the queries */
+    for (i = 0; i < (int) (sizeof(setup) / sizeof(setup[0])); ++i)
+        run_ts(setup[i]);
+
+    for (i = 0; i < (int) (sizeof(commands) / sizeof(commands[0])); ++i)
+    {
+        double start, best = 0, total = 0;
+
+        for (j = 0; j < runs; ++j)
+        {
+            double t;
+
+            start = now();
+            run_ts(commands[i]);
+            t = now() - start;
+            total += t;
+            if (j == 0 || t < best)
+                best = t;
+        }
+        printf("ts %-8s %8.3f ms average, %8.3f ms best\n",
+                commands[i][2] ? "-nf true" : commands[i][1],
+                total * 1000. / runs, best * 1000.);
+        fflush(stdout);
+    }
+
+    {
+        char *kill_job[] = { 0, "-k", "0", 0 };
+        char *kill_server[] = { 0, "-K", 0 };
+
+        run_ts(kill_job);
+        run_ts(kill_server);
+    }
+    unlink(socket_path);
+
+    return 0;
+}
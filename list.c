@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <sys/time.h>
 #include "main.h"
 
@@ -55,11 +56,29 @@ static int max(int a, int b)
     return b;
 }
 
+/* The lines of the jobs are built here, one after the other, so listing
+ * many jobs doesn't allocate for each */
+static char *line_buffer = 0;
+static int line_buffer_size = 0;
+
+static char * get_line_buffer(int maxlen)
+{
+    if (maxlen > line_buffer_size)
+    {
+        free(line_buffer);
+        line_buffer_size = max(maxlen, 1024);
+        line_buffer = (char *) malloc(line_buffer_size);
+        if (line_buffer == NULL)
+            error("Malloc for %i failed.\n", line_buffer_size);
+    }
+    return line_buffer;
+}
+
 static const char * ofilename_shown(const struct Job *p)
 {
     const char * output_filename;
 
-    if (p->state == SKIPPED)
+    if (p->state == SKIPPED || p->state == EXPIRED)
     {
         output_filename = "(no output)";
     } else if (p->store_output)
@@ -83,7 +102,15 @@ static const char * ofilename_shown(const struct Job *p)
     return output_filename;
 }
 
-static char * print_noresult(const struct Job *p)
+/* Queued jobs that could run, but were held back, are shown apart */
+static const char * jobstate_shown(const struct Job *p)
+{
+    if (p->state == QUEUED && p->defer != DEFER_NONE)
+        return "deferred";
+    return jstate2string(p->state);
+}
+
+static const char * print_noresult(const struct Job *p)
 {
     const char * jobstate;
     const char * output_filename;
@@ -92,7 +119,7 @@ static char * print_noresult(const struct Job *p)
     /* 18 chars should suffice for a string like "[int]&& " */
     char dependstr[18] = "";
 
-    jobstate = jstate2string(p->state);
+    jobstate = jobstate_shown(p);
     output_filename = ofilename_shown(p);
 
     maxlen = 4 + 1 + 10 + 1 + max(20, strlen(output_filename)) + 1 + 8 + 1
@@ -109,9 +136,7 @@ static char * print_noresult(const struct Job *p)
             snprintf(dependstr, sizeof(dependstr), "[%i]&& ", p->depend_on);
     }
 
-    line = (char *) malloc(maxlen);
-    if (line == NULL)
-        error("Malloc for %i failed.\n", maxlen);
+    line = get_line_buffer(maxlen);
 
     if (p->label)
         snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %14s %s[%s]%s\n",
@@ -136,7 +161,7 @@ static char * print_noresult(const struct Job *p)
     return line;
 }
 
-static char * print_result(const struct Job *p)
+static const char * print_result(const struct Job *p)
 {
     const char * jobstate;
     int maxlen;
@@ -144,10 +169,16 @@ static char * print_result(const struct Job *p)
     const char * output_filename;
     /* 18 chars should suffice for a string like "[int]&& " */
     char dependstr[18] = "";
+    char elevel[12];
 
     jobstate = jstate2string(p->state);
     output_filename = ofilename_shown(p);
 
+    if (p->timed_out)
+        strcpy(elevel, "timeout");
+    else
+        sprintf(elevel, "%i", p->result.errorlevel);
+
     maxlen = 4 + 1 + 10 + 1 + max(20, strlen(output_filename)) + 1 + 8 + 1
         + 14 + 1 + strlen(p->command) + 20; /* 20 is the margin for errors */
 
@@ -162,17 +193,15 @@ static char * print_result(const struct Job *p)
             snprintf(dependstr, sizeof(dependstr), "[%i]&& ", p->depend_on);
     }
 
-    line = (char *) malloc(maxlen);
-    if (line == NULL)
-        error("Malloc for %i failed.\n", maxlen);
+    line = get_line_buffer(maxlen);
 
     if (p->label)
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %0.2f/%0.2f/%0.2f %s[%s]"
+        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %0.2f/%0.2f/%0.2f %s[%s]"
                 "%s\n",
                 p->jobid,
                 jobstate,
                 output_filename,
-                p->result.errorlevel,
+                elevel,
                 p->result.real_ms,
                 p->result.user_ms,
                 p->result.system_ms,
@@ -180,11 +209,11 @@ static char * print_result(const struct Job *p)
                 p->label,
                 p->command);
     else
-        snprintf(line, maxlen, "%-4i %-10s %-20s %-8i %0.2f/%0.2f/%0.2f %s%s\n",
+        snprintf(line, maxlen, "%-4i %-10s %-20s %-8s %0.2f/%0.2f/%0.2f %s%s\n",
                 p->jobid,
                 jobstate,
                 output_filename,
-                p->result.errorlevel,
+                elevel,
                 p->result.real_ms,
                 p->result.user_ms,
                 p->result.system_ms,
@@ -194,9 +223,10 @@ static char * print_result(const struct Job *p)
     return line;
 }
 
-char * joblist_line(const struct Job *p)
+/* The line stays valid until the next call */
+const char * joblist_line(const struct Job *p)
 {
-    char * line;
+    const char * line;
 
     if (p->state == FINISHED)
         line = print_result(p);
@@ -221,3 +251,211 @@ char * joblistdump_torun(const struct Job *p)
 
     return line;
 }
+
+/* The structured formats, built in the line buffer */
+
+static int line_len;
+
+static void line_add(const char *data, int len)
+{
+    if (len <= 0)
+        return;
+    if (line_len + len > line_buffer_size)
+    {
+        int new_size = max(line_len + len, line_buffer_size * 2);
+        char *new_buffer = (char *) realloc(line_buffer, new_size);
+
+        if (new_buffer == NULL)
+            error("Realloc for %i failed.\n", new_size);
+        line_buffer = new_buffer;
+        line_buffer_size = new_size;
+    }
+    memcpy(line_buffer + line_len, data, len);
+    line_len += len;
+}
+
+static void line_printf(const char *fmt, ...)
+{
+    char tmp[200];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    line_add(tmp, strlen(tmp));
+}
+
+/* A JSON string of len chars */
+static void line_json_chars(const char *str, int len)
+{
+    const char *end = str + len;
+
+    line_add("\"", 1);
+    for (; str < end; ++str)
+    {
+        unsigned char c = (unsigned char) *str;
+
+        if (c == '"' || c == '\\')
+        {
+            line_add("\\", 1);
+            line_add(str, 1);
+        } else if (c == '\n')
+            line_add("\\n", 2);
+        else if (c == '\t')
+            line_add("\\t", 2);
+        else if (c < 0x20)
+            line_printf("\\u%04x", c);
+        else
+            line_add(str, 1);
+    }
+    line_add("\"", 1);
+}
+
+/* A JSON string, or null */
+static void line_json_string(const char *str)
+{
+    if (str == 0)
+        line_add("null", 4);
+    else
+        line_json_chars(str, strlen(str));
+}
+
+/* Seconds since the epoch, to the microsecond. null if not yet. */
+static void line_json_time(const struct timeval *tv)
+{
+    if (tv->tv_sec == 0 && tv->tv_usec == 0)
+        line_add("null", 4);
+    else
+        line_printf("%ld.%06ld", (long) tv->tv_sec, (long) tv->tv_usec);
+}
+
+static double seconds(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.;
+}
+
+static const char * output_file(const struct Job *p)
+{
+    if (p->store_output && p->state != QUEUED && p->state != SKIPPED
+            && p->state != EXPIRED)
+        return p->output_filename;
+    return 0;
+}
+
+static int has_result(const struct Job *p)
+{
+    return p->state == FINISHED || p->state == SKIPPED
+        || p->state == EXPIRED;
+}
+
+/* The job as a JSON object, with all it has. The info, the text shown by
+ * -i, goes only if asked. */
+const char * joblist_json(const struct Job *p, int with_info)
+{
+    int i;
+
+    line_len = 0;
+
+    line_printf("{\"id\":%i,\"state\":", p->jobid);
+    line_json_string(jstate2string(p->state));
+    line_printf(",\"deferred\":%s", p->state == QUEUED
+            && p->defer != DEFER_NONE ? "true" : "false");
+    line_add(",\"label\":", 9);
+    line_json_string(p->label);
+    line_add(",\"command\":", 11);
+    line_json_string(p->command);
+    line_add(",\"output\":", 10);
+    line_json_string(output_file(p));
+    line_printf(",\"pid\":%i,\"slots\":%i,\"mem_peak_kib\":%i,\"priority\":%i",
+            p->pid, p->num_slots, p->mem_peak, p->priority);
+    line_printf(",\"timeout\":%i,\"retries\":%i,\"attempts\":%i",
+            p->timeout, p->retries, p->attempts);
+    line_printf(",\"interactive\":%s", p->interactive ? "true" : "false");
+
+    line_add(",\"depends_on\":[", 15);
+    if (p->do_depend && p->depend_on >= 0)
+        line_printf("%i", p->depend_on);
+    line_add("],\"dependents\":[", 16);
+    for (i = 0; i < p->notify_errorlevel_to_size; ++i)
+        line_printf(i ? ",%i" : "%i", p->notify_errorlevel_to[i]);
+    line_add("]", 1);
+
+    line_add(",\"enqueue_time\":", 16);
+    line_json_time(&p->info.enqueue_time);
+    line_add(",\"start_time\":", 14);
+    line_json_time(&p->info.start_time);
+    line_add(",\"end_time\":", 12);
+    line_json_time(&p->info.end_time);
+    if (p->deadline != 0)
+        line_printf(",\"deadline\":%ld", (long) p->deadline);
+    if (p->expires != 0)
+        line_printf(",\"expires\":%ld", (long) p->expires);
+
+    if (has_result(p))
+        line_printf(",\"result\":{\"errorlevel\":%i,\"died_by_signal\":%s,"
+                "\"signal\":%i,\"timed_out\":%s,\"skipped\":%s,"
+                "\"real\":%.9g,\"user\":%.9g,\"system\":%.9g}",
+                p->result.errorlevel,
+                p->result.died_by_signal ? "true" : "false",
+                p->result.signal, p->timed_out ? "true" : "false",
+                p->state != FINISHED ? "true" : "false",
+                p->result.real_ms, p->result.user_ms, p->result.system_ms);
+    else
+        line_add(",\"result\":null", 14);
+
+    if (with_info)
+    {
+        line_add(",\"info\":", 8);
+        line_json_chars(p->info.ptr, pinfo_size(&p->info));
+    }
+
+    /* With the null */
+    line_add("}", 2);
+    return line_buffer;
+}
+
+/* The job as a struct Job_record, with what follows it */
+const char * joblist_binary(const struct Job *p, int *size)
+{
+    struct Job_record r;
+    const char *output = output_file(p);
+
+    memset(&r, 0, sizeof(r));
+    r.jobid = p->jobid;
+    r.state = p->state;
+    r.pid = p->pid;
+    r.num_slots = p->num_slots;
+    r.depend_on = p->do_depend ? p->depend_on : -1;
+    r.priority = p->priority;
+    r.attempts = p->attempts;
+    r.enqueue_time = seconds(&p->info.enqueue_time);
+    r.start_time = seconds(&p->info.start_time);
+    r.end_time = seconds(&p->info.end_time);
+    if (has_result(p))
+    {
+        r.errorlevel = p->result.errorlevel;
+        r.died_by_signal = p->result.died_by_signal;
+        r.signal = p->result.signal;
+        r.timed_out = p->timed_out;
+        r.real_time = p->result.real_ms;
+        r.user_time = p->result.user_ms;
+        r.system_time = p->result.system_ms;
+    }
+    r.command_size = strlen(p->command) + 1;
+    r.label_size = p->label ? strlen(p->label) + 1 : 0;
+    r.output_size = output ? strlen(output) + 1 : 0;
+    r.dependents = p->notify_errorlevel_to_size;
+    r.size = sizeof(r) + r.command_size + r.label_size + r.output_size
+        + r.dependents * sizeof(int);
+
+    line_len = 0;
+    line_add((const char *) &r, sizeof(r));
+    line_add(p->command, r.command_size);
+    line_add(p->label, r.label_size);
+    line_add(output, r.output_size);
+    line_add((const char *) p->notify_errorlevel_to,
+            r.dependents * sizeof(int));
+
+    *size = r.size;
+    return line_buffer;
+}
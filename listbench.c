@@ -0,0 +1,214 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* Benchmark of 'ts -l' against a server with 1k, 10k and 100k finished
+ * jobs. It starts its own server, on a socket of its own, and fills it
+ * speaking the protocol like a ts client would, but without running
+ * anything. Then it times the runs of 'ts -l', with the output to
+ * /dev/null. */
+
+static char socket_path[100];
+static char socket_env[120];
+static const char *ts_path = "./ts";
+
+/* msg.c needs these, from error.c */
+enum Process_type process_type = CLIENT;
+
+void error(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(-1);
+}
+
+void warning(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+void warning_msg(const struct msg *m, const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+static double now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* Runs ts with an argument, with the output to /dev/null */
+static void run_ts(const char *arg)
+{
+    int pid;
+    int status;
+
+    pid = fork();
+    if (pid == -1)
+        error("fork");
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd == -1)
+            error("open /dev/null");
+        dup2(fd, 1);
+        execl(ts_path, ts_path, arg, (char *) NULL);
+        error("Cannot run %s", ts_path);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        error("%s %s failed", ts_path, arg);
+}
+
+static int connect_server()
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        error("socket");
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        error("Cannot connect to %s", socket_path);
+    msg_reset(fd);
+    return fd;
+}
+
+static void expect(int fd, struct msg *m, enum msg_types type)
+{
+    if (recv_msg(fd, m) != sizeof(*m) || m->type != type)
+        error("The server did not answer %i", type);
+}
+
+/* A job that runs and ends at once, as a client without output would do */
+static void add_finished_job(int i)
+{
+    struct msg m;
+    struct msg_part parts[2];
+    char command[100];
+    char label[20];
+    int fd;
+
+    fd = connect_server();
+
+    sprintf(command, "make -C /home/user/src/project%i -j4 all", i);
+    sprintf(label, "build%i", i % 10);
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.command_size = strlen(command) + 1;
+    m.u.newjob.label_size = strlen(label) + 1;
+    m.u.newjob.should_keep_finished = 1;
+    m.u.newjob.depend_on = -1;
+    m.u.newjob.num_slots = 1;
+    parts[0].data = command;
+    parts[0].size = m.u.newjob.command_size;
+    parts[1].data = label;
+    parts[1].size = m.u.newjob.label_size;
+    send_msg_parts(fd, &m, parts, 2);
+    expect(fd, &m, NEWJOB_OK);
+    expect(fd, &m, RUNJOB);
+
+    memset(&m, 0, sizeof(m));
+    m.type = RUNJOB_OK;
+    m.u.output.pid = getpid();
+    send_msg(fd, &m);
+
+    memset(&m, 0, sizeof(m));
+    m.type = ENDJOB;
+    m.u.result.real_ms = 1.5;
+    send_msg(fd, &m);
+
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 1000, 10000, 100000 };
+    int runs = 20;
+    int jobs = 0;
+    int i, j;
+
+    if (argc > 1)
+        runs = atoi(argv[1]);
+    if (argc > 2)
+        ts_path = argv[2];
+    if (runs <= 0)
+    {
+        fprintf(stderr, "usage: listbench [runs [ts]]\n");
+        return 1;
+    }
+
+    sprintf(socket_path, "/tmp/listbench.%i", (int) getpid());
+    sprintf(socket_env, "TS_SOCKET=%s", socket_path);
+    putenv(socket_env);
+    putenv("TS_MAXFINISHED=1000000");
+    unlink(socket_path);
+
+    /* Starts the server */
+    run_ts("-C");
+
+    for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); ++i)
+    {
+        double start, best = 0, total = 0;
+
+        for (; jobs < sizes[i]; ++jobs)
+            add_finished_job(jobs);
+
+        for (j = 0; j < runs; ++j)
+        {
+            double t;
+
+            start = now();
+            run_ts("-l");
+            t = now() - start;
+            total += t;
+            if (j == 0 || t < best)
+                best = t;
+        }
+        printf("%7i jobs  ts -l: %8.2f ms average, %8.2f ms best\n",
+                jobs, total * 1000. / runs, best * 1000.);
+        fflush(stdout);
+    }
+
+    run_ts("-K");
+    unlink(socket_path);
+
+    return 0;
+}
@@ -10,7 +10,10 @@
 #include <signal.h>
 
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
+#include <getopt.h>
+#include <limits.h>
 
 #include "main.h"
 
@@ -25,6 +28,87 @@ int server_socket;
 static char getopt_env[] = "POSIXLY_CORRECT=YES";
 static char *old_getopt_env;
 
+/* Options without a short form. Their values go after any char. */
+enum
+{
+    OPT_MEM = 256,
+    OPT_TIMEOUT,
+    OPT_RETRIES,
+    OPT_BACKOFF,
+    OPT_AT,
+    OPT_AFTER,
+    OPT_START_RATE,
+    OPT_STATS,
+    OPT_DEADLINE,
+    OPT_PRIORITY,
+    OPT_GANG,
+    OPT_GANG_SIZE,
+    OPT_GANG_TEARDOWN,
+    OPT_QUEUE,
+    OPT_UNIQUE,
+    OPT_DEBOUNCE,
+    OPT_MEMO_INPUTS,
+    OPT_HEDGE,
+    OPT_TTL,
+    OPT_INTERACTIVE,
+    OPT_PIPE,
+    OPT_STATE,
+    OPT_LABEL_PATTERN,
+    OPT_JOBIDS,
+    OPT_ELEVEL,
+    OPT_SORT,
+    OPT_LIMIT,
+    OPT_OFFSET,
+    OPT_COUNT,
+    OPT_FORMAT,
+    OPT_WATCH,
+    OPT_ALL,
+    OPT_ANY,
+    OPT_RING,
+    OPT_ATTACH
+};
+
+static struct option long_options[] =
+{
+    {"mem", required_argument, NULL, OPT_MEM},
+    {"timeout", required_argument, NULL, OPT_TIMEOUT},
+    {"retries", required_argument, NULL, OPT_RETRIES},
+    {"backoff", required_argument, NULL, OPT_BACKOFF},
+    {"at", required_argument, NULL, OPT_AT},
+    {"after", required_argument, NULL, OPT_AFTER},
+    {"start-rate", required_argument, NULL, OPT_START_RATE},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"deadline", required_argument, NULL, OPT_DEADLINE},
+    {"priority", required_argument, NULL, OPT_PRIORITY},
+    {"gang", required_argument, NULL, OPT_GANG},
+    {"gang-size", required_argument, NULL, OPT_GANG_SIZE},
+    {"gang-teardown", no_argument, NULL, OPT_GANG_TEARDOWN},
+    {"queue", required_argument, NULL, OPT_QUEUE},
+    {"unique", optional_argument, NULL, OPT_UNIQUE},
+    {"debounce", optional_argument, NULL, OPT_DEBOUNCE},
+    {"memo-inputs", required_argument, NULL, OPT_MEMO_INPUTS},
+    {"hedge", optional_argument, NULL, OPT_HEDGE},
+    {"ttl", required_argument, NULL, OPT_TTL},
+    {"interactive", no_argument, NULL, OPT_INTERACTIVE},
+    {"pipe", no_argument, NULL, OPT_PIPE},
+    {"state", required_argument, NULL, OPT_STATE},
+    {"label-pattern", required_argument, NULL, OPT_LABEL_PATTERN},
+    {"jobids", required_argument, NULL, OPT_JOBIDS},
+    {"elevel", required_argument, NULL, OPT_ELEVEL},
+    {"sort", required_argument, NULL, OPT_SORT},
+    {"limit", required_argument, NULL, OPT_LIMIT},
+    {"offset", required_argument, NULL, OPT_OFFSET},
+    {"count", no_argument, NULL, OPT_COUNT},
+    {"format", required_argument, NULL, OPT_FORMAT},
+    {"watch", optional_argument, NULL, OPT_WATCH},
+    {"all", no_argument, NULL, OPT_ALL},
+    {"any", no_argument, NULL, OPT_ANY},
+    {"ring", no_argument, NULL, OPT_RING},
+    {"attach", required_argument, NULL, OPT_ATTACH},
+    {"label", required_argument, NULL, 'L'},
+    {NULL, 0, NULL, 0}
+};
+
 static char version[] = "Task Spooler v1.0.0 - a task queue system for the unix user.\n"
 "Copyright (C) 2007-2016  Lluis Batlle i Rossell";
 
@@ -45,6 +129,35 @@ static void default_command_line()
     command_line.wait_enqueuing = 1;
     command_line.stderr_apart = 0;
     command_line.num_slots = 1;
+    command_line.mem_peak = 0;
+    command_line.timeout = 0;
+    command_line.retries = 0;
+    command_line.backoff_min = 10;
+    command_line.backoff_max = 10 * 60;
+    command_line.delay = 0;
+    command_line.deadline = 0;
+    command_line.priority = 0;
+    command_line.gang = 0;
+    command_line.gang_size = 1;
+    command_line.gang_teardown = 0;
+    command_line.queue = 0;
+    command_line.unique = UNIQUE_NONE;
+    command_line.unique_key = 0;
+    command_line.memo_inputs = 0;
+    command_line.memo_inputs_num = 0;
+    command_line.hedge = 0;
+    command_line.ttl = 0;
+    command_line.interactive = 0;
+    command_line.start_rate = 0;
+    command_line.start_burst = 1;
+    memset(&command_line.list, 0, sizeof(command_line.list));
+    command_line.list_label = 0;
+    command_line.format = FORMAT_TEXT;
+    command_line.watch_snapshot = 0;
+    command_line.wait_jobids = 0;
+    command_line.wait_jobids_num = 0;
+    command_line.wait_all = 0;
+    command_line.wait_any = 0;
 }
 
 void get_command(int index, int argc, char **argv)
@@ -53,6 +166,70 @@ void get_command(int index, int argc, char **argv)
     command_line.command.num = argc - index;
 }
 
+/* Parses "<min>..<max>" or "<time>" for a constant delay */
+static int get_backoff(const char *str, int *min, int *max)
+{
+    char tmp[50];
+    char *tmp2;
+
+    if(strlen(str) >= 50)
+        return 0;
+    strcpy(tmp, str);
+
+    tmp2 = strstr(tmp, "..");
+    if (tmp2 != NULL)
+    {
+        *tmp2 = '\0';
+        tmp2 += 2;
+    }
+
+    *min = parse_duration(tmp);
+    *max = tmp2 ? parse_duration(tmp2) : *min;
+    if (*min < 0 || *max < *min)
+        return 0;
+    return 1;
+}
+
+/* Seconds from now to the next "HH:MM[:SS]" of the local time.
+ * Returns -1 if the string cannot be parsed. */
+static int get_at_delay(const char *str)
+{
+    int h, m, sec = 0;
+    char extra;
+    time_t now, then;
+    struct tm tm;
+
+    if (sscanf(str, "%d:%d:%d%c", &h, &m, &sec, &extra) != 3)
+    {
+        sec = 0;
+        if (sscanf(str, "%d:%d%c", &h, &m, &extra) != 2)
+            return -1;
+    }
+    if (h < 0 || h > 23 || m < 0 || m > 59 || sec < 0 || sec > 59)
+        return -1;
+
+    now = time(NULL);
+    tm = *localtime(&now);
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    then = mktime(&tm);
+
+    /* Already past today: tomorrow */
+    if (then <= now)
+    {
+        tm.tm_mday += 1;
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = sec;
+        tm.tm_isdst = -1;
+        then = mktime(&tm);
+    }
+
+    return (int) (then - now);
+}
+
 static int get_two_jobs(const char *str, int *j1, int *j2)
 {
     char tmp[50];
@@ -77,6 +254,68 @@ static int get_two_jobs(const char *str, int *j1, int *j2)
     return 1;
 }
 
+/* States like "queued,running" to bits of (1 << state) */
+static int get_list_states(const char *str)
+{
+    char tmp[200];
+    char *name;
+    int states = 0;
+
+    if(strlen(str) >= sizeof(tmp))
+        return 0;
+    strcpy(tmp, str);
+
+    for (name = strtok(tmp, ","); name != 0; name = strtok(0, ","))
+    {
+        int s;
+
+        for (s = QUEUED; s <= EXPIRED; ++s)
+            if (s != HOLDING_CLIENT && strcmp(name, jstate2string(s)) == 0)
+                break;
+        if (s > EXPIRED)
+            return 0;
+        states |= 1 << s;
+    }
+    return states;
+}
+
+/* A range of jobids, like "10-20", "10-" or "-20" */
+static int get_jobid_range(const char *str, int *min, int *max)
+{
+    const char *dash;
+
+    dash = strchr(str, '-');
+    if (dash == NULL)
+        return 0;
+
+    *min = dash == str ? 0 : atoi(str);
+    *max = dash[1] == '\0' ? INT_MAX : atoi(dash + 1);
+    return *min >= 0 && *max >= *min;
+}
+
+/* A sort key, "-" before it for the reverse order */
+static int get_list_sort(const char *str, enum List_sort *sort, int *reverse)
+{
+    static const char *keys[] = { "id", "state", "label", "elevel",
+        "runtime", "enqueue" };
+    int i;
+
+    *reverse = 0;
+    if (str[0] == '-')
+    {
+        *reverse = 1;
+        ++str;
+    }
+
+    for (i = 0; i < (int) (sizeof(keys) / sizeof(keys[0])); ++i)
+        if (strcmp(str, keys[i]) == 0)
+        {
+            *sort = SORT_ID + i;
+            return 1;
+        }
+    return 0;
+}
+
 void parse_opts(int argc, char **argv)
 {
     int c;
@@ -84,7 +323,8 @@ void parse_opts(int argc, char **argv)
 
     /* Parse options */
     while(1) {
-        c = getopt(argc, argv, ":VhKgClnfmBEr:t:c:o:p:w:k:u:s:U:i:N:L:dS:D:");
+        c = getopt_long(argc, argv, ":VhKgClnfmBEr:t:c:o:p:w:k:u:s:U:i:N:L:dS:D:",
+                long_options, NULL);
 
         if (c == -1)
             break;
@@ -161,7 +401,14 @@ void parse_opts(int argc, char **argv)
                 break;
             case 'w':
                 command_line.request = c_WAITJOB;
-                command_line.jobid = atoi(optarg);
+                /* An option after it, as in "-w --all", is not its id */
+                if (optarg[0] == '-' && optarg == argv[optind - 1])
+                {
+                    command_line.jobid = -1;
+                    --optind;
+                }
+                else
+                    command_line.jobid = atoi(optarg);
                 break;
             case 'u':
                 command_line.request = c_URGENT;
@@ -207,6 +454,231 @@ void parse_opts(int argc, char **argv)
             case 'E':
                 command_line.stderr_apart = 1;
                 break;
+            case OPT_MEM:
+                command_line.mem_peak = parse_size_kb(optarg);
+                if (command_line.mem_peak < 0)
+                {
+                    fprintf(stderr, "Wrong size for --mem: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_TIMEOUT:
+                command_line.timeout = parse_duration(optarg);
+                if (command_line.timeout <= 0)
+                {
+                    fprintf(stderr, "Wrong time for --timeout: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_RETRIES:
+                command_line.retries = atoi(optarg);
+                if (command_line.retries < 0)
+                    command_line.retries = 0;
+                break;
+            case OPT_BACKOFF:
+                res = get_backoff(optarg, &command_line.backoff_min,
+                        &command_line.backoff_max);
+                if (!res)
+                {
+                    fprintf(stderr, "Wrong <min>..<max> for --backoff.\n");
+                    exit(-1);
+                }
+                break;
+            case OPT_AT:
+                command_line.delay = get_at_delay(optarg);
+                if (command_line.delay < 0)
+                {
+                    fprintf(stderr, "Wrong <HH:MM[:SS]> for --at: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_START_RATE:
+                command_line.request = c_SET_START_RATE;
+                if (!parse_start_rate(optarg, &command_line.start_rate,
+                            &command_line.start_burst))
+                {
+                    fprintf(stderr, "Wrong <num>/<s|m|h> for --start-rate: %s\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_DEADLINE:
+                /* A time of the day, or a time from now */
+                if (strchr(optarg, ':') != NULL)
+                    command_line.deadline = get_at_delay(optarg);
+                else
+                    command_line.deadline = parse_duration(optarg);
+                if (command_line.deadline <= 0)
+                {
+                    fprintf(stderr, "Wrong time for --deadline: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_PRIORITY:
+                command_line.priority = atoi(optarg);
+                if (command_line.priority < 0)
+                    command_line.priority = 0;
+                break;
+            case OPT_GANG:
+                command_line.gang = optarg;
+                break;
+            case OPT_GANG_SIZE:
+                command_line.gang_size = atoi(optarg);
+                if (command_line.gang_size < 1)
+                {
+                    fprintf(stderr, "Wrong size for --gang-size: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_GANG_TEARDOWN:
+                command_line.gang_teardown = 1;
+                break;
+            case OPT_QUEUE:
+                command_line.queue = optarg;
+                break;
+            case OPT_UNIQUE:
+                command_line.unique = UNIQUE_KEEP;
+                command_line.unique_key = optarg;
+                break;
+            case OPT_DEBOUNCE:
+                command_line.unique = UNIQUE_REPLACE;
+                command_line.unique_key = optarg;
+                break;
+            case OPT_INTERACTIVE:
+                command_line.interactive = 1;
+                break;
+            case OPT_TTL:
+                command_line.ttl = parse_duration(optarg);
+                if (command_line.ttl <= 0)
+                {
+                    fprintf(stderr, "Wrong time for --ttl: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_HEDGE:
+                command_line.hedge = 95;
+                if (optarg)
+                    command_line.hedge = atoi(optarg);
+                if (command_line.hedge < 1 || command_line.hedge > 100)
+                {
+                    fprintf(stderr, "Wrong percentile for --hedge: %s\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_MEMO_INPUTS:
+                command_line.memo_inputs = (char **) realloc(
+                        command_line.memo_inputs,
+                        (command_line.memo_inputs_num + 1) * sizeof(char *));
+                if (command_line.memo_inputs == 0)
+                    error("Cannot allocate the memo inputs");
+                command_line.memo_inputs[command_line.memo_inputs_num++] =
+                    optarg;
+                break;
+            case OPT_STATS:
+                command_line.request = c_STATS;
+                break;
+            case OPT_PIPE:
+                command_line.request = c_PIPE;
+                break;
+            case OPT_STATE:
+                command_line.list.states = get_list_states(optarg);
+                if (command_line.list.states == 0)
+                {
+                    fprintf(stderr, "Wrong states for --state: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_LABEL_PATTERN:
+                command_line.list_label = optarg;
+                break;
+            case OPT_JOBIDS:
+                command_line.list.jobid_range = 1;
+                if (!get_jobid_range(optarg, &command_line.list.jobid_min,
+                            &command_line.list.jobid_max))
+                {
+                    fprintf(stderr, "Wrong <id>-<id> for --jobids: %s\n",
+                            optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_ELEVEL:
+                if (strcmp(optarg, "failed") == 0)
+                    command_line.list.elevel = ELEVEL_FAILED;
+                else
+                {
+                    command_line.list.elevel = ELEVEL_EQUAL;
+                    command_line.list.errorlevel = atoi(optarg);
+                }
+                break;
+            case OPT_SORT:
+                if (!get_list_sort(optarg, &command_line.list.sort,
+                            &command_line.list.reverse))
+                {
+                    fprintf(stderr, "Wrong key for --sort: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_LIMIT:
+                command_line.list.limit = atoi(optarg);
+                if (command_line.list.limit <= 0)
+                {
+                    fprintf(stderr, "Wrong number for --limit: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_OFFSET:
+                command_line.list.offset = atoi(optarg);
+                if (command_line.list.offset < 0)
+                    command_line.list.offset = 0;
+                break;
+            case OPT_COUNT:
+                command_line.list.count = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "text") == 0)
+                    command_line.format = FORMAT_TEXT;
+                else if (strcmp(optarg, "json") == 0)
+                    command_line.format = FORMAT_JSON;
+                else if (strcmp(optarg, "binary") == 0)
+                    command_line.format = FORMAT_BINARY;
+                else
+                {
+                    fprintf(stderr, "Wrong format for --format: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_WATCH:
+                command_line.request = c_WATCH;
+                if (optarg && strcmp(optarg, "snapshot") == 0)
+                    command_line.watch_snapshot = 1;
+                else if (optarg)
+                {
+                    fprintf(stderr, "Wrong argument for --watch: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case OPT_ALL:
+                command_line.wait_all = 1;
+                break;
+            case OPT_ANY:
+                command_line.wait_any = 1;
+                break;
+            case OPT_RING:
+                command_line.request = c_RING;
+                break;
+            case OPT_ATTACH:
+                command_line.request = c_ATTACH;
+                command_line.jobid = atoi(optarg);
+                break;
+            case OPT_AFTER:
+                command_line.delay = parse_duration(optarg);
+                if (command_line.delay < 0)
+                {
+                    fprintf(stderr, "Wrong time for --after: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
             case ':':
                 switch(optopt)
                 {
@@ -271,6 +743,32 @@ void parse_opts(int argc, char **argv)
 
     command_line.command.num = 0;
 
+    /* "--start-rate 20/s burst 50", without quoting */
+    if (command_line.request == c_SET_START_RATE && optind + 1 < argc
+            && strcmp(argv[optind], "burst") == 0)
+    {
+        command_line.start_burst = atoi(argv[optind + 1]);
+        if (command_line.start_burst < 1)
+        {
+            fprintf(stderr, "Wrong burst for --start-rate: %s\n",
+                    argv[optind + 1]);
+            exit(-1);
+        }
+    }
+
+    /* "-w 10 11 12": the ids after the first */
+    if (command_line.request == c_WAITJOB && optind < argc)
+    {
+        int i;
+
+        command_line.wait_jobids_num = argc - optind;
+        command_line.wait_jobids = (int *) malloc(
+                command_line.wait_jobids_num * sizeof(int));
+        for (i = optind; i < argc; ++i)
+            command_line.wait_jobids[i - optind] = atoi(argv[i]);
+        optind = argc;
+    }
+
     /* if the request is still the default option... 
      * (the default values should be centralized) */
     if (optind < argc && command_line.request == c_LIST)
@@ -279,8 +777,21 @@ void parse_opts(int argc, char **argv)
         get_command(optind, argc, argv);
     }
 
+    /* The job to put in the ring, or to run attached */
+    if (optind < argc && (command_line.request == c_RING
+                || command_line.request == c_ATTACH))
+        get_command(optind, argc, argv);
+
+    if (command_line.request == c_ATTACH && command_line.command.num == 0)
+    {
+        fprintf(stderr, "--attach needs the command of the job\n");
+        exit(-1);
+    }
+
+    /* The ring needs the server, but not a connection to it */
     if (command_line.request != c_SHOW_HELP &&
-            command_line.request != c_SHOW_VERSION)
+            command_line.request != c_SHOW_VERSION &&
+            command_line.request != c_RING)
         command_line.need_server = 1;
 
     if ( ! command_line.store_output && ! command_line.should_go_background )
@@ -293,6 +804,20 @@ void parse_opts(int argc, char **argv)
                 "For e-mail, you should store the output (not through gzip)\n");
         exit(-1);
     }
+
+    /* The memoized result is the output file */
+    if (command_line.memo_inputs_num > 0 && ! command_line.store_output)
+    {
+        fprintf(stderr, "For --memo-inputs, you should store the output\n");
+        exit(-1);
+    }
+
+    /* A member run again would start alone */
+    if (command_line.gang && command_line.retries > 0)
+    {
+        fprintf(stderr, "A gang job cannot have --retries\n");
+        exit(-1);
+    }
 }
 
 static void fill_first_3_handles()
@@ -345,12 +870,32 @@ static void print_help(const char *cmd)
     printf("  TS_ENV  command called on enqueue. Its output determines the job information.\n");
     printf("  TS_SAVELIST  filename which will store the list, if the server dies.\n");
     printf("  TS_SLOTS   amount of jobs which can run at once, read on server start.\n");
+    printf("  TS_MEMRESERVE  memory kept free when starting jobs (1/32 of RAM by default).\n");
+    printf("  TS_TIMEOUT  run time allowed to the jobs without --timeout, read on server start.\n");
+    printf("  TS_RING    take jobs from 'ts --ring' too, if set on server start.\n");
+    printf("  TS_TIMEOUT_GRACE  time between the SIGTERM and the SIGKILL on timeout (10s).\n");
     printf("  TMPDIR     directory where to place the output files and the default socket.\n");
     printf("Actions:\n");
     printf("  -K       kill the task spooler server\n");
     printf("  -C       clear the list of finished jobs\n");
     printf("  -l       show the job list (default action)\n");
     printf("  -S [num] get/set the number of max simultaneous jobs of the server.\n");
+    printf("  --start-rate <num>/<s|m|h> [burst <num>]  limit the job starts of the\n"
+           "           queue, or of the label given with -L. \"off\" removes the limit.\n");
+    printf("  --stats  show the fair share usage of the users.\n");
+    printf("  --pipe   answer the requests read from stdin, a line each, in one connection.\n");
+    printf("  --watch[=snapshot]  show the changes of the jobs as they happen.\n");
+    printf("  --ring [command]  queue the command, or a 'sh -c' of each line of stdin,\n"
+           "           through the ring of a server started with TS_RING. Only -L, -N\n"
+           "           and -p apply. The job ids are not shown.\n");
+    printf("  --state <state,...>  list only the jobs in those states.\n");
+    printf("  --label-pattern <pattern>  list only the jobs of labels matching it.\n");
+    printf("  --jobids <id-id>  list only the jobs in that range.\n");
+    printf("  --elevel <num|failed>  list only the finished jobs of that errorlevel.\n");
+    printf("  --sort [-]<id|state|label|elevel|runtime|enqueue>  order of the list.\n");
+    printf("  --limit <num>  --offset <num>  list a page of the jobs.\n");
+    printf("  --count  show the number of jobs in the list, instead.\n");
+    printf("  --format <text|json|binary>  of the list and of -i.\n");
     printf("  -t [id]  \"tail -n 10 -f\" the output of the job. Last run if not specified.\n");
     printf("  -c [id]  like -t, but shows all the lines. Last run if not specified.\n");
     printf("  -p [id]  show the pid of the job. Last run if not specified.\n");
@@ -358,7 +903,9 @@ static void print_help(const char *cmd)
     printf("  -i [id]  show job information. Of last job run, if not specified.\n");
     printf("  -s [id]  show the job state. Of the last added, if not specified.\n");
     printf("  -r [id]  remove a job. The last added, if not specified.\n");
-    printf("  -w [id]  wait for a job. The last added, if not specified.\n");
+    printf("  -w [id...]  wait for jobs. The last added, if not specified.\n");
+    printf("  -w --label <label>, -w --all  wait for the jobs of the label, or all.\n");
+    printf("  --any    with -w, wait only until the first job ends.\n");
     printf("  -k [id]  send SIGTERM to the job process group. The last run, if not specified.\n");
     printf("  -u [id]  put that job first. The last added, if not specified.\n");
     printf("  -U <id-id>  swap two jobs in the queue.\n");
@@ -375,6 +922,34 @@ static void print_help(const char *cmd)
     printf("  -D <id>  the job will be run only if the job of given id ends well.\n");
     printf("  -L <lab> name this task with a label, to be distinguished on listing.\n");
     printf("  -N <num> number of slots required by the job (1 default).\n");
+    printf("  --mem <size>  expected peak memory of the job (K/M/G suffixes). It will\n"
+           "           not start until the host has that memory available.\n");
+    printf("  --timeout <time>  kill the job if it runs longer (s/m/h/d suffixes).\n");
+    printf("  --retries <num>  run the job again if it fails, up to num times.\n");
+    printf("  --backoff <min>..<max>  delay before retrying, doubling from min up to\n"
+           "           max (10s..10m default).\n");
+    printf("  --at <HH:MM[:SS]>  don't start the job before that time (today or tomorrow).\n");
+    printf("  --after <time>  don't start the job before that time passes.\n");
+    printf("  --deadline <HH:MM[:SS]|time>  the job should end by then. The jobs with\n"
+           "           deadline run first, by least slack.\n");
+    printf("  --priority <num>  run before the jobs of lower priority (0 default),\n"
+           "           stopping them if it needs their slots.\n");
+    printf("  --gang <name>  start the job only together with the rest of its gang.\n");
+    printf("  --gang-size <num>  jobs in the gang, to wait for (1 default).\n");
+    printf("  --gang-teardown  if a job of the gang fails, kill the rest.\n");
+    printf("  --queue <name>  run the job in that queue of the quotas (TS_QUEUES),\n"
+           "           like \"io/net\".\n");
+    printf("  --unique[=<key>]  don't queue the job if the same one waits to run;\n"
+           "           give its id instead. The default key is label and command.\n");
+    printf("  --debounce[=<key>]  as --unique, but the new job replaces the old one.\n");
+    printf("  --memo-inputs <files>  if a run with the same command and input files\n"
+           "           (globs) ended well, give its result instead of running.\n");
+    printf("  --hedge[=<pct>]  for idempotent jobs: if it runs past that percentile\n"
+           "           (95 default) of the run times of its label, start a backup copy\n"
+           "           in an idle slot. The first copy to end wins.\n");
+    printf("  --ttl <time>  if the job did not start within that time, it expires.\n");
+    printf("  --interactive  run before the batch jobs, also in the slots reserved\n"
+           "           for the interactive jobs.\n");
 }
 
 static void print_version()
@@ -402,6 +977,7 @@ static void unset_getopt_env()
 int main(int argc, char **argv)
 {
     int errorlevel = 0;
+    int done;
 
     process_type = CLIENT;
 
@@ -414,10 +990,14 @@ int main(int argc, char **argv)
     /* This will be inherited by the server, if it's run */
     ignore_sigpipe();
 
+    /* The read only queries, from the status page of the server */
+    if (command_line.need_server && c_status_query())
+        return 0;
+
     if (command_line.need_server)
     {
+        /* The version goes with the first request */
         ensure_server_up();
-        c_check_version();
     }
 
     switch(command_line.request)
@@ -435,12 +1015,14 @@ int main(int argc, char **argv)
         if (!command_line.need_server)
             error("The command %i needs the server", command_line.request);
         c_new_job();
-        command_line.jobid = c_wait_newjob_ok();
+        command_line.jobid = c_wait_newjob_ok(&done, &errorlevel);
         if (command_line.store_output)
         {
             printf("%i\n", command_line.jobid);
             fflush(stdout);
         }
+        if (done)
+            break;
         if (command_line.should_go_background)
         {
             go_background();
@@ -519,6 +1101,26 @@ int main(int argc, char **argv)
     case c_GET_MAX_SLOTS:
         c_get_max_slots();
         break;
+    case c_SET_START_RATE:
+        c_send_start_rate();
+        break;
+    case c_STATS:
+        c_stats();
+        c_wait_server_lines();
+        break;
+    case c_PIPE:
+        c_pipe();
+        break;
+    case c_WATCH:
+        c_watch(command_line.watch_snapshot);
+        break;
+    case c_RING:
+        c_ring();
+        break;
+    case c_ATTACH:
+        c_attach();
+        errorlevel = c_wait_server_commands();
+        break;
     case c_SWAP_JOBS:
         if (!command_line.need_server)
             error("The command %i needs the server", command_line.request);
@@ -7,7 +7,7 @@
 enum
 {
     CMD_LEN=500,
-    PROTOCOL_VERSION=730
+    PROTOCOL_VERSION=758
 };
 
 enum msg_types
@@ -41,7 +41,20 @@ enum msg_types
     GET_MAX_SLOTS_OK,
     GET_VERSION,
     VERSION,
-    NEWJOB_NOK
+    NEWJOB_NOK,
+    NEWJOB_DUP,
+    NEWJOB_MEMO,
+    SET_START_RATE,
+    STATS,
+    HEDGE,
+    HEDGE_WON,
+    HEDGE_STARTED,
+    SESSION,
+    RESPONSE_END,
+    LIST_DATA,
+    SUBSCRIBE,
+    EVENT,
+    ATTACH
 };
 
 enum Request
@@ -64,7 +77,67 @@ enum Request
     c_INFO,
     c_SET_MAX_SLOTS,
     c_GET_MAX_SLOTS,
-    c_KILL_JOB
+    c_KILL_JOB,
+    c_SET_START_RATE,
+    c_STATS,
+    c_PIPE,
+    c_WATCH,
+    c_RING,
+    c_ATTACH
+};
+
+/* What to do with a new job, if the same one still waits to run */
+enum Unique
+{
+    UNIQUE_NONE,
+    UNIQUE_KEEP, /* Keep the old one, and don't queue the new */
+    UNIQUE_REPLACE /* Remove the old one, and queue the new */
+};
+
+/* Of the list and the job info */
+enum Format
+{
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_BINARY /* Of struct Job_record */
+};
+
+/* The order of the list, by default that of the queue */
+enum List_sort
+{
+    SORT_NONE,
+    SORT_ID,
+    SORT_STATE,
+    SORT_LABEL,
+    SORT_ELEVEL,
+    SORT_RUNTIME,
+    SORT_ENQUEUE
+};
+
+enum List_elevel
+{
+    ELEVEL_ANY,
+    ELEVEL_EQUAL, /* The finished jobs with that errorlevel */
+    ELEVEL_FAILED /* The finished jobs that did not end well */
+};
+
+/* What LIST shows. All zero shows all the jobs. The label pattern goes
+ * with the message. */
+struct List_query
+{
+    int states; /* Bits (1 << state). 0 for any */
+    int jobid_range;
+    int jobid_min;
+    int jobid_max;
+    enum List_elevel elevel;
+    int errorlevel;
+    enum List_sort sort;
+    int reverse;
+    int limit; /* Jobs shown at most. 0 means no limit */
+    int offset; /* Jobs matching skipped */
+    int count; /* Only the number of jobs matching */
+    int label_size; /* Of the label pattern. 0 for any */
+    enum Format format;
 };
 
 struct Command_line {
@@ -89,6 +162,35 @@ struct Command_line {
     } command;
     char *label;
     int num_slots; /* Slots for the job to use. Default 1 */
+    int mem_peak; /* Expected peak memory in KiB. 0 means not declared */
+    int timeout; /* Seconds of run time allowed. 0 means the queue default */
+    int retries; /* Runs to try again on failure */
+    int backoff_min; /* Seconds before the first retry */
+    int backoff_max; /* Seconds between retries, at most */
+    int delay; /* Seconds before the job can start. 0 means none */
+    int deadline; /* Seconds from now to finish the job. 0 means none */
+    int priority; /* Higher preempts lower. 0 is the default */
+    char *gang; /* Name of the gang to join, or 0 */
+    int gang_size;
+    int gang_teardown;
+    char *queue; /* Of the quotas, or 0 */
+    enum Unique unique;
+    char *unique_key; /* 0 for the default, label and command */
+    char **memo_inputs; /* Patterns of the input files, for --memo-inputs */
+    int memo_inputs_num;
+    int hedge; /* Percentile of the run time for a backup copy. 0 if none */
+    int ttl; /* Seconds to start, or the job expires. 0 means the queue's */
+    int interactive; /* Can use the slots reserved for interactive jobs */
+    double start_rate; /* Starts per second. 0 means no limit */
+    int start_burst;
+    struct List_query list;
+    char *list_label; /* Pattern of the labels listed, or 0 */
+    enum Format format; /* Of the list and the info */
+    int watch_snapshot; /* --watch=snapshot: the jobs as they are, first */
+    int *wait_jobids; /* The more of -w, after command_line.jobid */
+    int wait_jobids_num;
+    int wait_all; /* -w --all: all the jobs in the list */
+    int wait_any; /* -w --any: until the first of them ends */
 };
 
 enum Process_type {
@@ -102,6 +204,10 @@ extern enum Process_type process_type;
 extern int server_socket; /* Used in the client */
 
 struct msg;
+struct Flow;
+struct Gang;
+struct Notify;
+struct Quota;
 
 enum Jobstate
 {
@@ -109,7 +215,37 @@ enum Jobstate
     RUNNING,
     FINISHED,
     SKIPPED,
-    HOLDING_CLIENT
+    HOLDING_CLIENT,
+    DELAYED, /* Waiting for a timer before getting queued */
+    PREEMPTED, /* Running, but stopped to give its slots */
+    EXPIRED /* Did not start within its TTL */
+};
+
+/* What the EVENT messages tell the subscribers */
+enum Event
+{
+    EV_SNAPSHOT, /* A job, as it was on SUBSCRIBE */
+    EV_SNAPSHOT_END,
+    EV_ENQUEUED,
+    EV_STATE, /* Started, preempted, back to the queue... */
+    EV_FINISHED, /* With its result; also skipped or expired */
+    EV_REMOVED,
+    EV_CLEARED, /* The finished jobs */
+    EV_REORDERED,
+    EV_SLOTS,
+    EV_LOST /* The subscriber was too slow, and missed some */
+};
+
+/* Why a queued job, that could run by its slots, was not started */
+enum Defer
+{
+    DEFER_NONE,
+    DEFER_MEMORY,
+    DEFER_MEMPRESSURE,
+    DEFER_RATE,
+    DEFER_LABEL_RATE,
+    DEFER_GANG,
+    DEFER_QUOTA
 };
 
 struct msg
@@ -128,13 +264,37 @@ struct msg
             int depend_on; /* -1 means depend on previous */
             int wait_enqueuing;
             int num_slots;
+            int mem_peak;
+            int timeout;
+            int retries;
+            int backoff_min;
+            int backoff_max;
+            int delay;
+            int deadline;
+            int priority;
+            int gang_name_size; /* 0 if not in a gang */
+            int gang_size;
+            int gang_teardown;
+            int queue_name_size; /* 0 if in no queue */
+            enum Unique unique;
+            int unique_key_size;
+            int memo_key_size; /* 0 if not memoized */
+            int hedge;
+            int ttl;
+            int interactive;
+            int argc; /* From the ring: the argv follow the command */
         } newjob;
         struct {
             int ofilename_size;
             int store_output;
             int pid;
+            int memo_key_size; /* Of the inputs as the run starts, or 0 */
         } output;
         int jobid;
+        struct {
+            int jobid;
+            int errorlevel;
+        } memo;
         struct Result {
             int errorlevel;
             int died_by_signal;
@@ -150,9 +310,44 @@ struct msg
             int jobid1;
             int jobid2;
         } swap;
-        int last_errorlevel;
+        struct {
+            int last_errorlevel;
+            int skip; /* Its gang was torn down */
+        } runjob;
         int max_slots;
         int version;
+        struct {
+            double rate;
+            int burst;
+            int label_size;
+        } start_rate;
+        struct List_query list;
+        struct {
+            int jobid;
+            enum Format format;
+        } info;
+        int snapshot; /* Of SUBSCRIBE */
+        struct {
+            int jobid; /* -1 for the last */
+            int jobids_num; /* More, that follow as ints */
+            int all;
+            int any;
+            int label_size; /* The label follows. Instead of the ids */
+        } wait;
+        struct {
+            enum Event type;
+            int jobid;
+            int jobid2; /* Of EV_REORDERED, the job now before it. Else -1 */
+            enum Jobstate state;
+            int errorlevel;
+            int died_by_signal;
+            int signal;
+            float real_ms;
+            int count; /* The max slots of EV_SLOTS and EV_SNAPSHOT_END, the
+                          events lost of EV_LOST */
+            int label_size; /* The label and the command follow */
+            int command_size;
+        } event;
     } u;
 };
 
@@ -164,6 +359,25 @@ struct Procinfo
     struct timeval enqueue_time;
     struct timeval start_time;
     struct timeval end_time;
+    struct timeval suspend_time; /* When last stopped by preemption */
+    float suspended; /* Seconds stopped, not counted as run time */
+};
+
+enum
+{
+    TICK_MS = 10 /* Resolution of the server timers */
+};
+
+struct Timer
+{
+    struct Timer *next;
+    struct Timer *prev;
+    unsigned long expires; /* In ticks */
+    int pending;
+    int level; /* Where it is in the wheel */
+    int index;
+    void (*fire)(struct Timer *t);
+    void *data;
 };
 
 struct Job
@@ -185,6 +399,76 @@ struct Job
     char *label;
     struct Procinfo info;
     int num_slots;
+    int mem_peak; /* KiB, 0 if not declared */
+    enum Defer defer;
+    int timeout; /* Seconds, 0 if none */
+    int timed_out;
+    struct Timer timeout_timer;
+    int retries;
+    int backoff_min; /* Seconds */
+    int backoff_max;
+    int attempts; /* Runs started */
+    struct Timer delay_timer; /* For the DELAYED state */
+    time_t delayed_until; /* Wall clock time to leave DELAYED */
+    int uid; /* Of the submitter, -1 if unknown */
+    struct Flow *flow; /* Of the fair share */
+    time_t deadline; /* 0 if none */
+    int estimate; /* Seconds of run expected, -1 if unknown */
+    int heap_index; /* In the deadline heap, -1 if not there */
+    int priority;
+    int preemptions;
+    struct Gang *gang; /* 0 if none */
+    int gang_torn; /* Its gang was torn down before it started */
+    struct Quota *quota; /* Of its queue, or 0 */
+    char *unique_key; /* While it waits, if --unique or --debounce */
+    int unique_indexed;
+    struct Job *unique_next; /* In the bucket of the index */
+    char *memo_key; /* Of its inputs, or 0 */
+    int hedge; /* Percentile of the run time for a backup copy. 0 if none */
+    int hedge_due; /* Ran past it: a backup copy can start */
+    int hedged; /* The backup copy runs, taking slots too */
+    int backup_pid; /* Of the backup copy, once its client tells. Else 0 */
+    struct Timer hedge_timer;
+    struct Job *hedge_next; /* In the list of those due */
+    time_t expires; /* If not started by then. 0 if no TTL */
+    int expired; /* The TTL passed: to end as EXPIRED */
+    struct Timer ttl_timer;
+    struct Job *expired_next; /* In the list for the server to end */
+    int interactive; /* Goes first, and can use the reserved slots */
+    struct Job *interactive_next; /* In the list of those queued */
+    struct Notify *waiters; /* The clients in -w for it */
+    int status_index; /* In the status page, -1 if not there */
+    int ring_argc; /* From the ring, its argv after the command. Else 0 */
+    struct Timer attach_timer; /* From the ring: for its runner to attach */
+};
+
+/* A job in --format=binary, in host byte order. After it go the command,
+ * the label and the output file name, each with its null, and then the ids
+ * of the jobs depending on it. */
+struct Job_record
+{
+    int size; /* Of the record and all that follows */
+    int jobid;
+    int state; /* enum Jobstate */
+    int pid;
+    int num_slots;
+    int depend_on; /* -1 if none */
+    int errorlevel;
+    int died_by_signal;
+    int signal;
+    int timed_out;
+    int priority;
+    int attempts;
+    double enqueue_time; /* Seconds since the epoch. 0 if not yet */
+    double start_time;
+    double end_time;
+    double real_time; /* Seconds */
+    double user_time;
+    double system_time;
+    int command_size;
+    int label_size; /* 0 if none */
+    int output_size; /* 0 if none */
+    int dependents;
 };
 
 enum ExitCodes
@@ -203,6 +487,8 @@ void c_wait_server_lines();
 void c_clear_finished();
 int c_wait_server_commands();
 void c_send_runjob_ok(const char *ofname, int pid);
+void c_send_hedge_won(const char *ofname, int pid);
+void c_send_hedge_started(int pid);
 int c_tail();
 int c_cat();
 void c_show_output_file();
@@ -213,29 +499,50 @@ int c_wait_job();
 int c_wait_running_job();
 int c_wait_job_recv();
 void c_move_urgent();
-int c_wait_newjob_ok();
+int c_wait_newjob_ok(int *done, int *errorlevel);
 void c_get_state();
 void c_swap_jobs();
 void c_show_info();
 char *build_command_string();
 void c_send_max_slots(int max_slots);
 void c_get_max_slots();
-void c_check_version();
+void c_send_start_rate();
+void c_stats();
+void c_session_open();
+int c_session_answer();
+void c_watch(int snapshot);
 
 /* jobs.c */
-void s_list(int s);
+void s_list(int s, const struct List_query *q, const char *label);
+void s_snapshot(int s);
+void s_update_status();
+void s_continue_preempted();
 int s_newjob(int s, struct msg *m);
+int s_newjob_ring(struct msg *m, const char *data);
+const char * s_ring_argv(int jobid, int *argc);
+void s_ring_wait_attach(int jobid);
+void s_ring_failed(int jobid, const char *why);
+int s_ring_attach(int jobid);
 void s_removejob(int jobid);
 void job_finished(const struct Result *result, int jobid);
+int s_job_retry(const struct Result *result, int jobid);
 int next_run_job();
 void s_mark_job_running(int jobid);
+int s_find_duplicate(int jobid);
+void s_job_replaced(int jobid, int by);
+int s_memo_lookup(int jobid, int *errorlevel);
 void s_clear_finished();
-void s_process_runjob_ok(int jobid, char *oname, int pid);
+void s_process_runjob_ok(int jobid, char *oname, int pid, char *memo_key);
+void s_hedge_won(int jobid, char *oname, int pid);
+void s_hedge_started(int jobid, int pid);
+int next_hedge_job();
+int next_expired_job();
+void s_job_expired(int jobid);
 void s_send_output(int socket, int jobid);
 int s_remove_job(int s, int *jobid);
 void s_remove_notification(int s);
 void check_notify_list(int jobid);
-void s_wait_job(int s, int jobid);
+void s_wait_job(int s, const struct msg *m);
 void s_wait_running_job(int s, int jobid);
 void s_move_urgent(int s, int jobid);
 void s_send_state(int s, int jobid);
@@ -244,10 +551,15 @@ void dump_jobs_struct(FILE *out);
 void dump_notifies_struct(FILE *out);
 void joblist_dump(int fd);
 const char * jstate2string(enum Jobstate s);
-void s_job_info(int s, int jobid);
+const char * defer2string(enum Defer d);
+void s_set_default_timeout(int seconds);
+void s_job_info(int s, int jobid, enum Format format);
 void s_send_runjob(int s, int jobid);
 void s_set_max_slots(int new_max_slots);
+void s_set_interactive_slots(int slots);
 void s_get_max_slots(int s);
+void s_stats(int s);
+void send_list_line(int s, const char * str);
 int job_is_running(int jobid);
 int job_is_holding_client(int jobid);
 int wake_hold_client();
@@ -287,10 +599,21 @@ void block_sigint();
 void unblock_sigint_and_install_handler();
 
 /* msg.c */
-void send_bytes(const int fd, const char *data, int bytes);
+struct msg_part
+{
+    const void *data;
+    int size;
+};
+
 int recv_bytes(const int fd, char *data, int bytes);
 void send_msg(const int fd, const struct msg *m);
+void send_msg_parts(const int fd, const struct msg *m,
+        const struct msg_part *parts, int nparts);
 int recv_msg(const int fd, struct msg *m);
+int frame_msg_parts(char *buf, int size, const struct msg *m,
+        const struct msg_part *parts, int nparts);
+int msg_pending(const int fd);
+void msg_reset(const int fd);
 
 /* msgdump.c */
 void msgdump(FILE *, const struct msg *m);
@@ -301,7 +624,9 @@ void warning_msg(const struct msg *m, const char *str, ...);
 
 /* list.c */
 char * joblist_headers();
-char * joblist_line(const struct Job *p);
+const char * joblist_line(const struct Job *p);
+const char * joblist_json(const struct Job *p, int with_info);
+const char * joblist_binary(const struct Job *p, int *size);
 char * joblistdump_torun(const struct Job *p);
 char * joblistdump_headers();
 
@@ -319,10 +644,128 @@ void pinfo_set_start_time(struct Procinfo *p);
 void pinfo_set_end_time(struct Procinfo *p);
 float pinfo_time_until_now(const struct Procinfo *p);
 float pinfo_time_run(const struct Procinfo *p);
+void pinfo_suspend(struct Procinfo *p);
+void pinfo_resume(struct Procinfo *p);
 void pinfo_init(struct Procinfo *p);
 
 /* env.c */
 char * get_environment();
 
+/* memory.c */
+int parse_size_kb(const char *str);
+int mem_get_headroom(int *headroom);
+int mem_outstanding_kb(const struct Job *p);
+
+/* ratelimit.c */
+int parse_start_rate(const char *str, double *rate, int *burst);
+void s_set_start_rate(const char *label, double rate, int burst);
+void s_start_rate(int s, const struct msg *m);
+enum Defer rate_admissible(const char *label);
+void rate_consume(const char *label);
+
+/* fairshare.c */
+void fs_init();
+int fs_enabled();
+int fs_peer_uid(int s);
+struct Flow * fs_job_flow(int uid, const char *label);
+void fs_begin_pass();
+int fs_has_candidate(const struct Flow *f);
+void fs_offer(struct Job *p);
+struct Job * fs_pick();
+void fs_job_ended(struct Job *p);
+void fs_job_gone(struct Job *p);
+void fs_send_stats(int s, const struct Job *first);
+
+/* deadline.c */
+void edf_insert(struct Job *p);
+void edf_remove(struct Job *p);
+struct Job * edf_first();
+void edf_set_aside(struct Job *p);
+void edf_put_back();
+int edf_estimate(const struct Job *p);
+float edf_percentile(const struct Job *p, int percent);
+void edf_job_ended(const struct Job *p);
+int edf_will_miss(const struct Job *p, time_t now);
+
+/* gang.c */
+struct Gang * gang_join(const char *name, int size, int teardown);
+void gang_leave(struct Job *p);
+int gang_complete(const struct Gang *g);
+int gang_started(const struct Gang *g);
+int gang_size(const struct Gang *g);
+const char * gang_name(const struct Gang *g);
+int gang_first_visit(struct Gang *g, unsigned int pass);
+void gang_start(struct Gang *g, struct Job *first);
+int gang_next_dispatch();
+void gang_member_ended(const struct Job *p, struct Job *first);
+
+/* quota.c */
+void quota_init();
+struct Quota * quota_find(const char *name);
+const char * quota_name(const struct Quota *q);
+int quota_ttl(const struct Quota *q);
+void quota_begin_pass(const struct Job *first,
+        int (*waiting)(const struct Job *p));
+int quota_admissible(const struct Job *p, int free_slots);
+void quota_send_stats(int s);
+
+/* unique.c */
+void unique_set_key(struct Job *p, const char *key);
+struct Job * unique_find(const char *key);
+void unique_insert(struct Job *p);
+void unique_remove(struct Job *p);
+
+/* memo.c */
+char * memo_key();
+void memo_init();
+int memo_lookup(const char *key, int *errorlevel, const char **output,
+        int *jobid);
+void memo_store(const char *key, int errorlevel, const char *output,
+        int jobid);
+void memo_send_stats(int s);
+
+/* timers.c */
+void timers_init();
+unsigned long timers_now();
+int timers_fd();
+void timers_run();
+struct timeval * timers_select_timeout(struct timeval *tv);
+void timer_init(struct Timer *t, void (*fire)(struct Timer *t), void *data);
+void timer_add(struct Timer *t, unsigned long ms);
+void timer_del(struct Timer *t);
+int timer_pending(const struct Timer *t);
+int parse_duration(const char *str);
+
 /* tail.c */
 int tail_file(const char *fname, int last_lines);
+
+/* pipe.c */
+void c_pipe();
+
+/* events.c */
+void events_subscribe(int s);
+void events_unsubscribe(int s);
+int events_subscribed(int s);
+void event_job(int s, enum Event type, const struct Job *p);
+void event_reordered(int jobid, int jobid2);
+void event_count(int s, enum Event type, int count);
+int events_writeset(fd_set *writeset, int maxfd);
+void events_flush(fd_set *writeset);
+
+/* status.c */
+void status_init(const char *socket_path);
+void status_end();
+void status_job(struct Job *p, const int *state_count);
+void status_job_gone(struct Job *p, const int *state_count);
+void status_slots(int busy_slots, int max_slots);
+int c_status_query();
+
+/* ring.c */
+void ring_init(const char *socket_path);
+void ring_end();
+int ring_fd();
+int ring_pending();
+void ring_drain();
+void ring_run(int jobid);
+void c_ring();
+void c_attach();
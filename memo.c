@@ -0,0 +1,384 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Memoization of the job results, for --memo-inputs. The client hashes
+ * what defines the result of the job: the command, the directory, some
+ * environment and the contents of the input files. The server remembers
+ * the key of each successful run, with its output file. A new job of
+ * a known key ends at once, with the output of the run it repeats.
+ * The cache forgets the entries older than TS_MEMO_AGE, and the least
+ * recently used ones when their outputs take more than TS_MEMO_SIZE. */
+
+/* The key: four lanes of 32 bits, each a FNV-1a with its own prime,
+ * mixed at the end. Not against malice, but enough against chance. */
+struct Hash
+{
+    unsigned int lane[4];
+};
+
+static const unsigned int primes[4] =
+    { 16777619u, 2246822519u, 3266489917u, 668265263u };
+
+static void hash_init(struct Hash *h)
+{
+    h->lane[0] = 2166136261u;
+    h->lane[1] = 0x9747b28cu;
+    h->lane[2] = 0x85ebca6bu;
+    h->lane[3] = 0xc2b2ae35u;
+}
+
+static void hash_bytes(struct Hash *h, const void *data, int len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    int i, j;
+
+    for (i = 0; i < len; ++i)
+        for (j = 0; j < 4; ++j)
+            h->lane[j] = (h->lane[j] ^ p[i]) * primes[j];
+}
+
+/* A string, after its length, so "ab","c" and "a","bc" differ */
+static void hash_token(struct Hash *h, const char *tag, const char *str)
+{
+    char len[32];
+
+    sprintf(len, "%s%lu:", tag, (unsigned long) strlen(str));
+    hash_bytes(h, len, strlen(len));
+    hash_bytes(h, str, strlen(str));
+}
+
+static unsigned int fmix(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+static void hash_file(struct Hash *h, const char *path)
+{
+    char buffer[65536];
+    int fd;
+    int res;
+
+    hash_token(h, "f", path);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        hash_token(h, "e", "unreadable");
+        return;
+    }
+    while ((res = read(fd, buffer, sizeof(buffer))) > 0)
+        hash_bytes(h, buffer, res);
+    close(fd);
+    if (res == -1)
+        hash_token(h, "e", "unreadable");
+}
+
+static void hash_inputs(struct Hash *h, const char *patterns)
+{
+    char *copy;
+    char *pattern;
+
+    copy = (char *) malloc(strlen(patterns) + 1);
+    if (copy == 0)
+        error("Cannot allocate the memo inputs");
+    strcpy(copy, patterns);
+
+    for (pattern = strtok(copy, ", "); pattern != 0;
+            pattern = strtok(0, ", "))
+    {
+        glob_t g;
+        unsigned int i;
+
+        /* A missing input counts as such, so its creation changes the key */
+        if (glob(pattern, 0, NULL, &g) != 0)
+        {
+            hash_token(h, "n", pattern);
+            continue;
+        }
+        for (i = 0; i < g.gl_pathc; ++i)
+            hash_file(h, g.gl_pathv[i]);
+        globfree(&g);
+    }
+
+    free(copy);
+}
+
+/* The key of the job in command_line, as a hex string */
+char * memo_key()
+{
+    struct Hash h;
+    char cwd[4096];
+    const char *env;
+    char *key;
+    int i;
+
+    hash_init(&h);
+
+    for (i = 0; i < command_line.command.num; ++i)
+        hash_token(&h, "a", command_line.command.array[i]);
+    if (command_line.label)
+        hash_token(&h, "l", command_line.label);
+    if (getcwd(cwd, sizeof(cwd)) != 0)
+        hash_token(&h, "d", cwd);
+
+    env = getenv("PATH");
+    hash_token(&h, "p", env ? env : "");
+    env = getenv("TS_MEMO_ENV");
+    if (env != 0)
+    {
+        char *copy = (char *) malloc(strlen(env) + 1);
+        char *name;
+
+        if (copy == 0)
+            error("Cannot allocate the memo environment");
+        strcpy(copy, env);
+        for (name = strtok(copy, ","); name != 0; name = strtok(0, ","))
+        {
+            const char *val = getenv(name);
+            hash_token(&h, "v", name);
+            hash_token(&h, val ? "=" : "u", val ? val : "");
+        }
+        free(copy);
+    }
+
+    for (i = 0; i < command_line.memo_inputs_num; ++i)
+        hash_inputs(&h, command_line.memo_inputs[i]);
+
+    key = (char *) malloc(4 * 8 + 1);
+    if (key == 0)
+        error("Cannot allocate the memo key");
+    for (i = 0; i < 4; ++i)
+        sprintf(key + i * 8, "%08x", fmix(h.lane[i]));
+    return key;
+}
+
+/* The server side */
+
+struct Memo
+{
+    char *key;
+    int errorlevel;
+    char *output;
+    int size_kb;
+    int jobid; /* Of the run */
+    time_t created;
+    time_t used;
+    struct Memo *next;
+};
+
+enum
+{
+    MEMO_BUCKETS = 1024
+};
+
+static struct Memo *memos[MEMO_BUCKETS];
+static int memo_count = 0;
+static int total_kb = 0;
+static int max_kb = 1024 * 1024;
+static int max_age = 7 * 24 * 60 * 60;
+static int hits = 0;
+static int misses = 0;
+static int evictions = 0;
+
+void memo_init()
+{
+    const char *str;
+
+    str = getenv("TS_MEMO_SIZE");
+    if (str != NULL)
+    {
+        int kb = parse_size_kb(str);
+        if (kb >= 0)
+            max_kb = kb;
+        else
+            warning("Wrong TS_MEMO_SIZE value \"%s\"", str);
+    }
+
+    str = getenv("TS_MEMO_AGE");
+    if (str != NULL)
+    {
+        int seconds = parse_duration(str);
+        if (seconds > 0)
+            max_age = seconds;
+        else
+            warning("Wrong TS_MEMO_AGE value \"%s\"", str);
+    }
+}
+
+static unsigned int bucket_of(const char *key)
+{
+    unsigned int h = 5381;
+
+    for (; *key != '\0'; ++key)
+        h = h * 33 + (unsigned char) *key;
+    return h % MEMO_BUCKETS;
+}
+
+static void remove_memo(struct Memo **pm)
+{
+    struct Memo *m = *pm;
+
+    *pm = m->next;
+    total_kb -= m->size_kb;
+    --memo_count;
+    free(m->key);
+    free(m->output);
+    free(m);
+}
+
+static struct Memo ** find_memo(const char *key)
+{
+    struct Memo **pm;
+
+    for (pm = &memos[bucket_of(key)]; *pm != 0; pm = &(*pm)->next)
+        if (strcmp((*pm)->key, key) == 0)
+            break;
+    return pm;
+}
+
+/* Makes room for 'need' KiB more, forgetting the old entries, and then the
+ * least recently used */
+static void evict(int need, time_t now)
+{
+    int i;
+
+    for (i = 0; i < MEMO_BUCKETS; ++i)
+    {
+        struct Memo **pm = &memos[i];
+        while (*pm != 0)
+            if (now - (*pm)->created > max_age)
+            {
+                remove_memo(pm);
+                ++evictions;
+            } else
+                pm = &(*pm)->next;
+    }
+
+    while (memo_count > 0 && total_kb + need > max_kb)
+    {
+        struct Memo **lru = 0;
+
+        for (i = 0; i < MEMO_BUCKETS; ++i)
+        {
+            struct Memo **pm;
+            for (pm = &memos[i]; *pm != 0; pm = &(*pm)->next)
+                if (lru == 0 || (*pm)->used < (*lru)->used)
+                    lru = pm;
+        }
+        remove_memo(lru);
+        ++evictions;
+    }
+}
+
+/* Whether there is a result for the key. The output belongs to the
+ * cache. */
+int memo_lookup(const char *key, int *errorlevel, const char **output,
+        int *jobid)
+{
+    struct Memo **pm;
+    struct stat st;
+    time_t now = time(NULL);
+
+    pm = find_memo(key);
+    if (*pm != 0 && (now - (*pm)->created > max_age
+                || stat((*pm)->output, &st) == -1))
+    {
+        /* Too old, or someone removed the output */
+        remove_memo(pm);
+        ++evictions;
+    }
+    if (*pm == 0)
+    {
+        ++misses;
+        return 0;
+    }
+
+    ++hits;
+    (*pm)->used = now;
+    *errorlevel = (*pm)->errorlevel;
+    *output = (*pm)->output;
+    *jobid = (*pm)->jobid;
+    return 1;
+}
+
+/* Remembers the result of a run */
+void memo_store(const char *key, int errorlevel, const char *output,
+        int jobid)
+{
+    struct Memo **pm;
+    struct Memo *m;
+    struct stat st;
+    time_t now = time(NULL);
+    int size_kb;
+
+    if (stat(output, &st) == -1)
+        return;
+    size_kb = (int) ((st.st_size + 1023) / 1024);
+    if (size_kb > max_kb)
+        return;
+
+    pm = find_memo(key);
+    if (*pm != 0)
+        remove_memo(pm);
+    evict(size_kb, now);
+
+    m = (struct Memo *) malloc(sizeof(*m));
+    if (m == 0)
+        return;
+    m->key = (char *) malloc(strlen(key) + 1);
+    m->output = (char *) malloc(strlen(output) + 1);
+    if (m->key == 0 || m->output == 0)
+    {
+        free(m->key);
+        free(m->output);
+        free(m);
+        return;
+    }
+    strcpy(m->key, key);
+    strcpy(m->output, output);
+    m->errorlevel = errorlevel;
+    m->size_kb = size_kb;
+    m->jobid = jobid;
+    m->created = now;
+    m->used = now;
+
+    pm = &memos[bucket_of(key)];
+    m->next = *pm;
+    *pm = m;
+    ++memo_count;
+    total_kb += size_kb;
+}
+
+void memo_send_stats(int s)
+{
+    char line[200];
+    int lookups = hits + misses;
+
+    if (lookups == 0 && memo_count == 0)
+        return;
+
+    snprintf(line, sizeof(line), "Memo: %i results, %i KiB of outputs."
+            " Hits %i, misses %i (%.0f%% hit rate). Evicted %i\n",
+            memo_count, total_kb, hits, misses,
+            lookups ? 100. * hits / lookups : 0., evictions);
+    send_list_line(s, line);
+}
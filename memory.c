@@ -0,0 +1,153 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Memory figures are handled in KiB all over this file, as /proc/meminfo
+ * reports them. */
+
+/* Returns the size in KiB, or -1 if the string cannot be parsed.
+ * Accepts plain bytes, or a K/M/G/T suffix (powers of 1024). */
+int parse_size_kb(const char *str)
+{
+    double val;
+    char *end;
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return -1;
+
+    switch(toupper((unsigned char) *end))
+    {
+        case '\0':
+            val /= 1024.;
+            break;
+        case 'K':
+            break;
+        case 'M':
+            val *= 1024.;
+            break;
+        case 'G':
+            val *= 1024. * 1024.;
+            break;
+        case 'T':
+            val *= 1024. * 1024. * 1024.;
+            break;
+        default:
+            return -1;
+    }
+
+    if (val > 2147483647.)
+        return -1;
+    return (int) val;
+}
+
+/* Reads MemAvailable and MemTotal from /proc/meminfo.
+ * Returns 0 if not found (non linux, etc.) */
+static int read_meminfo(int *available, int *total)
+{
+    FILE *f;
+    char line[100];
+    int found = 0;
+
+    f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return 0;
+
+    while (found != 3 && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (strncmp(line, "MemAvailable:", 13) == 0)
+        {
+            *available = atoi(line + 13);
+            found |= 1;
+        }
+        else if (strncmp(line, "MemTotal:", 9) == 0)
+        {
+            *total = atoi(line + 9);
+            found |= 2;
+        }
+    }
+    fclose(f);
+
+    return found == 3;
+}
+
+/* The resident memory of the process group leader of a job, in KiB.
+ * Its children are not accounted, but it's good enough for the usual
+ * "one big process" jobs. */
+static int job_rss_kb(int pid)
+{
+    FILE *f;
+    char name[40];
+    long size, resident;
+    int res;
+
+    if (pid <= 0)
+        return 0;
+
+    sprintf(name, "/proc/%i/statm", pid);
+    f = fopen(name, "r");
+    if (f == NULL)
+        return 0;
+    res = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+    if (res != 2)
+        return 0;
+
+    return (int) (resident * (sysconf(_SC_PAGESIZE) / 1024));
+}
+
+/* Memory we keep free for the system. TS_MEMRESERVE, or 1/32 of the RAM. */
+static int get_mem_reserve(int memtotal)
+{
+    const char *str;
+
+    str = getenv("TS_MEMRESERVE");
+    if (str != NULL)
+    {
+        int reserve;
+        reserve = parse_size_kb(str);
+        if (reserve >= 0)
+            return reserve;
+        warning("Wrong TS_MEMRESERVE value \"%s\"", str);
+    }
+
+    return memtotal / 32;
+}
+
+/* Sets *headroom to the memory the jobs can still take without getting
+ * into the reserve, in KiB. Returns 0 if we cannot know. */
+int mem_get_headroom(int *headroom)
+{
+    int available;
+    int memtotal;
+
+    if (!read_meminfo(&available, &memtotal))
+        return 0;
+
+    *headroom = available - get_mem_reserve(memtotal);
+    return 1;
+}
+
+/* What the running job p may still allocate, of its declared peak */
+int mem_outstanding_kb(const struct Job *p)
+{
+    int rss;
+
+    if (p->mem_peak <= 0)
+        return 0;
+
+    rss = job_rss_kb(p->pid);
+    if (rss >= p->mem_peak)
+        return 0;
+    return p->mem_peak - rss;
+}
@@ -6,79 +6,344 @@
 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "main.h"
 
-void send_bytes(const int fd, const char *data, int bytes)
+/* The messages go in frames: a header, and the payload. The header has the
+ * magic "ts", the frame version, a byte reserved, and the length of the
+ * payload and the PROTOCOL_VERSION of the sender, both in network order.
+ * The payload is the struct msg, followed by the bytes that go with it (the
+ * command, the label...). A whole request goes out in one writev(), and the
+ * frames are parsed from a buffer kept for each descriptor, so a recv() may
+ * bring many of them, or part of one.
+ *
+ * As every frame has the protocol, the first request of a client is also
+ * its version check. A frame of another protocol reads as a VERSION message
+ * with it: the server answers it with its own VERSION and closes, and the
+ * client ends with an error. */
+
+enum
 {
-    int res;
-    int offset = 0;
+    FRAME_HEADER = 12,
+    FRAME_VERSION = 2,
+    FRAME_MAX = 64 * 1024 * 1024,
+    FRAME_MAX_PARTS = 16,
+    READER_SIZE = 4096
+};
+
+struct Reader
+{
+    char *buf;
+    int size;
+    int start; /* The first byte not taken */
+    int end; /* After the last byte received */
+    int frame_left; /* Of the payload of the last frame, not taken */
+};
+
+/* By descriptor */
+static struct Reader *readers = 0;
+static int readers_size = 0;
+
+static struct Reader * get_reader(int fd)
+{
+    if (fd >= readers_size)
+    {
+        int new_size = fd + 16;
+
+        readers = (struct Reader *) realloc(readers,
+                new_size * sizeof(*readers));
+        if (readers == 0)
+            error("Cannot allocate the message readers");
+        memset(readers + readers_size, 0,
+                (new_size - readers_size) * sizeof(*readers));
+        readers_size = new_size;
+    }
+    return &readers[fd];
+}
+
+/* Receives until the buffer has 'need' bytes not taken. Returns 1, 0 on
+ * end of file, or -1 on error. */
+static int fill(struct Reader *r, int fd, int need)
+{
+    if (r->start == r->end)
+        r->start = r->end = 0;
+
+    if (r->start + need > r->size)
+    {
+        /* Move what is left to the front, and grow if needed */
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        if (need > r->size)
+        {
+            int new_size = need > READER_SIZE ? need : READER_SIZE;
+
+            r->buf = (char *) realloc(r->buf, new_size);
+            if (r->buf == 0)
+                error("Cannot allocate the message reader of %i", fd);
+            r->size = new_size;
+        }
+    }
+
+    while (r->end - r->start < need)
+    {
+        int res = recv(fd, r->buf + r->end, r->size - r->end, 0);
+
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return res;
+        r->end += res;
+    }
+    return 1;
+}
+
+/* Copies what the buffer has, up to 'bytes' */
+static int take(struct Reader *r, char *data, int bytes)
+{
+    int avail = r->end - r->start;
+
+    if (bytes > avail)
+        bytes = avail;
+    if (data != 0)
+        memcpy(data, r->buf + r->start, bytes);
+    r->start += bytes;
+    return bytes;
+}
 
-    while(1)
+static void write_all(int fd, struct iovec *iov, int niov, int bytes)
+{
+    while (bytes > 0)
     {
-        res = send(fd, data + offset, bytes, 0);
-        if(res == -1)
+        int res = writev(fd, iov, niov);
+
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1)
         {
             warning("Sending %i bytes to %i.", bytes, fd);
-            break;
+            return;
         }
-        if(res == bytes)
-            break;
-        offset += res;
         bytes -= res;
+        /* Skip what went out */
+        while (niov > 0 && res >= (int) iov->iov_len)
+        {
+            res -= iov->iov_len;
+            ++iov;
+            --niov;
+        }
+        if (niov > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+}
+
+/* The iovec of the frame of the message and its parts. Returns the number
+ * of entries, and the bytes in *bytes. */
+static int frame_iov(unsigned char *header, struct iovec *iov,
+        const struct msg *m, const struct msg_part *parts, int nparts,
+        int *bytes)
+{
+    unsigned long len = sizeof(*m);
+    int niov = 0;
+    int i;
+
+    if (nparts > FRAME_MAX_PARTS)
+        error("Too many parts for a message: %i", nparts);
+
+    if (0)
+        msgdump(stderr, m);
+
+    iov[niov].iov_base = (void *) header;
+    iov[niov++].iov_len = FRAME_HEADER;
+    iov[niov].iov_base = (void *) m;
+    iov[niov++].iov_len = sizeof(*m);
+    for (i = 0; i < nparts; ++i)
+    {
+        if (parts[i].size <= 0)
+            continue;
+        iov[niov].iov_base = (void *) parts[i].data;
+        iov[niov++].iov_len = parts[i].size;
+        len += parts[i].size;
+    }
+
+    header[0] = 't';
+    header[1] = 's';
+    header[2] = FRAME_VERSION;
+    header[3] = 0;
+    header[4] = (len >> 24) & 0xff;
+    header[5] = (len >> 16) & 0xff;
+    header[6] = (len >> 8) & 0xff;
+    header[7] = len & 0xff;
+    header[8] = (PROTOCOL_VERSION >> 24) & 0xff;
+    header[9] = (PROTOCOL_VERSION >> 16) & 0xff;
+    header[10] = (PROTOCOL_VERSION >> 8) & 0xff;
+    header[11] = PROTOCOL_VERSION & 0xff;
+
+    *bytes = len + FRAME_HEADER;
+    return niov;
+}
+
+/* Sends the message and its parts in a single frame */
+void send_msg_parts(const int fd, const struct msg *m,
+        const struct msg_part *parts, int nparts)
+{
+    unsigned char header[FRAME_HEADER];
+    struct iovec iov[FRAME_MAX_PARTS + 2];
+    int niov;
+    int bytes;
+
+    niov = frame_iov(header, iov, m, parts, nparts, &bytes);
+    write_all(fd, iov, niov, bytes);
+}
+
+/* Writes the frame into buf, to be sent later, if it has room for it.
+ * Returns the size of the frame. */
+int frame_msg_parts(char *buf, int size, const struct msg *m,
+        const struct msg_part *parts, int nparts)
+{
+    unsigned char header[FRAME_HEADER];
+    struct iovec iov[FRAME_MAX_PARTS + 2];
+    int niov;
+    int bytes;
+    int i;
+
+    niov = frame_iov(header, iov, m, parts, nparts, &bytes);
+    if (bytes > size)
+        return bytes;
+
+    for (i = 0; i < niov; ++i)
+    {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
     }
+    return bytes;
 }
 
+void send_msg(const int fd, const struct msg *m)
+{
+    send_msg_parts(fd, m, 0, 0);
+}
+
+/* The bytes sent as parts of the last message received */
 int recv_bytes(const int fd, char *data, int bytes)
 {
-    int res;
+    struct Reader *r = get_reader(fd);
     int offset = 0;
 
-    while(1)
+    if (bytes > r->frame_left)
     {
-        res = recv(fd, data + offset, bytes, 0);
-        if(res == -1)
+        warning("Receiving %i bytes from %i, and the message has %i.",
+                bytes, fd, r->frame_left);
+        bytes = r->frame_left;
+    }
+
+    while (offset < bytes)
+    {
+        int res = fill(r, fd, 1);
+
+        if (res <= 0)
         {
             warning("Receiving %i bytes from %i.", bytes, fd);
-            break;
+            return -1;
         }
-        if(res == bytes)
-            break;
-        offset += res;
-        bytes -= res;
+        offset += take(r, data + offset, bytes - offset);
     }
+    r->frame_left -= bytes;
 
-    return res;
+    return bytes;
 }
 
-void send_msg(const int fd, const struct msg *m)
+int recv_msg(const int fd, struct msg *m)
 {
+    struct Reader *r = get_reader(fd);
+    unsigned char *h;
+    unsigned long len;
+    int version;
     int res;
 
+    /* Skip the parts of the last message that no one wanted */
+    while (r->frame_left > 0)
+    {
+        res = fill(r, fd, 1);
+        if (res <= 0)
+            return res;
+        r->frame_left -= take(r, 0, r->frame_left);
+    }
+
+    res = fill(r, fd, FRAME_HEADER);
+    if (res == 0 && r->start == r->end)
+        return 0;
+    if (res <= 0)
+    {
+        warning("Receiving a message from %i.", fd);
+        return -1;
+    }
+
+    h = (unsigned char *) r->buf + r->start;
+    len = ((unsigned long) h[4] << 24) | ((unsigned long) h[5] << 16)
+        | ((unsigned long) h[6] << 8) | h[7];
+    version = (h[8] << 24) | (h[9] << 16) | (h[10] << 8) | h[11];
+    if (h[0] != 't' || h[1] != 's' || h[2] != FRAME_VERSION)
+    {
+        warning("Receiving a message from %i of frame version %i, "
+                "instead of %i.", fd, h[2], FRAME_VERSION);
+        return -1;
+    }
+    if (version != PROTOCOL_VERSION)
+    {
+        /* Its msg may not be like ours. The payload is skipped. */
+        if (process_type == CLIENT)
+            error("Wrong server version. Received %i, expecting %i",
+                    version, PROTOCOL_VERSION);
+        r->start += FRAME_HEADER;
+        r->frame_left = len;
+        memset(m, 0, sizeof(*m));
+        m->type = VERSION;
+        m->u.version = version;
+        return sizeof(*m);
+    }
+    if (len < sizeof(*m) || len > FRAME_MAX)
+    {
+        warning("Receiving a message from %i of %lu bytes.", fd, len);
+        return -1;
+    }
+    r->start += FRAME_HEADER;
+
+    res = fill(r, fd, sizeof(*m));
+    if (res <= 0)
+    {
+        warning("Receiving a message from %i.", fd);
+        return -1;
+    }
+    take(r, (char *) m, sizeof(*m));
+    r->frame_left = len - sizeof(*m);
+
     if (0)
         msgdump(stderr, m);
-    res = send(fd, m, sizeof(*m), 0);
-    if(res == -1 || res != sizeof(*m))
-        warning_msg(m, "Sending a message to %i, sent %i bytes, should "
-                "send %i.", fd,
-                res, sizeof(*m));
+
+    return sizeof(*m);
 }
 
-int recv_msg(const int fd, struct msg *m)
+/* Whether there are bytes received, and not taken. select() will not tell
+ * about them. */
+int msg_pending(const int fd)
 {
-    int res;
+    return fd < readers_size && readers[fd].start < readers[fd].end;
+}
 
-    res = recv(fd, m, sizeof(*m), 0);
-    if(res == -1)
-        warning_msg(m, "Receiving a message from %i.", fd);
-    if (res == sizeof(*m) && 0)
-        msgdump(stderr, m);
-    if (res != sizeof(*m) && res > 0)
-        warning_msg(m, "Receiving a message from %i, received %i bytes, "
-                "should have received %i.", fd,
-                res, sizeof(*m));
+/* The descriptor is a new connection */
+void msg_reset(const int fd)
+{
+    struct Reader *r = get_reader(fd);
 
-    return res;
+    r->start = r->end = 0;
+    r->frame_left = 0;
 }
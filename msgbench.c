@@ -0,0 +1,233 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* Benchmark of the framing of msg.c against the old way: the raw struct
+ * msg in a send(), and each payload in a send() of its own. A client sends
+ * requests like those of a new job (the message, the command, the label and
+ * the environment) to a server process, that answers each one. */
+
+static const char command[] = "make -C /home/user/src/project -j4 all";
+static const char label[] = "build";
+static char environment[2048];
+
+/* msg.c needs these, from error.c */
+enum Process_type process_type = CLIENT;
+
+void error(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(-1);
+}
+
+void warning(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+void warning_msg(const struct msg *m, const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+/* The old path */
+static void old_send(int fd, const void *data, int bytes)
+{
+    int res;
+
+    while (bytes > 0)
+    {
+        res = send(fd, data, bytes, 0);
+        if (res == -1)
+            error("old_send");
+        data = (const char *) data + res;
+        bytes -= res;
+    }
+}
+
+static int old_recv(int fd, void *data, int bytes)
+{
+    int res;
+    int offset = 0;
+
+    while (offset < bytes)
+    {
+        res = recv(fd, (char *) data + offset, bytes - offset, 0);
+        if (res <= 0)
+            return res;
+        offset += res;
+    }
+    return offset;
+}
+
+static void fill_request(struct msg *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->type = NEWJOB;
+    m->u.newjob.command_size = sizeof(command);
+    m->u.newjob.label_size = sizeof(label);
+    m->u.newjob.env_size = sizeof(environment);
+}
+
+static void old_client(int fd, int requests)
+{
+    struct msg m;
+    int i;
+
+    for (i = 0; i < requests; ++i)
+    {
+        fill_request(&m);
+        old_send(fd, &m, sizeof(m));
+        old_send(fd, command, m.u.newjob.command_size);
+        old_send(fd, label, m.u.newjob.label_size);
+        old_send(fd, environment, m.u.newjob.env_size);
+        if (old_recv(fd, &m, sizeof(m)) != sizeof(m))
+            error("old_client");
+    }
+}
+
+static void old_server(int fd)
+{
+    struct msg m;
+    char buffer[4096];
+
+    while (old_recv(fd, &m, sizeof(m)) == sizeof(m))
+    {
+        old_recv(fd, buffer, m.u.newjob.command_size);
+        old_recv(fd, buffer, m.u.newjob.label_size);
+        old_recv(fd, buffer, m.u.newjob.env_size);
+        m.type = NEWJOB_OK;
+        old_send(fd, &m, sizeof(m));
+    }
+}
+
+/* The framed path */
+static void new_client(int fd, int requests)
+{
+    struct msg m;
+    struct msg_part parts[3];
+    int i;
+
+    for (i = 0; i < requests; ++i)
+    {
+        fill_request(&m);
+        parts[0].data = command;
+        parts[0].size = m.u.newjob.command_size;
+        parts[1].data = label;
+        parts[1].size = m.u.newjob.label_size;
+        parts[2].data = environment;
+        parts[2].size = m.u.newjob.env_size;
+        send_msg_parts(fd, &m, parts, 3);
+        if (recv_msg(fd, &m) != sizeof(m))
+            error("new_client");
+    }
+}
+
+static void new_server(int fd)
+{
+    struct msg m;
+    char buffer[4096];
+
+    while (recv_msg(fd, &m) == sizeof(m))
+    {
+        recv_bytes(fd, buffer, m.u.newjob.command_size);
+        recv_bytes(fd, buffer, m.u.newjob.label_size);
+        recv_bytes(fd, buffer, m.u.newjob.env_size);
+        m.type = NEWJOB_OK;
+        send_msg(fd, &m);
+    }
+}
+
+static double run(const char *name, void (*client)(int, int),
+        void (*server)(int), int requests)
+{
+    int fds[2];
+    int pid;
+    struct timeval start, end;
+    double seconds;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        error("socketpair");
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1)
+        error("fork");
+    if (pid == 0)
+    {
+        close(fds[0]);
+        msg_reset(fds[1]);
+        server(fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+    msg_reset(fds[0]);
+
+    gettimeofday(&start, NULL);
+    client(fds[0], requests);
+    gettimeofday(&end, NULL);
+
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    seconds = end.tv_sec - start.tv_sec
+        + (end.tv_usec - start.tv_usec) / 1000000.;
+    printf("%-8s %8i requests  %8.3fs  %8.2f us/request  %9.0f requests/s\n",
+            name, requests, seconds, seconds * 1000000. / requests,
+            requests / seconds);
+    return seconds;
+}
+
+int main(int argc, char **argv)
+{
+    int requests = 100000;
+    double old_time, new_time;
+
+    if (argc > 1)
+        requests = atoi(argv[1]);
+    if (requests <= 0)
+    {
+        fprintf(stderr, "usage: msgbench [requests]\n");
+        return 1;
+    }
+
+    memset(environment, 'e', sizeof(environment) - 1);
+    environment[sizeof(environment) - 1] = '\0';
+
+    printf("struct msg: %i bytes. Payload: %i bytes\n", (int) sizeof(struct msg),
+            (int) (sizeof(command) + sizeof(label) + sizeof(environment)));
+    old_time = run("old", old_client, old_server, requests);
+    new_time = run("framed", new_client, new_server, requests);
+    printf("framed/old time: %.2f\n", new_time / old_time);
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* ts --pipe: a session with the server, taking the requests from stdin, one
+ * a line:
+ *   list, stats, slots, state [id], info [id], output [id]
+ * They go out as they come, without waiting for the answers, up to
+ * PIPE_WINDOW of them. Each answer ends in a line with a single dot. */
+
+enum
+{
+    PIPE_WINDOW = 64,
+    LINE_SIZE = 1024
+};
+
+static char line_buf[LINE_SIZE];
+static int line_len = 0;
+static int outstanding = 0;
+
+/* Prints the next answer */
+static void answer()
+{
+    if (!c_session_answer())
+        error("The server closed the session");
+    printf(".\n");
+    --outstanding;
+    if (!msg_pending(server_socket))
+        fflush(stdout);
+}
+
+/* Fills the message for the request of the line. Returns 0 if wrong. */
+static int parse_request(const char *line, struct msg *m)
+{
+    char name[20];
+    int jobid = -1;
+    int n;
+
+    n = sscanf(line, "%19s %i", name, &jobid);
+    if (n < 1)
+        return 0;
+
+    /* The defaults of the requests */
+    memset(&m->u, 0, sizeof(m->u));
+    m->u.jobid = jobid;
+    if (strcmp(name, "list") == 0 && n == 1)
+        m->type = LIST;
+    else if (strcmp(name, "stats") == 0 && n == 1)
+        m->type = STATS;
+    else if (strcmp(name, "slots") == 0 && n == 1)
+        m->type = GET_MAX_SLOTS;
+    else if (strcmp(name, "state") == 0)
+        m->type = GET_STATE;
+    else if (strcmp(name, "info") == 0)
+        m->type = INFO;
+    else if (strcmp(name, "output") == 0)
+        m->type = ASK_OUTPUT;
+    else
+        return 0;
+    return 1;
+}
+
+static void request(const char *line)
+{
+    struct msg m;
+
+    if (line[strspn(line, " \t")] == '\0')
+        return;
+
+    if (!parse_request(line, &m))
+    {
+        /* In order with the answers */
+        while (outstanding > 0)
+            answer();
+        printf("Wrong request: %s\n.\n", line);
+        fflush(stdout);
+        return;
+    }
+
+    send_msg(server_socket, &m);
+    ++outstanding;
+}
+
+/* Sends the complete lines received, while the window has room. Returns
+ * whether a line is left. */
+static int send_lines()
+{
+    char *end;
+
+    while (outstanding < PIPE_WINDOW
+            && (end = memchr(line_buf, '\n', line_len)) != 0)
+    {
+        int len = end - line_buf;
+
+        *end = '\0';
+        request(line_buf);
+        memmove(line_buf, end + 1, line_len - len - 1);
+        line_len -= len + 1;
+    }
+    return memchr(line_buf, '\n', line_len) != 0;
+}
+
+void c_pipe()
+{
+    int eof = 0;
+
+    c_session_open();
+
+    while (!eof || line_len > 0 || outstanding > 0)
+    {
+        fd_set readset;
+        int maxfd = server_socket;
+        int lines_left;
+
+        lines_left = send_lines();
+
+        if (eof && !lines_left && line_len > 0)
+        {
+            /* The last line, without newline */
+            line_buf[line_len] = '\0';
+            line_len = 0;
+            request(line_buf);
+            continue;
+        }
+
+        if (msg_pending(server_socket))
+        {
+            answer();
+            continue;
+        }
+
+        FD_ZERO(&readset);
+        if (!eof && !lines_left && line_len < LINE_SIZE - 1)
+            FD_SET(0, &readset);
+        if (outstanding > 0)
+            FD_SET(server_socket, &readset);
+
+        if (!FD_ISSET(0, &readset) && outstanding == 0)
+        {
+            if (line_len >= LINE_SIZE - 1)
+                error("Line too long in the requests of --pipe");
+            continue;
+        }
+
+        if (select(maxfd + 1, &readset, NULL, NULL, NULL) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error("select in c_pipe");
+        }
+
+        if (FD_ISSET(server_socket, &readset))
+            answer();
+
+        if (FD_ISSET(0, &readset))
+        {
+            int res = read(0, line_buf + line_len, LINE_SIZE - 1 - line_len);
+
+            if (res == -1 && errno != EINTR)
+                error("Reading the requests of --pipe");
+            if (res == 0)
+                eof = 1;
+            if (res > 0)
+                line_len += res;
+        }
+    }
+    fflush(stdout);
+}
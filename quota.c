@@ -0,0 +1,273 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Slot quotas of the queues sharing the server. The queues form a tree by
+ * their names ("io", "io/net", "io/disk"), and each one can have a
+ * guaranteed minimum of slots, out of the slots of its parent. The slots
+ * are not partitioned: a queue can borrow the slots that others don't use.
+ * But while a queue with waiting jobs is under its minimum, the slots it
+ * misses are reserved for it: the queues over their own minimum cannot
+ * take them, so they go back to the owner as the borrowers end. */
+
+struct Quota
+{
+    char *name; /* The full path */
+    int min; /* Guaranteed slots */
+    int ttl; /* Default TTL of its jobs, seconds. 0 to take the parent's */
+    struct Quota *parent;
+    struct Quota *children;
+    struct Quota *next;
+
+    /* Computed in every dispatch pass */
+    int running; /* Slots of the running jobs, including those below */
+    int demand; /* Slots of the jobs waiting to run, including below */
+    int reserved;
+};
+
+/* The top level queues */
+static struct Quota *first_quota = 0;
+static int any_minimum = 0;
+
+static struct Quota * new_quota(struct Quota *parent, const char *name,
+        int len)
+{
+    struct Quota *q;
+    struct Quota **pq;
+
+    q = (struct Quota *) malloc(sizeof(*q));
+    if (q == 0)
+        error("Cannot allocate a queue quota");
+    memset(q, 0, sizeof(*q));
+    q->name = (char *) malloc(len + 1);
+    if (q->name == 0)
+        error("Cannot allocate a queue quota");
+    strncpy(q->name, name, len);
+    q->name[len] = '\0';
+    q->parent = parent;
+
+    /* Append, so the stats go in order of creation */
+    pq = parent ? &parent->children : &first_quota;
+    while (*pq != 0)
+        pq = &(*pq)->next;
+    *pq = q;
+
+    return q;
+}
+
+/* The queue of that path, created with its parents if they don't exist */
+struct Quota * quota_find(const char *name)
+{
+    struct Quota *parent = 0;
+    struct Quota *q = 0;
+    const char *end = name;
+
+    do
+    {
+        end = strchr(end, '/');
+        {
+            int len = end ? end - name : (int) strlen(name);
+
+            for (q = parent ? parent->children : first_quota; q != 0;
+                    q = q->next)
+                if ((int) strlen(q->name) == len
+                        && strncmp(q->name, name, len) == 0)
+                    break;
+            if (q == 0)
+                q = new_quota(parent, name, len);
+        }
+        parent = q;
+        if (end != 0)
+            ++end;
+    } while (end != 0);
+
+    return q;
+}
+
+static int set_min(struct Quota *q, const char *value)
+{
+    int min = atoi(value);
+
+    if (min <= 0)
+        return 0;
+    q->min = min;
+    any_minimum = 1;
+    return 1;
+}
+
+static int set_ttl(struct Quota *q, const char *value)
+{
+    char str[100];
+    int ttl;
+
+    strncpy(str, value, sizeof(str) - 1);
+    str[sizeof(str) - 1] = '\0';
+    str[strcspn(str, ",")] = '\0';
+    ttl = parse_duration(str);
+    if (ttl <= 0)
+        return 0;
+    q->ttl = ttl;
+    return 1;
+}
+
+/* Reads a list of queues and values, like "io:4,io/net:2,cpu:2" */
+static void read_queue_list(const char *var,
+        int (*set)(struct Quota *q, const char *value))
+{
+    const char *p = getenv(var);
+
+    while (p != 0 && *p != '\0')
+    {
+        char name[200];
+        int len = strcspn(p, ":,");
+
+        if (len > 0 && len < (int) sizeof(name) && p[len] == ':')
+        {
+            strncpy(name, p, len);
+            name[len] = '\0';
+            if (!set(quota_find(name), p + len + 1))
+                warning("Wrong %s value for \"%s\"", var, name);
+        } else
+            warning("Wrong %s value \"%s\"", var, p);
+
+        p = strchr(p, ',');
+        if (p != 0)
+            ++p;
+    }
+}
+
+/* Reads TS_QUEUES, the minimum slots, like "io:4,io/net:2,io/disk:2,cpu:2",
+ * and TS_QUEUE_TTL, the default TTL, like "nightly:12h,io/net:30m" */
+void quota_init()
+{
+    read_queue_list("TS_QUEUES", set_min);
+    read_queue_list("TS_QUEUE_TTL", set_ttl);
+}
+
+const char * quota_name(const struct Quota *q)
+{
+    return q->name;
+}
+
+/* The default TTL of the jobs of the queue, inherited from its parents.
+ * 0 if none. */
+int quota_ttl(const struct Quota *q)
+{
+    for (; q != 0; q = q->parent)
+        if (q->ttl > 0)
+            return q->ttl;
+    return 0;
+}
+
+static void clear_counts(struct Quota *q)
+{
+    for (; q != 0; q = q->next)
+    {
+        q->running = q->demand = q->reserved = 0;
+        clear_counts(q->children);
+    }
+}
+
+static void compute_reserved(struct Quota *q)
+{
+    for (; q != 0; q = q->next)
+    {
+        int missing = q->min - q->running;
+
+        q->reserved = missing < q->demand ? missing : q->demand;
+        if (q->reserved < 0)
+            q->reserved = 0;
+        compute_reserved(q->children);
+    }
+}
+
+/* Recounts the slots used and wanted by each queue, from the jobs.
+ * 'first' is the first queued or running job; 'waiting' tells whether a
+ * queued job may run now, leaving the slots apart. */
+void quota_begin_pass(const struct Job *first,
+        int (*waiting)(const struct Job *p))
+{
+    const struct Job *p;
+    struct Quota *q;
+
+    if (first_quota == 0)
+        return;
+
+    clear_counts(first_quota);
+    for (p = first; p != 0; p = p->next)
+    {
+        if (p->quota == 0)
+            continue;
+        if (p->state == RUNNING)
+            for (q = p->quota; q != 0; q = q->parent)
+                q->running += p->num_slots;
+        else if (p->state == QUEUED && waiting(p))
+            for (q = p->quota; q != 0; q = q->parent)
+                q->demand += p->num_slots;
+    }
+    compute_reserved(first_quota);
+}
+
+/* Whether the job can take its slots out of the free ones, without taking
+ * those reserved for other queues. At each level where its queue stays
+ * within its minimum, it uses its own share, so the reservations of the
+ * sibling queues don't matter there. */
+int quota_admissible(const struct Job *p, int free_slots)
+{
+    struct Quota *q;
+    struct Quota *sibling;
+    int available = free_slots;
+
+    if (!any_minimum)
+        return 1;
+
+    if (p->quota == 0)
+    {
+        for (sibling = first_quota; sibling != 0; sibling = sibling->next)
+            available -= sibling->reserved;
+        return p->num_slots <= available;
+    }
+
+    for (q = p->quota; q != 0; q = q->parent)
+    {
+        if (q->running + p->num_slots <= q->min)
+            continue;
+        for (sibling = q->parent ? q->parent->children : first_quota;
+                sibling != 0; sibling = sibling->next)
+            if (sibling != q)
+                available -= sibling->reserved;
+    }
+
+    return p->num_slots <= available;
+}
+
+static void send_quota_lines(int s, const struct Quota *q)
+{
+    char line[300];
+
+    for (; q != 0; q = q->next)
+    {
+        snprintf(line, sizeof(line), "%-20s %6i %7i %6i %8i\n",
+                q->name, q->min, q->running, q->demand, q->reserved);
+        send_list_line(s, line);
+        send_quota_lines(s, q->children);
+    }
+}
+
+/* The queue quota section of the stats, as of the last dispatch pass */
+void quota_send_stats(int s)
+{
+    if (first_quota == 0)
+        return;
+
+    send_list_line(s, "Queue                   Min Running Queued Reserved\n");
+    send_quota_lines(s, first_quota);
+}
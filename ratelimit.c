@@ -0,0 +1,240 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* Limits of the job start rate, as token buckets. Each start takes a token,
+ * and the tokens come back at the given rate, up to the burst. There is a
+ * bucket for the whole queue, and one for every label given a limit.
+ * When a job cannot start for the lack of tokens, a timer wakes the server
+ * when the next token comes. */
+
+struct Bucket
+{
+    char *label; /* 0 for the whole queue */
+    double rate; /* Tokens per second */
+    double burst;
+    double tokens;
+    unsigned long last; /* Tick of the last refill */
+    struct Bucket *next;
+};
+
+static struct Bucket *queue_bucket = 0;
+static struct Bucket *first_label_bucket = 0;
+
+static struct Timer refill_timer;
+static int refill_timer_ready = 0;
+static unsigned long refill_tick; /* Valid if the timer is pending */
+
+/* Returns 0 if the string cannot be parsed.
+ * Accepts "<num>[/s|/m|/h][ burst <num>]", or "off" for no limit. */
+int parse_start_rate(const char *str, double *rate, int *burst)
+{
+    char *end;
+    double val;
+
+    if (strcmp(str, "off") == 0)
+    {
+        *rate = 0;
+        return 1;
+    }
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return 0;
+
+    if (*end == '/')
+    {
+        ++end;
+        switch(tolower((unsigned char) *end))
+        {
+            case 's':
+                break;
+            case 'm':
+                val /= 60.;
+                break;
+            case 'h':
+                val /= 60. * 60.;
+                break;
+            default:
+                return 0;
+        }
+        ++end;
+    }
+    *rate = val;
+
+    while (isspace((unsigned char) *end))
+        ++end;
+    if (*end == '\0')
+        return 1;
+
+    if (strncmp(end, "burst", 5) != 0)
+        return 0;
+    end += 5;
+    *burst = (int) strtol(end, &end, 10);
+    if (*burst < 1 || *end != '\0')
+        return 0;
+    return 1;
+}
+
+static void refill(struct Bucket *b, unsigned long now)
+{
+    b->tokens += (double) (now - b->last) * TICK_MS / 1000. * b->rate;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last = now;
+}
+
+static struct Bucket ** find_bucket(const char *label)
+{
+    struct Bucket **pb;
+
+    if (label == 0)
+        return &queue_bucket;
+
+    pb = &first_label_bucket;
+    while (*pb != 0 && strcmp((*pb)->label, label) != 0)
+        pb = &(*pb)->next;
+    return pb;
+}
+
+/* A rate of 0 removes the limit */
+void s_set_start_rate(const char *label, double rate, int burst)
+{
+    struct Bucket **pb;
+    struct Bucket *b;
+
+    pb = find_bucket(label);
+    b = *pb;
+
+    if (rate <= 0)
+    {
+        if (b != 0)
+        {
+            *pb = b->next;
+            free(b->label);
+            free(b);
+        }
+        return;
+    }
+
+    if (b == 0)
+    {
+        b = (struct Bucket *) malloc(sizeof(*b));
+        if (b == 0)
+            error("Cannot allocate the start rate bucket");
+        b->label = 0;
+        if (label != 0)
+        {
+            b->label = (char *) malloc(strlen(label) + 1);
+            if (b->label == 0)
+                error("Cannot allocate the start rate bucket");
+            strcpy(b->label, label);
+        }
+        b->next = 0;
+        *pb = b;
+    }
+
+    /* A new limit starts with the bucket full */
+    b->rate = rate;
+    b->burst = burst < 1 ? 1 : burst;
+    b->tokens = b->burst;
+    b->last = timers_now();
+}
+
+/* The SET_START_RATE message, followed by the label if any */
+void s_start_rate(int s, const struct msg *m)
+{
+    char *label = 0;
+    int res;
+
+    if (m->u.start_rate.label_size > 0)
+    {
+        label = (char *) malloc(m->u.start_rate.label_size);
+        if (label == 0)
+            error("Cannot allocate memory in s_start_rate label_size(%i)",
+                    m->u.start_rate.label_size);
+        res = recv_bytes(s, label, m->u.start_rate.label_size);
+        if (res == -1)
+            error("wrong bytes received");
+    }
+
+    s_set_start_rate(label, m->u.start_rate.rate, m->u.start_rate.burst);
+    free(label);
+}
+
+/* Nothing to do: the server loop will call next_run_job() after it */
+static void fire_refill(struct Timer *t)
+{
+}
+
+/* Wakes up the server when the bucket has a token again */
+static void wait_for_token(struct Bucket *b, unsigned long now)
+{
+    unsigned long ms;
+    unsigned long tick;
+
+    ms = (unsigned long) ((1. - b->tokens) / b->rate * 1000.) + 1;
+    tick = now + (ms + TICK_MS - 1) / TICK_MS;
+
+    if (!refill_timer_ready)
+    {
+        timer_init(&refill_timer, fire_refill, 0);
+        refill_timer_ready = 1;
+    }
+    if (timer_pending(&refill_timer) && refill_tick <= tick)
+        return;
+    refill_tick = tick;
+    timer_add(&refill_timer, ms);
+}
+
+static int has_token(struct Bucket *b, unsigned long now)
+{
+    refill(b, now);
+    if (b->tokens >= 1.)
+        return 1;
+    wait_for_token(b, now);
+    return 0;
+}
+
+/* Whether a job of that label can start now, considering the start rate
+ * limits. A job of another label may still start, if only the label
+ * limit stops this one. */
+enum Defer rate_admissible(const char *label)
+{
+    unsigned long now = timers_now();
+
+    if (queue_bucket != 0 && !has_token(queue_bucket, now))
+        return DEFER_RATE;
+
+    if (label != 0 && first_label_bucket != 0)
+    {
+        struct Bucket *b = *find_bucket(label);
+        if (b != 0 && !has_token(b, now))
+            return DEFER_LABEL_RATE;
+    }
+
+    return DEFER_NONE;
+}
+
+/* Takes the tokens for a job start. Call it after rate_admissible() */
+void rate_consume(const char *label)
+{
+    if (queue_bucket != 0)
+        queue_bucket->tokens -= 1.;
+
+    if (label != 0 && first_label_bucket != 0)
+    {
+        struct Bucket *b = *find_bucket(label);
+        if (b != 0)
+            b->tokens -= 1.;
+    }
+}
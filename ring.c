@@ -0,0 +1,547 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "main.h"
+
+/* The submission ring: with TS_RING set, the server maps a file next to
+ * the socket, <socket>.ring, where 'ts --ring' puts new jobs without
+ * connecting. The jobs get their ids when the server takes them.
+ *
+ * It is a bounded queue of many producers and one consumer. Each cell has
+ * a sequence. A producer claims the cell at enqueue_pos when its sequence
+ * equals the position, fills it, and publishes it making the sequence
+ * pos + 1. The server takes the cells in order while published, and gives
+ * each back for the next lap making it pos + RING_CELLS.
+ *
+ * The doorbell is a fifo, <socket>.ring.bell, in the select() of the
+ * server. Before blocking, the server sets 'sleeping' and looks at the ring
+ * again. A producer rings only if it sees 'sleeping' after publishing, so
+ * the server is woken once for a burst, not for each job.
+ *
+ * A job of the ring has no client to run it. When it starts, the server
+ * spawns 'ts --attach id -- argv...', that connects and runs it as any
+ * other job. */
+
+#ifdef __GNUC__
+#define barrier() __sync_synchronize()
+#define compare_and_swap(p, old, new) __sync_bool_compare_and_swap(p, old, new)
+#else
+#define barrier()
+#endif
+
+enum
+{
+    RING_MAGIC = 0x74735247, /* "tsRG" */
+    RING_CELLS = 1024, /* A power of two */
+    RING_DATA = 1024, /* The command, argv, directory and label of a job */
+    RING_BATCH = RING_CELLS, /* Jobs taken on each loop of the server */
+    RING_FULL_WAIT = 1000 /* Microseconds a producer waits on a full ring */
+};
+
+struct Ring_cell
+{
+    volatile unsigned int seq;
+    int data_size;
+    struct msg m;
+    char data[RING_DATA];
+};
+
+struct Ring
+{
+    int magic;
+    int version; /* PROTOCOL_VERSION */
+    int pid; /* Of the server */
+    volatile int sleeping; /* The server is about to block in select() */
+    char pad0[64]; /* The producers write enqueue_pos; keep it apart */
+    volatile unsigned int enqueue_pos;
+    char pad1[64];
+    struct Ring_cell cells[RING_CELLS];
+};
+
+static struct Ring *ring = 0;
+static int bell_fd = -1;
+static char *ring_path = 0;
+static char *bell_path = 0;
+/* Server side */
+static unsigned int dequeue_pos = 0;
+static char runner_path[1024]; /* Our own binary, for the runners */
+
+static void get_ring_paths(const char *socket_path)
+{
+    ring_path = (char *) malloc(strlen(socket_path) + strlen(".ring.bell") + 1);
+    bell_path = (char *) malloc(strlen(socket_path) + strlen(".ring.bell") + 1);
+    if (ring_path == 0 || bell_path == 0)
+        error("Cannot allocate the paths of the ring");
+    sprintf(ring_path, "%s.ring", socket_path);
+    sprintf(bell_path, "%s.ring.bell", socket_path);
+}
+
+/* Server side */
+
+#ifdef __GNUC__
+
+/* Only with TS_RING set. Without the ring, 'ts --ring' fails. */
+void ring_init(const char *socket_path)
+{
+    int fd;
+    int i;
+    int len;
+
+    if (getenv("TS_RING") == 0)
+        return;
+
+    get_ring_paths(socket_path);
+    unlink(bell_path);
+    if (mkfifo(bell_path, 0600) == -1)
+    {
+        warning("Cannot create the ring bell %s", bell_path);
+        return;
+    }
+    /* Open for writing too, so it never reads as closed */
+    bell_fd = open(bell_path, O_RDWR | O_NONBLOCK);
+    if (bell_fd == -1)
+    {
+        warning("Cannot open the ring bell %s", bell_path);
+        unlink(bell_path);
+        return;
+    }
+
+    fd = open(ring_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(*ring)) == -1)
+    {
+        warning("Cannot create the ring %s", ring_path);
+        if (fd != -1)
+            close(fd);
+        ring_end();
+        return;
+    }
+    ring = (struct Ring *) mmap(0, sizeof(*ring), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == (struct Ring *) MAP_FAILED)
+    {
+        warning("Cannot map the ring %s", ring_path);
+        ring = 0;
+        ring_end();
+        return;
+    }
+
+    len = readlink("/proc/self/exe", runner_path, sizeof(runner_path) - 1);
+    if (len == -1)
+        len = 0;
+    runner_path[len] = '\0';
+
+    for (i = 0; i < RING_CELLS; ++i)
+        ring->cells[i].seq = i;
+    ring->pid = getpid();
+    ring->version = PROTOCOL_VERSION;
+    barrier();
+    ring->magic = RING_MAGIC;
+}
+
+#else
+
+void ring_init(const char *socket_path)
+{
+    if (getenv("TS_RING") != 0)
+        warning("The ring needs atomic operations, not in this build");
+}
+
+#endif
+
+void ring_end()
+{
+    if (ring != 0)
+        ring->magic = 0;
+    if (ring_path != 0)
+        unlink(ring_path);
+    if (bell_path != 0)
+        unlink(bell_path);
+    if (bell_fd != -1)
+        close(bell_fd);
+    bell_fd = -1;
+}
+
+/* The doorbell for the select() of the server, or -1 */
+int ring_fd()
+{
+    return ring != 0 ? bell_fd : -1;
+}
+
+static int cell_ready()
+{
+    return ring->cells[dequeue_pos & (RING_CELLS - 1)].seq == dequeue_pos + 1;
+}
+
+/* Returns 1 if there are jobs to take. Else the server will block, and
+ * the next producer rings. */
+int ring_pending()
+{
+    if (ring == 0)
+        return 0;
+    if (cell_ready())
+        return 1;
+    ring->sleeping = 1;
+    barrier();
+    if (cell_ready())
+    {
+        ring->sleeping = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* The cell came from a trusted producer, but a bad one would make the
+ * server read out of the job parts. Returns 0 if wrong. */
+static int check_cell(const struct msg *m, const char *data, int size)
+{
+    int strings = 0;
+    int i;
+
+    if (m->type != NEWJOB || size < 0 || size > RING_DATA)
+        return 0;
+    if (m->u.newjob.command_size <= 0 || m->u.newjob.label_size < 0
+            || m->u.newjob.command_size + m->u.newjob.label_size != size)
+        return 0;
+    /* Only the command and the label come in the ring */
+    if (m->u.newjob.env_size != 0 || m->u.newjob.gang_name_size != 0
+            || m->u.newjob.queue_name_size != 0
+            || m->u.newjob.unique != UNIQUE_NONE
+            || m->u.newjob.unique_key_size != 0
+            || m->u.newjob.memo_key_size != 0
+            || m->u.newjob.do_depend != 0)
+        return 0;
+    if (data[m->u.newjob.command_size - 1] != '\0'
+            || (m->u.newjob.label_size > 0 && data[size - 1] != '\0'))
+        return 0;
+    /* The command to show, the argv, and the directory */
+    for (i = 0; i < m->u.newjob.command_size; ++i)
+        if (data[i] == '\0')
+            ++strings;
+    return m->u.newjob.argc > 0 && strings == m->u.newjob.argc + 2;
+}
+
+static void take_cell(struct Ring_cell *c)
+{
+    struct msg m;
+    char data[RING_DATA];
+    int size;
+
+    /* A copy, that the producers cannot touch while the server reads it */
+    m = c->m;
+    size = c->data_size;
+    if (size >= 0 && size <= RING_DATA)
+        memcpy(data, c->data, size);
+    if (!check_cell(&m, data, size))
+    {
+        warning("Wrong job in the ring, at %u", dequeue_pos);
+        return;
+    }
+    s_newjob_ring(&m, data);
+}
+
+/* Takes the jobs published, at most RING_BATCH, so the clients are not
+ * starved. Not fewer: each loop of the server walks the queue a few times.
+ * The rest make ring_pending() true for the next loop. */
+void ring_drain()
+{
+    char buf[64];
+    int n;
+
+    if (ring == 0)
+        return;
+
+    ring->sleeping = 0;
+    while (read(bell_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    for (n = 0; n < RING_BATCH && cell_ready(); ++n)
+    {
+        struct Ring_cell *c = &ring->cells[dequeue_pos & (RING_CELLS - 1)];
+
+        barrier();
+        take_cell(c);
+        barrier();
+        c->seq = dequeue_pos + RING_CELLS;
+        ++dequeue_pos;
+    }
+}
+
+/* Spawns the runner of a job of the ring, that just started, in the
+ * directory of its producer. It is not our child: the middle process ends
+ * at once. */
+void ring_run(int jobid)
+{
+    const char *argv_block;
+    const char **args;
+    const char *cwd;
+    char jobid_str[20];
+    int argc;
+    int pid;
+    int i;
+
+    argv_block = s_ring_argv(jobid, &argc);
+    if (argv_block == 0)
+        error("The job %i started without a client", jobid);
+
+    args = (const char **) malloc((argc + 5) * sizeof(*args));
+    if (args == 0)
+        error("Cannot allocate the runner of the job %i", jobid);
+    sprintf(jobid_str, "%i", jobid);
+    args[0] = runner_path[0] != '\0' ? runner_path : "ts";
+    args[1] = "--attach";
+    args[2] = jobid_str;
+    args[3] = "--";
+    for (i = 0; i < argc; ++i)
+    {
+        args[4 + i] = argv_block;
+        argv_block += strlen(argv_block) + 1;
+    }
+    args[4 + argc] = 0;
+    cwd = argv_block;
+
+    pid = fork();
+    if (pid == 0)
+    {
+        int max = (int) sysconf(_SC_OPEN_MAX);
+        int fd;
+
+        if (fork() != 0)
+            _exit(0);
+        setsid();
+        for (fd = 3; fd < max; ++fd)
+            close(fd);
+        fd = open("/dev/null", O_RDWR);
+        if (fd != -1)
+        {
+            dup2(fd, 0);
+            dup2(fd, 1);
+            dup2(fd, 2);
+        }
+        /* If it is gone, the job ends when the runner does not attach */
+        if (chdir(cwd) == -1)
+            _exit(-1);
+        if (runner_path[0] != '\0')
+            execv(args[0], (char * const *) args);
+        execvp("ts", (char * const *) args);
+        _exit(-1);
+    }
+    free(args);
+
+    if (pid == -1)
+    {
+        s_ring_failed(jobid, "cannot fork its runner");
+        return;
+    }
+    waitpid(pid, 0, 0);
+    /* It may still fail to run, or die before attaching */
+    s_ring_wait_attach(jobid);
+}
+
+/* Client side */
+
+#ifdef __GNUC__
+
+/* The directory where the jobs run */
+static char ring_cwd[RING_DATA];
+
+static struct Ring * map_ring()
+{
+    struct Ring *r;
+    char *socket_path;
+    struct stat st;
+    int fd;
+
+    create_socket_path(&socket_path);
+    get_ring_paths(socket_path);
+    free(socket_path);
+
+    fd = open(ring_path, O_RDWR);
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(*r))
+    {
+        close(fd);
+        return 0;
+    }
+    r = (struct Ring *) mmap(0, sizeof(*r), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == (struct Ring *) MAP_FAILED)
+        return 0;
+
+    if (r->magic != RING_MAGIC || r->version != PROTOCOL_VERSION
+            || (kill(r->pid, 0) == -1 && errno != EPERM))
+        return 0;
+
+    bell_fd = open(bell_path, O_WRONLY | O_NONBLOCK);
+    if (bell_fd == -1)
+        return 0;
+    return r;
+}
+
+/* Puts a job in the ring. Returns 0 if it does not fit in a cell. */
+static int ring_put(char **argv, int argc, const char *label)
+{
+    struct Ring_cell *c;
+    unsigned int pos;
+    int command_size = 0;
+    int cwd_size = strlen(ring_cwd) + 1;
+    int label_size;
+    int argv_size = 0;
+    char *data;
+    int i;
+
+    for (i = 0; i < argc; ++i)
+        argv_size += strlen(argv[i]) + 1;
+    /* The command to show has the argv joined by spaces */
+    command_size = argv_size * 2 + cwd_size;
+    label_size = label ? strlen(label) + 1 : 0;
+    if (command_size + label_size > RING_DATA)
+        return 0;
+
+    /* Claim a cell */
+    while (1)
+    {
+        int dif;
+
+        pos = ring->enqueue_pos;
+        c = &ring->cells[pos & (RING_CELLS - 1)];
+        dif = (int) (c->seq - pos);
+        if (dif == 0)
+        {
+            if (compare_and_swap(&ring->enqueue_pos, pos, pos + 1))
+                break;
+        }
+        else if (dif < 0)
+        {
+            /* Full, until the server takes more */
+            if (kill(ring->pid, 0) == -1 && errno != EPERM)
+                error("The server of the ring is gone");
+            if (ring->sleeping)
+                write(bell_fd, "", 1);
+            usleep(RING_FULL_WAIT);
+        }
+        /* Else another producer took it; try the next */
+    }
+
+    memset(&c->m, 0, sizeof(c->m));
+    c->m.type = NEWJOB;
+    c->m.u.newjob.command_size = command_size;
+    c->m.u.newjob.label_size = label_size;
+    c->m.u.newjob.store_output = 1;
+    c->m.u.newjob.should_keep_finished = command_line.should_keep_finished;
+    c->m.u.newjob.depend_on = -1;
+    c->m.u.newjob.num_slots = command_line.num_slots;
+    c->m.u.newjob.priority = command_line.priority;
+    c->m.u.newjob.argc = argc;
+
+    data = c->data;
+    for (i = 0; i < argc; ++i)
+    {
+        if (i > 0)
+            *data++ = ' ';
+        strcpy(data, argv[i]);
+        data += strlen(argv[i]);
+    }
+    *data++ = '\0';
+    for (i = 0; i < argc; ++i)
+    {
+        strcpy(data, argv[i]);
+        data += strlen(argv[i]) + 1;
+    }
+    strcpy(data, ring_cwd);
+    data += cwd_size;
+    if (label)
+    {
+        strcpy(data, label);
+        data += label_size;
+    }
+    c->data_size = data - c->data;
+
+    /* Publish it, and wake the server if it sleeps */
+    barrier();
+    c->seq = pos + 1;
+    barrier();
+    if (ring->sleeping)
+    {
+        ring->sleeping = 0;
+        write(bell_fd, "", 1);
+    }
+    return 1;
+}
+
+/* 'ts --ring cmd args', or the lines of stdin as 'sh -c line' each */
+void c_ring()
+{
+    ring = map_ring();
+    if (ring == 0)
+        error("The server has no ring; start it with TS_RING set");
+    /* The jobs run here, as those queued through the socket */
+    if (getcwd(ring_cwd, sizeof(ring_cwd)) == 0)
+        error("Cannot get the current directory for the ring");
+
+    if (command_line.command.num > 0)
+    {
+        if (!ring_put(command_line.command.array, command_line.command.num,
+                    command_line.label))
+            error("The job does not fit in the ring");
+        return;
+    }
+
+    while (1)
+    {
+        char line[RING_DATA];
+        char *argv[3];
+        int len;
+
+        if (fgets(line, sizeof(line), stdin) == 0)
+            break;
+        len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        else if (!feof(stdin))
+            error("Line too long for the ring: %.40s...", line);
+        if (len == 0)
+            continue;
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = line;
+        if (!ring_put(argv, 3, command_line.label))
+            error("The job does not fit in the ring: %.40s...", line);
+    }
+}
+
+#else
+
+void c_ring()
+{
+    error("The ring needs atomic operations, not in this build");
+}
+
+#endif
+
+/* The runner of a job of the ring, spawned by the server */
+void c_attach()
+{
+    struct msg m;
+
+    m.type = ATTACH;
+    m.u.jobid = command_line.jobid;
+    send_msg(server_socket, &m);
+}
@@ -0,0 +1,269 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/* Benchmark of the enqueues per second, through the socket and through
+ * the ring. It starts its own server with TS_RING, on a socket of its own,
+ * and keeps its only slot busy, so the jobs stay queued and nothing runs.
+ *
+ * The socket path speaks the protocol like a ts client would: a connection
+ * and a NEWJOB for each job, until NEWJOB_OK. The connections stay open, as
+ * they hold the jobs, so it queues at most SOCKET_JOBS.
+ *
+ * The ring path pipes the jobs to 'ts --ring', a line each, and times it
+ * until 'ts --count' shows them all in the queue. */
+
+enum
+{
+    SOCKET_JOBS = 500
+};
+
+static char socket_path[100];
+static char socket_env[120];
+static const char *ts_path = "./ts";
+
+/* msg.c needs these, from error.c */
+enum Process_type process_type = CLIENT;
+
+void error(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(-1);
+}
+
+void warning(const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+void warning_msg(const struct msg *m, const char *str, ...)
+{
+    va_list ap;
+
+    va_start(ap, str);
+    vfprintf(stderr, str, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+static double now()
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* Runs ts with an argument, with the output to /dev/null */
+static void run_ts(const char *arg)
+{
+    int pid;
+    int status;
+
+    pid = fork();
+    if (pid == -1)
+        error("fork");
+    if (pid == 0)
+    {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd == -1)
+            error("open /dev/null");
+        dup2(fd, 1);
+        execl(ts_path, ts_path, arg, (char *) NULL);
+        error("Cannot run %s", ts_path);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        error("%s %s failed", ts_path, arg);
+}
+
+/* The jobs queued, from 'ts --count' */
+static int count_queued()
+{
+    char command[200];
+    FILE *f;
+    int count = -1;
+
+    sprintf(command, "%s --count --state queued", ts_path);
+    f = popen(command, "r");
+    if (f == 0)
+        error("Cannot run %s", command);
+    if (fscanf(f, "%i", &count) != 1)
+        error("%s failed", command);
+    pclose(f);
+    return count;
+}
+
+static int connect_server()
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+        error("socket");
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        error("Cannot connect to %s", socket_path);
+    msg_reset(fd);
+    return fd;
+}
+
+static void expect(int fd, struct msg *m, enum msg_types type)
+{
+    if (recv_msg(fd, m) != sizeof(*m) || m->type != type)
+        error("The server did not answer %i", type);
+}
+
+/* Queues a job, and returns the connection that holds it */
+static int add_job(int i)
+{
+    struct msg m;
+    struct msg_part parts[1];
+    char command[100];
+    int fd;
+
+    fd = connect_server();
+
+    sprintf(command, "echo job %i", i);
+
+    memset(&m, 0, sizeof(m));
+    m.type = NEWJOB;
+    m.u.newjob.command_size = strlen(command) + 1;
+    m.u.newjob.store_output = 1;
+    m.u.newjob.should_keep_finished = 1;
+    m.u.newjob.depend_on = -1;
+    m.u.newjob.num_slots = 1;
+    parts[0].data = command;
+    parts[0].size = m.u.newjob.command_size;
+    send_msg_parts(fd, &m, parts, 1);
+    expect(fd, &m, NEWJOB_OK);
+    return fd;
+}
+
+/* A job that keeps the only slot, until we close its connection */
+static int add_blocker()
+{
+    struct msg m;
+    int fd;
+
+    fd = add_job(-1);
+    expect(fd, &m, RUNJOB);
+    memset(&m, 0, sizeof(m));
+    m.type = RUNJOB_OK;
+    m.u.output.pid = getpid();
+    send_msg(fd, &m);
+    return fd;
+}
+
+/* The connections stay open until the server ends */
+static double bench_socket(int jobs)
+{
+    double start;
+    int i;
+
+    start = now();
+    for (i = 0; i < jobs; ++i)
+        add_job(i);
+    return now() - start;
+}
+
+/* Returns the time until the server took them all, after the ones queued
+ * before. In *publish, the time until 'ts --ring' ended. */
+static double bench_ring(int jobs, int before, double *publish)
+{
+    double start;
+    FILE *f;
+    int i;
+
+    start = now();
+    {
+        char command[200];
+
+        sprintf(command, "%s --ring", ts_path);
+        f = popen(command, "w");
+        if (f == 0)
+            error("Cannot run %s", command);
+    }
+    for (i = 0; i < jobs; ++i)
+        fprintf(f, "echo job %i\n", i);
+    if (pclose(f) != 0)
+        error("%s --ring failed", ts_path);
+    *publish = now() - start;
+
+    while (count_queued() < before + jobs)
+        usleep(1000);
+    return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int jobs = 100000;
+    int socket_jobs;
+    double t, publish;
+
+    if (argc > 1)
+        jobs = atoi(argv[1]);
+    if (argc > 2)
+        ts_path = argv[2];
+    if (jobs <= 0)
+    {
+        fprintf(stderr, "usage: ringbench [jobs [ts]]\n");
+        return 1;
+    }
+    socket_jobs = jobs < SOCKET_JOBS ? jobs : SOCKET_JOBS;
+
+    sprintf(socket_path, "/tmp/ringbench.%i", (int) getpid());
+    sprintf(socket_env, "TS_SOCKET=%s", socket_path);
+    putenv(socket_env);
+    putenv("TS_RING=1");
+    unlink(socket_path);
+
+    /* Starts the server, with one slot, that the blocker takes */
+    run_ts("-C");
+    run_ts("-S1");
+    add_blocker();
+
+    t = bench_socket(socket_jobs);
+    printf("socket: %7i jobs in %8.3f s: %9.0f enqueues/s\n",
+            socket_jobs, t, socket_jobs / t);
+    fflush(stdout);
+
+    t = bench_ring(jobs, socket_jobs, &publish);
+    printf("ring:   %7i jobs in %8.3f s: %9.0f enqueues/s"
+            " (published in %.3f s)\n",
+            jobs, t, jobs / t, publish);
+
+    run_ts("-K");
+    unlink(socket_path);
+
+    return 0;
+}
@@ -44,6 +44,11 @@ static enum Break
 static void end_server(int ls);
 static void s_newjob_ok(int index);
 static void s_newjob_nok(int index);
+static void s_newjob_dup(int index, int jobid);
+static int replace_job(int jobid, int by);
+static void expire_job(int jobid);
+static void s_newjob_memo(int index, int errorlevel);
+static void s_send_hedge(int jobid);
 static void s_runjob(int jobid, int index);
 static void clean_after_client_disappeared(int socket, int index);
 
@@ -52,6 +57,7 @@ struct Client_conn
     int socket;
     int hasjob;
     int jobid;
+    int session; /* Keeps open after the answers, each ending in RESPONSE_END */
 };
 
 /* Globals */
@@ -92,11 +98,47 @@ static void sigterm_handler(int n)
                     dumpfilename);
     }
 
+    s_continue_preempted();
+
     /* path will be initialized for sure, before installing the handler */
     unlink(path);
+    status_end();
+    ring_end();
     exit(1);
 }
 
+static void set_default_timeout()
+{
+    char *str;
+
+    str = getenv("TS_TIMEOUT");
+    if (str != NULL)
+    {
+        int seconds;
+        seconds = parse_duration(str);
+        if (seconds >= 0)
+            s_set_default_timeout(seconds);
+        else
+            warning("Wrong TS_TIMEOUT value \"%s\"", str);
+    }
+}
+
+static void set_default_start_rate()
+{
+    char *str;
+
+    str = getenv("TS_START_RATE");
+    if (str != NULL)
+    {
+        double rate;
+        int burst = 1;
+        if (parse_start_rate(str, &rate, &burst))
+            s_set_start_rate(0, rate, burst);
+        else
+            warning("Wrong TS_START_RATE value \"%s\"", str);
+    }
+}
+
 static void set_default_maxslots()
 {
     char *str;
@@ -110,6 +152,19 @@ static void set_default_maxslots()
     }
 }
 
+static void set_default_interactive_slots()
+{
+    char *str;
+
+    str = getenv("TS_INTERACTIVE_SLOTS");
+    if (str != NULL)
+    {
+        int slots;
+        slots = abs(atoi(str));
+        s_set_interactive_slots(slots);
+    }
+}
+
 static void install_sigterm_handler()
 {
   struct sigaction act;
@@ -201,9 +256,19 @@ void server_main(int notify_fd, char *_path)
     if (res == -1)
         error("Error listening.");
 
+    status_init(path);
+    ring_init(path);
     install_sigterm_handler();
 
     set_default_maxslots();
+    set_default_interactive_slots();
+    set_default_timeout();
+    set_default_start_rate();
+    fs_init();
+    quota_init();
+    memo_init();
+
+    timers_init();
 
     notify_parent(notify_fd);
 
@@ -222,13 +287,19 @@ static int get_conn_of_jobid(int jobid)
 static void server_loop(int ls)
 {
     fd_set readset;
+    fd_set writeset;
     int i;
     int maxfd;
     int keep_loop = 1;
     int newjob;
+    int pending;
 
     while (keep_loop)
     {
+        struct timeval tv;
+        int tfd;
+        int rfd;
+
         FD_ZERO(&readset);
         maxfd = 0;
         /* If we can accept more connections, go on.
@@ -238,25 +309,63 @@ static void server_loop(int ls)
             FD_SET(ls,&readset);
             maxfd = ls;
         }
+        pending = 0;
         for(i=0; i< nconnections; ++i)
         {
             FD_SET(client_cs[i].socket, &readset);
             if (client_cs[i].socket > maxfd)
                 maxfd = client_cs[i].socket;
+            /* Already received, select() would not wake for them */
+            if (msg_pending(client_cs[i].socket))
+                pending = 1;
         }
-        select(maxfd + 1, &readset, NULL, NULL, NULL);
+        tfd = timers_fd();
+        if (tfd != -1)
+        {
+            FD_SET(tfd, &readset);
+            if (tfd > maxfd)
+                maxfd = tfd;
+        }
+        /* The doorbell of the ring, that a producer rings if we sleep */
+        rfd = ring_fd();
+        if (rfd != -1)
+        {
+            FD_SET(rfd, &readset);
+            if (rfd > maxfd)
+                maxfd = rfd;
+            if (ring_pending())
+                pending = 1;
+        }
+        /* The events that the subscribers could not take yet */
+        FD_ZERO(&writeset);
+        maxfd = events_writeset(&writeset, maxfd);
+        if (pending)
+        {
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            select(maxfd + 1, &readset, &writeset, NULL, &tv);
+        }
+        else
+            select(maxfd + 1, &readset, &writeset, NULL,
+                    timers_select_timeout(&tv));
+        timers_run();
+        events_flush(&writeset);
+        ring_drain();
         if (FD_ISSET(ls,&readset))
         {
             int cs;
             cs = accept(ls, NULL, NULL);
             if (cs == -1)
                 error("Accepting from %i", ls);
+            msg_reset(cs);
             client_cs[nconnections].hasjob = 0;
+            client_cs[nconnections].session = 0;
             client_cs[nconnections].socket = cs;
             ++nconnections;
         }
         for(i=0; i< nconnections; ++i)
-            if (FD_ISSET(client_cs[i].socket, &readset))
+            if (FD_ISSET(client_cs[i].socket, &readset)
+                    || msg_pending(client_cs[i].socket))
             {
                 enum Break b;
                 b = client_read(i);
@@ -271,15 +380,22 @@ static void server_loop(int ls)
                 else if (b == BREAK)
                     keep_loop = 0;
             }
-        /* This will return firstjob->jobid or -1 */
-        newjob = next_run_job();
-        if (newjob != -1)
+        /* End the jobs that did not start within their TTL */
+        while ((newjob = next_expired_job()) != -1)
+            expire_job(newjob);
+
+        /* Start all we can. This will return a jobid or -1 */
+        while ((newjob = next_run_job()) != -1)
         {
             int conn, awaken_job;
             conn = get_conn_of_jobid(newjob);
             /* This next marks the firstjob state to RUNNING */
             s_mark_job_running(newjob);
-            s_runjob(newjob, conn);
+            if (conn == -1)
+                /* From the ring: its runner will attach */
+                ring_run(newjob);
+            else
+                s_runjob(newjob, conn);
 
             while ((awaken_job = wake_hold_client()) != -1)
             {
@@ -289,6 +405,12 @@ static void server_loop(int ls)
                 s_newjob_ok(wake_conn);
             }
         }
+
+        /* The slots still idle can run backup copies of the stragglers */
+        while ((newjob = next_hedge_job()) != -1)
+            s_send_hedge(newjob);
+
+        s_update_status();
     }
 
     end_server(ls);
@@ -296,8 +418,11 @@ static void server_loop(int ls)
 
 static void end_server(int ls)
 {
+    s_continue_preempted();
     close(ls);
     unlink(path);
+    status_end();
+    ring_end();
     /* This comes from the parent, in the fork after server_main.
      * This is the last use of path in this process.*/
     free(path); 
@@ -350,18 +475,53 @@ clean_after_client_disappeared(int socket, int index)
          * it may well be a notification */
         s_remove_notification(socket);
 
+    events_unsubscribe(socket);
     close(socket);
     remove_connection(index);
 }
 
+/* The requests answered at once, that end in RESPONSE_END in a session */
+static int is_query(enum msg_types type)
+{
+    switch(type)
+    {
+        case LIST:
+        case STATS:
+        case INFO:
+        case CLEAR_FINISHED:
+        case ASK_OUTPUT:
+        case REMOVEJOB:
+        case URGENT:
+        case SET_MAX_SLOTS:
+        case GET_MAX_SLOTS:
+        case SET_START_RATE:
+        case SWAP_JOBS:
+        case GET_STATE:
+        case GET_VERSION:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void s_response_end(int s)
+{
+    struct msg m;
+
+    m.type = RESPONSE_END;
+    send_msg(s, &m);
+}
+
 static enum Break
     client_read(int index)
 {
     struct msg m;
     int s;
     int res;
+    int session;
 
     s = client_cs[index].socket;
+    session = client_cs[index].session;
 
     /* Read the message */
     res = recv_msg(s, &m);
@@ -377,6 +537,14 @@ static enum Break
         return NOBREAK;
     }
 
+    /* A subscriber only listens: its socket does not block anymore, and
+     * the answers would mix with the events */
+    if (events_subscribed(s))
+    {
+        warning("Message %i from a subscriber", m.type);
+        return CLOSE;
+    }
+
     /* Process message */
     switch(m.type)
     {
@@ -386,6 +554,40 @@ static enum Break
         case NEWJOB:
             client_cs[index].jobid = s_newjob(s, &m);
             client_cs[index].hasjob = 1;
+            if (m.u.newjob.unique != UNIQUE_NONE)
+            {
+                int dup = s_find_duplicate(client_cs[index].jobid);
+                if (dup != -1 && m.u.newjob.unique == UNIQUE_KEEP)
+                {
+                    /* The new job goes away, as if it never came */
+                    s_newjob_dup(index, dup);
+                    close(s);
+                    remove_connection(index);
+                    break;
+                }
+                if (dup != -1)
+                {
+                    int conn = replace_job(dup, client_cs[index].jobid);
+                    /* The connections after it move back */
+                    if (conn >= 0 && conn < index)
+                        --index;
+                    s_find_duplicate(client_cs[index].jobid);
+                }
+            }
+            if (m.u.newjob.memo_key_size > 0)
+            {
+                int errorlevel;
+                if (s_memo_lookup(client_cs[index].jobid, &errorlevel))
+                {
+                    s_newjob_memo(index, errorlevel);
+                    /* For the dependencies */
+                    check_notify_list(client_cs[index].jobid);
+                    client_cs[index].hasjob = 0;
+                    close(s);
+                    remove_connection(index);
+                    break;
+                }
+            }
             if (!job_is_holding_client(client_cs[index].jobid))
                 s_newjob_ok(index);
             else if (!m.u.newjob.wait_enqueuing)
@@ -397,6 +599,7 @@ static enum Break
         case RUNJOB_OK:
             {
                 char *buffer = 0;
+                char *memo_key = 0;
                 if (m.u.output.store_output)
                 {
                     /* Receive the output filename */
@@ -406,22 +609,78 @@ static enum Break
                     if (res != m.u.output.ofilename_size)
                         error("Reading the ofilename");
                 }
+                if (m.u.output.memo_key_size > 0)
+                {
+                    /* Receive the key of the inputs of this run */
+                    memo_key = (char *) malloc(m.u.output.memo_key_size);
+                    res = recv_bytes(s, memo_key, m.u.output.memo_key_size);
+                    if (res != m.u.output.memo_key_size)
+                        error("Reading the memo key");
+                }
                 s_process_runjob_ok(client_cs[index].jobid, buffer,
+                        m.u.output.pid, memo_key);
+            }
+            break;
+        case HEDGE_WON:
+            {
+                char *buffer = 0;
+                if (m.u.output.store_output)
+                {
+                    /* Receive the output filename */
+                    buffer = (char *) malloc(m.u.output.ofilename_size);
+                    res = recv_bytes(s, buffer,
+                        m.u.output.ofilename_size);
+                    if (res != m.u.output.ofilename_size)
+                        error("Reading the ofilename");
+                }
+                s_hedge_won(client_cs[index].jobid, buffer,
                         m.u.output.pid);
             }
             break;
+        case HEDGE_STARTED:
+            s_hedge_started(client_cs[index].jobid, m.u.output.pid);
+            break;
         case LIST:
-            s_list(s);
-            /* We must actively close, meaning End of Lines */
-            close(s);
-            remove_connection(index);
+            {
+                char *label = 0;
+                if (m.u.list.label_size > 0)
+                {
+                    /* Receive the label pattern */
+                    label = (char *) malloc(m.u.list.label_size);
+                    res = recv_bytes(s, label, m.u.list.label_size);
+                    if (res != m.u.list.label_size)
+                        error("Reading the label pattern");
+                }
+                s_list(s, &m.u.list, label);
+                free(label);
+            }
+            /* Out of a session, the close means the end of the lines */
+            if (!session)
+            {
+                close(s);
+                remove_connection(index);
+            }
+            break;
+        case STATS:
+            s_stats(s);
+            if (!session)
+            {
+                close(s);
+                remove_connection(index);
+            }
             break;
         case INFO:
-            s_job_info(s, m.u.jobid);
-            close(s);
-            remove_connection(index);
+            s_job_info(s, m.u.info.jobid, m.u.info.format);
+            if (!session)
+            {
+                close(s);
+                remove_connection(index);
+            }
             break;
         case ENDJOB:
+            /* The client will wait for another RUNJOB */
+            if (s_job_retry(&m.u.result, client_cs[index].jobid))
+                break;
             job_finished(&m.u.result, client_cs[index].jobid);
             /* For the dependencies */
             check_notify_list(client_cs[index].jobid);
@@ -462,7 +721,7 @@ static enum Break
             }
             break;
         case WAITJOB:
-            s_wait_job(s, m.u.jobid);
+            s_wait_job(s, &m);
             break;
         case WAIT_RUNNING_JOB:
             s_wait_running_job(s, m.u.jobid);
@@ -476,6 +735,9 @@ static enum Break
         case GET_MAX_SLOTS:
             s_get_max_slots(s);
             break;
+        case SET_START_RATE:
+            s_start_rate(s, &m);
+            break;
         case SWAP_JOBS:
             s_swap_jobs(s, m.u.swap.jobid1,
                     m.u.swap.jobid2);
@@ -486,6 +748,33 @@ static enum Break
         case GET_VERSION:
             s_send_version(s);
             break;
+        case VERSION:
+            /* A client of another protocol, from the frame of its request */
+            warning("Client of protocol %i, instead of %i", m.u.version,
+                    PROTOCOL_VERSION);
+            s_send_version(s);
+            return CLOSE;
+        case SESSION:
+            client_cs[index].session = 1;
+            break;
+        case SUBSCRIBE:
+            events_subscribe(s);
+            if (m.u.snapshot)
+                s_snapshot(s);
+            break;
+        case ATTACH:
+            /* The runner of a job from the ring, once */
+            if (get_conn_of_jobid(m.u.jobid) != -1
+                    || !s_ring_attach(m.u.jobid))
+            {
+                warning("Attach to the job %i, not waiting for it",
+                        m.u.jobid);
+                return CLOSE;
+            }
+            client_cs[index].hasjob = 1;
+            client_cs[index].jobid = m.u.jobid;
+            s_runjob(m.u.jobid, index);
+            break;
         default:
             /* Command not supported */
             /* On unknown message, we close the client,
@@ -494,6 +783,9 @@ static enum Break
             return CLOSE;
     }
 
+    if (session && is_query(m.type))
+        s_response_end(s);
+
     return NOBREAK; /* normal */
 }
 
@@ -540,12 +832,90 @@ static void s_newjob_nok(int index)
     send_msg(s, &m);
 }
 
+static void s_newjob_dup(int index, int jobid)
+{
+    int s;
+    struct msg m;
+
+    s = client_cs[index].socket;
+
+    m.type = NEWJOB_DUP;
+    m.u.jobid = jobid;
+
+    send_msg(s, &m);
+}
+
+/* Asks the client of the job to start a backup copy */
+static void s_send_hedge(int jobid)
+{
+    int conn;
+    struct msg m;
+
+    conn = get_conn_of_jobid(jobid);
+    if (conn == -1)
+        return;
+
+    m.type = HEDGE;
+    send_msg(client_cs[conn].socket, &m);
+}
+
+static void s_newjob_memo(int index, int errorlevel)
+{
+    int s;
+    struct msg m;
+
+    s = client_cs[index].socket;
+
+    m.type = NEWJOB_MEMO;
+    m.u.memo.jobid = client_cs[index].jobid;
+    m.u.memo.errorlevel = errorlevel;
+
+    send_msg(s, &m);
+}
+
+/* Ends a waiting job, replaced by a new one, and closes its client.
+ * Returns the index its connection had, or -1 if it had none. */
+static int replace_job(int jobid, int by)
+{
+    int conn;
+
+    s_job_replaced(jobid, by);
+    /* For the dependencies */
+    check_notify_list(jobid);
+    conn = get_conn_of_jobid(jobid);
+    if (conn != -1)
+    {
+        client_cs[conn].hasjob = 0;
+        close(client_cs[conn].socket);
+        remove_connection(conn);
+    }
+    return conn;
+}
+
+/* Ends a job whose TTL passed, and closes its client */
+static void expire_job(int jobid)
+{
+    int conn;
+
+    s_job_expired(jobid);
+    /* For the dependencies */
+    check_notify_list(jobid);
+    conn = get_conn_of_jobid(jobid);
+    if (conn != -1)
+    {
+        client_cs[conn].hasjob = 0;
+        close(client_cs[conn].socket);
+        remove_connection(conn);
+    }
+}
+
 static void dump_conn_struct(FILE *out, const struct Client_conn *p)
 {
     fprintf(out, "  new_conn\n");
     fprintf(out, "    socket %i\n", p->socket);
     fprintf(out, "    hasjob \"%i\"\n", p->hasjob);
     fprintf(out, "    jobid %i\n", p->jobid);
+    fprintf(out, "    session %i\n", p->session);
 }
 
 void dump_conns_struct(FILE *out)
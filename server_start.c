@@ -152,6 +152,7 @@ int ensure_server_up()
     server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
     if (server_socket == -1)
         error("getting the server socket");
+    msg_reset(server_socket);
 
     create_socket_path(&socket_path);
 
@@ -0,0 +1,350 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* The status page: a file next to the socket, mapped by the server, with
+ * the counters of the queue, the slots, and the state of each job. The
+ * clients answer 'ts -s id', 'ts -S' and 'ts --count' reading it, without
+ * talking to the server.
+ *
+ * The server is the only writer. It makes the sequence odd while it
+ * writes, and even again after. A reader takes the sequence, copies what it
+ * wants, and tries again if the sequence was odd or changed meanwhile. If
+ * it cannot get a stable copy, or the job is not in the table, the client
+ * asks the server as always. */
+
+#ifdef __GNUC__
+#define barrier() __sync_synchronize()
+#else
+#define barrier()
+#endif
+
+enum
+{
+    STATUS_MAGIC = 0x74735350, /* "tsSP" */
+    STATUS_JOBS = 16384,
+    STATUS_READ_TRIES = 1000
+};
+
+struct Status_job
+{
+    int jobid;
+    int state;
+};
+
+struct Status_page
+{
+    int magic;
+    int version; /* PROTOCOL_VERSION */
+    volatile unsigned int seq; /* Odd while the server writes */
+    int pid; /* Of the server */
+    int max_slots;
+    int busy_slots;
+    int state_count[EXPIRED + 1];
+    int jobs_num;
+    struct Status_job jobs[STATUS_JOBS];
+};
+
+static struct Status_page *page = 0;
+static char *page_path = 0;
+/* In the server, the job of each entry of the table */
+static struct Job **page_jobs = 0;
+
+static char * get_page_path(const char *socket_path)
+{
+    char *path;
+
+    path = (char *) malloc(strlen(socket_path) + strlen(".status") + 1);
+    if (path == 0)
+        error("Cannot allocate the path of the status page");
+    sprintf(path, "%s.status", socket_path);
+    return path;
+}
+
+/* Server side */
+
+static void write_begin()
+{
+    ++page->seq;
+    barrier();
+}
+
+static void write_end()
+{
+    barrier();
+    ++page->seq;
+}
+
+/* Without the page, the clients ask the server */
+void status_init(const char *socket_path)
+{
+    int fd;
+
+    page_path = get_page_path(socket_path);
+    fd = open(page_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+    {
+        warning("Cannot create the status page %s", page_path);
+        return;
+    }
+    if (ftruncate(fd, sizeof(*page)) == -1)
+    {
+        warning("Cannot size the status page %s", page_path);
+        close(fd);
+        unlink(page_path);
+        return;
+    }
+    page = (struct Status_page *) mmap(0, sizeof(*page),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == (struct Status_page *) MAP_FAILED)
+    {
+        warning("Cannot map the status page %s", page_path);
+        page = 0;
+        unlink(page_path);
+        return;
+    }
+
+    page_jobs = (struct Job **) malloc(STATUS_JOBS * sizeof(*page_jobs));
+    if (page_jobs == 0)
+        error("Cannot allocate the jobs of the status page");
+
+    /* The file is new and zeroed. Valid once it has the magic. */
+    page->pid = getpid();
+    page->version = PROTOCOL_VERSION;
+    barrier();
+    page->magic = STATUS_MAGIC;
+}
+
+void status_end()
+{
+    if (page == 0)
+        return;
+    page->magic = 0;
+    unlink(page_path);
+}
+
+/* The job is new, or changed. The counts by state go in the same write,
+ * so a reader sees the job and the counts that include it. */
+void status_job(struct Job *p, const int *state_count)
+{
+    int i;
+
+    if (page == 0)
+        return;
+
+    i = p->status_index;
+    /* With the table full, the clients will ask the server for it */
+    if (i == -1 && page->jobs_num < STATUS_JOBS)
+    {
+        i = page->jobs_num;
+        p->status_index = i;
+        page_jobs[i] = p;
+    }
+
+    write_begin();
+    if (i != -1)
+    {
+        page->jobs[i].jobid = p->jobid;
+        page->jobs[i].state = p->state;
+        if (i == page->jobs_num)
+            ++page->jobs_num;
+    }
+    memcpy(page->state_count, state_count, sizeof(page->state_count));
+    write_end();
+}
+
+/* The job is not in the lists anymore, nor in the counts. The last entry
+ * takes its place. */
+void status_job_gone(struct Job *p, const int *state_count)
+{
+    int i = p->status_index;
+    int last = page != 0 ? page->jobs_num - 1 : 0;
+
+    if (page == 0)
+        return;
+
+    write_begin();
+    if (i != -1)
+    {
+        page->jobs[i] = page->jobs[last];
+        --page->jobs_num;
+    }
+    memcpy(page->state_count, state_count, sizeof(page->state_count));
+    write_end();
+
+    if (i != -1)
+    {
+        page_jobs[i] = page_jobs[last];
+        page_jobs[i]->status_index = i;
+        p->status_index = -1;
+    }
+}
+
+/* Written only if changed: the server calls it on every loop */
+void status_slots(int busy_slots, int max_slots)
+{
+    if (page == 0)
+        return;
+
+    if (page->busy_slots == busy_slots && page->max_slots == max_slots)
+        return;
+
+    write_begin();
+    page->busy_slots = busy_slots;
+    page->max_slots = max_slots;
+    write_end();
+}
+
+/* Client side */
+
+/* The page of a server alive, of our protocol, or 0 */
+static const struct Status_page * map_page()
+{
+    const struct Status_page *p;
+    char *socket_path;
+    struct stat st;
+    int fd;
+
+    create_socket_path(&socket_path);
+    page_path = get_page_path(socket_path);
+    free(socket_path);
+    fd = open(page_path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || st.st_size != sizeof(*p))
+    {
+        close(fd);
+        return 0;
+    }
+    p = (const struct Status_page *) mmap(0, sizeof(*p), PROT_READ,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == (const struct Status_page *) MAP_FAILED)
+        return 0;
+
+    if (p->magic != STATUS_MAGIC || p->version != PROTOCOL_VERSION
+            || (kill(p->pid, 0) == -1 && errno != EPERM))
+        return 0;
+    return p;
+}
+
+/* Copies what the query needs. Returns 0 if it could not get it stable,
+ * or the job is not in the table. */
+static int read_page(const struct Status_page *p, int jobid,
+        struct Status_job *job, int *state_count, int *max_slots)
+{
+    int tries;
+
+    for (tries = 0; tries < STATUS_READ_TRIES; ++tries)
+    {
+        unsigned int seq = p->seq;
+        int found = 0;
+        int i;
+
+        if (seq & 1)
+            continue;
+        barrier();
+
+        if (jobid != -1)
+        {
+            int num = p->jobs_num;
+
+            for (i = 0; i < num && i < STATUS_JOBS; ++i)
+                if (p->jobs[i].jobid == jobid)
+                {
+                    *job = p->jobs[i];
+                    found = 1;
+                    break;
+                }
+        }
+        memcpy(state_count, p->state_count, sizeof(p->state_count));
+        *max_slots = p->max_slots;
+
+        barrier();
+        if (p->seq == seq)
+            return jobid == -1 || found;
+    }
+    return 0;
+}
+
+/* Answers the request from the status page, if it can. Returns 1 then. */
+int c_status_query()
+{
+    const struct Status_page *p;
+    const struct List_query *q = &command_line.list;
+    struct Status_job job;
+    int state_count[EXPIRED + 1];
+    int max_slots;
+    int jobid = -1;
+
+    switch(command_line.request)
+    {
+    case c_GET_STATE:
+        /* The last job is known only walking the queue */
+        if (command_line.jobid == -1)
+            return 0;
+        jobid = command_line.jobid;
+        break;
+    case c_GET_MAX_SLOTS:
+        break;
+    case c_LIST:
+        /* Counts only by state */
+        if (!q->count || q->jobid_range || q->elevel != ELEVEL_ANY
+                || command_line.list_label != 0)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    p = map_page();
+    if (p == 0)
+        return 0;
+    if (!read_page(p, jobid, &job, state_count, &max_slots))
+        return 0;
+
+    switch(command_line.request)
+    {
+    case c_GET_STATE:
+        printf("%s\n", jstate2string((enum Jobstate) job.state));
+        break;
+    case c_GET_MAX_SLOTS:
+        printf("%i\n", max_slots);
+        break;
+    default:
+        {
+            int count = 0;
+            int state;
+
+            /* As list_count() in the server */
+            for (state = QUEUED; state <= EXPIRED; ++state)
+                if (state != HOLDING_CLIENT
+                        && (q->states == 0 || (q->states & (1 << state))))
+                    count += state_count[state];
+            if (command_line.format == FORMAT_BINARY)
+                fwrite(&count, sizeof(count), 1, stdout);
+            else if (command_line.format == FORMAT_JSON)
+                printf("{\"count\":%i}\n", count);
+            else
+                printf("%i\n", count);
+        }
+        break;
+    }
+    return 1;
+}
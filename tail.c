@@ -164,7 +164,8 @@ int tail_file(const char *fname, int last_lines)
             res = select(maxfd + 1, &readset, 0, &errorset, &tv);
         }
 
-        if (FD_ISSET(server_socket, &readset))
+        if (FD_ISSET(server_socket, &readset)
+                || (waiting_end && msg_pending(server_socket)))
         {
             end_res = c_wait_job_recv();
             waiting_end = 0;
@@ -149,3 +149,672 @@ if [ $? -ne 0 ]; then
 fi
 
 ./ts -K
+
+# Test the memory admission. Nobody has 2000G available.
+./ts -K
+./ts --mem 2000G ls > /dev/null
+J2=`./ts ls`
+./ts -w $J2
+STATE=`./ts -s 0`
+if [ "$STATE" != "queued" ]; then
+  echo "Error in the memory admission."
+  exit 1
+fi
+# A gang whose members fit one by one, but not together
+if [ -r /proc/meminfo ]; then
+  ./ts -K
+  AVAIL=`awk '/^MemAvailable:/ { print $2 }' /proc/meminfo`
+  TOTAL=`awk '/^MemTotal:/ { print $2 }' /proc/meminfo`
+  MEM=$(( ($AVAIL - $TOTAL / 32) * 3 / 5 ))
+  ./ts -S 2
+  ./ts --gang m --gang-size 2 --mem ${MEM}K true > /dev/null
+  ./ts --gang m --gang-size 2 --mem ${MEM}K true > /dev/null
+  J2=`./ts ls`
+  ./ts -w $J2
+  STATE=`./ts -s 0`
+  if [ "$STATE" != "queued" ]; then
+    echo "Error in the memory admission 2."
+    exit 1
+  fi
+fi
+
+./ts -K
+
+# Test the server side timeouts
+./ts -K
+./ts --timeout 1 sleep 10 > /dev/null
+./ts -w
+if [ $? -eq 0 ]; then
+  echo "Error in the timeout 1."
+  exit 1
+fi
+LINES=`./ts -l | grep timeout | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the timeout 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the retries. The job fails twice, and succeeds on the third run.
+./ts -K
+rm -f /tmp/ts-retry-test
+./ts --retries 3 --backoff 0..1 sh -c 'echo x >> /tmp/ts-retry-test; test `wc -l < /tmp/ts-retry-test` -ge 3' > /dev/null
+./ts -w
+if [ $? -ne 0 ]; then
+  echo "Error in the retries 1."
+  exit 1
+fi
+LINES=`wc -l < /tmp/ts-retry-test`
+rm -f /tmp/ts-retry-test
+if [ $LINES -ne 3 ]; then
+  echo "Error in the retries 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the delayed jobs
+./ts -K
+./ts --after 2 ls > /dev/null
+STATE=`./ts -s`
+if [ "$STATE" != "delayed" ]; then
+  echo "Error in the delayed jobs 1."
+  exit 1
+fi
+./ts -w
+if [ $? -ne 0 ]; then
+  echo "Error in the delayed jobs 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the start rate limit
+./ts -K
+./ts -S 4
+./ts --start-rate 1/m
+./ts true > /dev/null
+./ts true > /dev/null
+./ts -w 0
+LINES=`./ts -l | grep deferred | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the start rate 1."
+  exit 1
+fi
+./ts --start-rate off
+./ts -w 1
+if [ $? -ne 0 ]; then
+  echo "Error in the start rate 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the fair share among labels
+./ts -K
+TS_FAIRSHARE=labels ./ts -S 1
+./ts sleep 1 > /dev/null
+./ts -L A true > /dev/null
+./ts -L A true > /dev/null
+./ts -L B true > /dev/null
+./ts -L B true > /dev/null
+./ts -w 4
+ORDER=`./ts -l | sed 1d | awk '{ print $1 }' | tr '\n' ' '`
+if [ "$ORDER" != "0 1 3 2 4 " ]; then
+  echo "Error in the fair share 1."
+  exit 1
+fi
+LINES=`./ts --stats | grep "^\`id -un\` " | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the fair share 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the deadlines
+./ts -K
+./ts -S 1
+./ts sleep 1 > /dev/null
+./ts echo A > /dev/null
+./ts --deadline 1h echo B > /dev/null
+./ts --deadline 10m echo C > /dev/null
+./ts -w 1
+ORDER=`./ts -l | sed 1d | awk '{ print $1 }' | tr '\n' ' '`
+if [ "$ORDER" != "0 3 2 1 " ]; then
+  echo "Error in the deadlines 1."
+  exit 1
+fi
+# The estimate of 'sleep 1' is known now, and it will not fit
+./ts sleep 1 > /dev/null
+./ts --deadline 1s sleep 1 > /dev/null
+sleep 1
+LINES=`./ts -l | grep "may miss its deadline" | wc -l`
+if [ $LINES -lt 1 ]; then
+  echo "Error in the deadlines 2."
+  exit 1
+fi
+# A job with deadline that waited for another runs once it goes
+./ts -K
+./ts -S 1
+./ts sleep 1 > /dev/null
+./ts -D 0 --deadline 1h true > /dev/null
+./ts -w 1
+STATE=`./ts -s 1`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the deadlines 3."
+  exit 1
+fi
+
+./ts -K
+
+# Test the preemption
+./ts -K
+./ts -S 1
+./ts sleep 2 > /dev/null
+sleep 0.5
+./ts --priority 1 true > /dev/null
+./ts -w 1
+STATE=`./ts -s 0`
+if [ "$STATE" != "running" ]; then
+  echo "Error in the preemption 1."
+  exit 1
+fi
+LINES=`./ts -i 0 | grep "Preempted by job 1" | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the preemption 2."
+  exit 1
+fi
+./ts -w 0
+
+# A preempted job cannot be removed
+./ts sleep 2 > /dev/null
+sleep 0.5
+./ts --priority 1 sleep 1 > /dev/null
+if ./ts -r 2 2> /dev/null; then
+  echo "Error in the preemption 3."
+  exit 1
+fi
+./ts -w 2
+
+# A gang member is not stopped
+./ts --gang h --gang-size 1 sleep 1 > /dev/null
+sleep 0.5
+./ts --priority 1 true > /dev/null
+./ts -w 5
+STATE=`./ts -s 4`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the preemption 4."
+  exit 1
+fi
+
+# A preempted job can be killed, and it runs again
+rm -f retry.tmp
+./ts --retries 1 --backoff 1..1 \
+  sh -c 'test -f retry.tmp || { touch retry.tmp; sleep 10; }' > /dev/null
+sleep 0.5
+./ts --priority 1 sleep 1 > /dev/null
+sleep 0.3
+./ts -k 6
+./ts -w 6
+LINES=`./ts -i 6 | grep "Attempt 1 failed" | wc -l`
+if [ $LINES -ne 1 ] || [ "`./ts -s 6`" != finished ]; then
+  echo "Error in the preemption 5."
+  exit 1
+fi
+rm -f retry.tmp
+
+# The server goes, and the preempted job goes on
+./ts sleep 10 > /dev/null
+sleep 0.5
+./ts --priority 1 sleep 10 > /dev/null
+sleep 0.3
+PID=`./ts -p 8`
+PID2=`./ts -p 9`
+./ts -K
+sleep 0.3
+STATE=`ps -o stat= -p $PID`
+kill -- -$PID -$PID2
+case "$STATE" in
+  T*)
+    echo "Error in the preemption 6."
+    exit 1;;
+esac
+
+./ts -K
+
+# Test the gangs
+./ts -K
+./ts -S 2
+./ts --gang g --gang-size 2 true > /dev/null
+./ts true > /dev/null
+./ts -w 1
+STATE=`./ts -s 0`
+if [ "$STATE" != "queued" ]; then
+  echo "Error in the gangs 1."
+  exit 1
+fi
+./ts --gang g --gang-size 2 true > /dev/null
+./ts -w 2
+./ts -w 0
+STATE=`./ts -s 0`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the gangs 2."
+  exit 1
+fi
+# A member not started when the gang is torn down, as its client is stopped
+rm -f gang.tmp
+./ts -f --gang t --gang-size 2 --gang-teardown \
+  sh -c 'sleep 2; touch gang.tmp' > /dev/null &
+CLIENT=$!
+while [ "`./ts -s 3 2> /dev/null`" != "queued" ]; do sleep 0.1; done
+kill -STOP $CLIENT
+./ts --gang t --gang-size 2 --gang-teardown false > /dev/null
+./ts -w 4
+kill -CONT $CLIENT
+wait $CLIENT
+sleep 3
+if [ -f gang.tmp ]; then
+  echo "Error in the gangs 3."
+  exit 1
+fi
+rm -f gang.tmp
+
+./ts -K
+
+# Test the queue quotas: 'b' gets back its slot from 'a'
+./ts -K
+TS_QUEUES="a:1,b:1" ./ts -S 2
+./ts --queue a sleep 1 > /dev/null
+./ts --queue a sleep 2 > /dev/null
+./ts --queue a sleep 1 > /dev/null
+./ts --queue b true > /dev/null
+./ts -w 3
+STATE=`./ts -s 2`
+if [ "$STATE" = "finished" ]; then
+  echo "Error in the queue quotas 1."
+  exit 1
+fi
+
+./ts -K
+
+# Test the unique jobs
+./ts -K
+./ts sleep 1 > /dev/null
+ID1=`./ts --unique echo hello`
+ID2=`./ts --unique echo hello`
+if [ "$ID1" != "$ID2" ]; then
+  echo "Error in the unique jobs 1."
+  exit 1
+fi
+./ts --debounce=k true > /dev/null
+ID3=`./ts --debounce=k true`
+./ts -w $ID3
+STATE=`./ts -s $(($ID3 - 1))`
+if [ "$STATE" != "skipped" ]; then
+  echo "Error in the unique jobs 2."
+  exit 1
+fi
+./ts sleep 1 > /dev/null
+./ts --debounce=k true > /dev/null
+ID4=`./ts -d true`
+./ts --debounce=k true > /dev/null
+./ts -w $ID4
+STATE=`./ts -s $ID4`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the unique jobs 3."
+  exit 1
+fi
+
+./ts -K
+
+# Test the memoized results
+./ts -K
+echo hello > memo-input.tmp
+./ts --memo-inputs memo-input.tmp cat memo-input.tmp > /dev/null
+./ts -w
+./ts -f --memo-inputs memo-input.tmp cat memo-input.tmp > /dev/null
+LINES=`./ts -i | grep "Memoized: the result of job 0" | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the memoized results 1."
+  exit 1
+fi
+echo bye > memo-input.tmp
+./ts --memo-inputs memo-input.tmp cat memo-input.tmp > /dev/null
+./ts -w
+OUT=`./ts -c`
+if [ "$OUT" != "bye" ]; then
+  echo "Error in the memoized results 2."
+  exit 1
+fi
+# The input changes while the job waits: its result is of the new input
+./ts sleep 1 > /dev/null
+echo early > memo-input.tmp
+./ts --memo-inputs memo-input.tmp cat memo-input.tmp > /dev/null
+echo late > memo-input.tmp
+./ts -w
+echo early > memo-input.tmp
+./ts --memo-inputs memo-input.tmp cat memo-input.tmp > /dev/null
+./ts -w
+OUT=`./ts -c`
+if [ "$OUT" != "early" ]; then
+  echo "Error in the memoized results 3."
+  exit 1
+fi
+rm -f memo-input.tmp
+
+./ts -K
+
+# Test the hedged jobs. The first copy to run is slow, the backup is quick.
+./ts -K
+./ts -S 2
+./ts --hedge -L hedge sleep 0.1 > /dev/null
+./ts --hedge -L hedge sleep 0.1 > /dev/null
+./ts --hedge -L hedge sleep 0.1 > /dev/null
+./ts -w
+rm -f hedge-flag.tmp
+./ts --hedge -L hedge sh -c 'if [ -e hedge-flag.tmp ]; then echo quick;
+  else touch hedge-flag.tmp; sleep 10; fi' > /dev/null
+./ts -w
+OUT=`./ts -c`
+if [ "$OUT" != "quick" ]; then
+  echo "Error in the hedged jobs 1."
+  exit 1
+fi
+LINES=`./ts -i | grep "The backup copy ended first" | wc -l`
+if [ $LINES -ne 1 ]; then
+  echo "Error in the hedged jobs 2."
+  exit 1
+fi
+rm -f hedge-flag.tmp
+# The timeout stops the backup copy too
+./ts --hedge -L hedge --timeout 1 sh -c 'if [ -e hedge-flag.tmp ]; then
+  sleep 3; echo quick; else touch hedge-flag.tmp; trap "" TERM; sleep 5; fi' \
+  > /dev/null
+./ts -w
+OUT=`./ts -c`
+if [ "$OUT" = "quick" ]; then
+  echo "Error in the hedged jobs 3."
+  exit 1
+fi
+rm -f hedge-flag.tmp
+
+./ts -K
+
+# Test the TTL. The job cannot start before it expires.
+./ts -K
+./ts sleep 2 > /dev/null
+./ts --ttl 1 ls > /dev/null
+./ts -d ls > /dev/null
+./ts -w
+STATE=`./ts -s 1`
+if [ "$STATE" != "expired" ]; then
+  echo "Error in the TTL 1."
+  exit 1
+fi
+STATE=`./ts -s 2`
+if [ "$STATE" != "skipped" ]; then
+  echo "Error in the TTL 2."
+  exit 1
+fi
+
+# A job removed before its TTL leaves no timer behind
+./ts sleep 2 > /dev/null
+./ts --ttl 1 ls > /dev/null
+./ts --ttl 1 ls > /dev/null
+./ts -r 4
+./ts -w
+STATE=`./ts -s 5`
+if [ "$STATE" != "expired" ]; then
+  echo "Error in the TTL 3."
+  exit 1
+fi
+
+./ts -K
+
+# Test the interactive slots. The batch jobs leave one slot free.
+./ts -K
+TS_INTERACTIVE_SLOTS=1 ./ts -S 2
+./ts sleep 2 > /dev/null
+./ts sleep 2 > /dev/null
+./ts --interactive ls > /dev/null
+./ts -w 2
+STATE=`./ts -s 1`
+if [ "$STATE" != "queued" ]; then
+  echo "Error in the interactive slots 1."
+  exit 1
+fi
+STATE=`./ts -s 2`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the interactive slots 2."
+  exit 1
+fi
+# An urged interactive job goes before the others
+./ts -K
+./ts -S 1
+./ts sleep 1 > /dev/null
+./ts --interactive sleep 0.5 > /dev/null
+./ts --interactive sleep 0.5 > /dev/null
+./ts -u 2
+./ts -w 1
+STATE=`./ts -s 2`
+if [ "$STATE" != "finished" ]; then
+  echo "Error in the interactive slots 3."
+  exit 1
+fi
+
+./ts -K
+
+# Test the session of --pipe. The answers come in order, after a dot each.
+./ts -K
+./ts ls > /dev/null
+./ts -w
+./ts sleep 2 > /dev/null
+OUT=`printf 'state 0\nstate 1\nbogus\nslots\n' | ./ts --pipe | tr '\n' ' '`
+if [ "$OUT" != "finished . running . Wrong request: bogus . 1 . " ]; then
+  echo "Error in the pipe 1."
+  exit 1
+fi
+LINES=`printf 'list\ninfo 0\n' | ./ts --pipe | grep -c '^\.$'`
+if [ "$LINES" != "2" ]; then
+  echo "Error in the pipe 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the list of many jobs. It goes in more than one chunk.
+./ts -K
+./ts sleep 10 > /dev/null
+LABEL=`printf '%0300i' 0`
+for i in `seq 200`; do
+  ./ts -n -L $LABEL true > /dev/null
+done
+LINES=`./ts -l | wc -l`
+if [ "$LINES" != "202" ]; then
+  echo "Error in the long list 1."
+  exit 1
+fi
+LINES=`./ts -l | grep -c "^[0-9]* *queued .*true$"`
+if [ "$LINES" != "200" ]; then
+  echo "Error in the long list 2."
+  exit 1
+fi
+
+./ts -K
+
+# Test the filters of the list.
+./ts -K
+./ts -L a1 true > /dev/null
+./ts -L b1 false > /dev/null
+./ts -L a2 sh -c 'exit 3' > /dev/null
+./ts -w
+./ts sleep 2 > /dev/null
+./ts -L b2 true > /dev/null
+COUNT=`./ts --count`
+if [ "$COUNT" != "5" ]; then
+  echo "Error in the list filters 1."
+  exit 1
+fi
+COUNT=`./ts --count --state queued,running`
+if [ "$COUNT" != "2" ]; then
+  echo "Error in the list filters 2."
+  exit 1
+fi
+COUNT=`./ts --count --elevel failed --label-pattern 'a*'`
+if [ "$COUNT" != "1" ]; then
+  echo "Error in the list filters 3."
+  exit 1
+fi
+IDS=`./ts --sort -id --limit 2 --offset 1 | tail -n +2 | cut -d' ' -f1 | tr '\n' ' '`
+if [ "$IDS" != "3 2 " ]; then
+  echo "Error in the list filters 4."
+  exit 1
+fi
+./ts -C
+COUNT=`./ts --count --state finished`
+if [ "$COUNT" != "0" ]; then
+  echo "Error in the list filters 5."
+  exit 1
+fi
+
+./ts -K
+
+# Test the structured formats.
+./ts -K
+./ts -L 'a "b"' true > /dev/null
+./ts -w
+COUNT=`./ts --format=json --count`
+if [ "$COUNT" != '{"count":1}' ]; then
+  echo "Error in the formats 1."
+  exit 1
+fi
+LINES=`./ts --format=json | grep -c '^{"id":0,"state":"finished",.*"label":"a \\\\"b\\\\"",'`
+if [ "$LINES" != "1" ]; then
+  echo "Error in the formats 2."
+  exit 1
+fi
+BYTES=`./ts --format=binary -i 0 | wc -c`
+if [ "$BYTES" -le 100 ]; then
+  echo "Error in the formats 3."
+  exit 1
+fi
+
+./ts -K
+
+# Test the event stream.
+./ts -K
+./ts -L first true > /dev/null
+./ts -w
+./ts --watch=snapshot > /tmp/ts_watch.$$ &
+WATCH=$!
+sleep 0.5
+./ts sh -c 'exit 2' > /dev/null
+./ts -w
+./ts -C
+./ts -K
+wait $WATCH
+if ! grep -q '^job 0 finished 0 .*\[first\]true$' /tmp/ts_watch.$$ \
+    || ! grep -q '^ready ' /tmp/ts_watch.$$ \
+    || ! grep -q '^enqueued 1 queued sh -c exit 2$' /tmp/ts_watch.$$ \
+    || ! grep -q '^state 1 running$' /tmp/ts_watch.$$ \
+    || ! grep -q '^finished 1 finished 2 ' /tmp/ts_watch.$$ \
+    || ! grep -q '^cleared$' /tmp/ts_watch.$$; then
+  echo "Error in the event stream."
+  cat /tmp/ts_watch.$$
+  rm -f /tmp/ts_watch.$$
+  exit 1
+fi
+rm -f /tmp/ts_watch.$$
+
+./ts -K
+
+# Test waiting for many jobs.
+./ts -K
+./ts -S 3
+./ts sh -c 'sleep 1; exit 3' > /dev/null
+./ts -L w true > /dev/null
+./ts -L w sleep 0.5 > /dev/null
+./ts -w 1 2
+if [ $? -ne 0 ]; then
+  echo "Error in the multi-job wait 1."
+  exit 1
+fi
+./ts -w --label w
+if [ $? -ne 0 ] || [ `./ts --count --state=running` != 1 ]; then
+  echo "Error in the multi-job wait 2."
+  exit 1
+fi
+./ts -w --all
+if [ $? -ne 3 ] || [ `./ts --count --state=finished` != 3 ]; then
+  echo "Error in the multi-job wait 3."
+  exit 1
+fi
+./ts sleep 10 > /dev/null
+./ts -w --any 3 0
+if [ $? -ne 3 ]; then
+  echo "Error in the multi-job wait 4."
+  exit 1
+fi
+
+./ts -K
+
+# Test the status page, read by -s, -S and --count.
+./ts -K
+STATUS=${TS_SOCKET:-${TMPDIR:-/tmp}/socket-ts.`id -u`}.status
+./ts -S 3
+./ts sleep 5 > /dev/null
+./ts true > /dev/null
+./ts -w 1
+if [ ! -f "$STATUS" ] || [ `./ts -S` != 3 ] || [ `./ts -s 1` != finished ] \
+    || [ `./ts --count` != 2 ]; then
+  echo "Error in the status page 1."
+  exit 1
+fi
+./ts -S 2
+./ts -C
+if [ `./ts -S` != 2 ] || [ `./ts --count` != 1 ] \
+    || [ `./ts --count --state running` != 1 ]; then
+  echo "Error in the status page 2."
+  exit 1
+fi
+./ts -K
+if [ -f "$STATUS" ]; then
+  echo "Error in the status page 3."
+  exit 1
+fi
+
+# Test the submission ring.
+./ts -K
+TS_RING=1 ./ts -S 2
+./ts --ring -L r sh -c 'exit 2'
+printf 'true\necho ring\n' | ./ts --ring
+./ts -w --all
+if [ $? -ne 2 ] || [ `./ts --count --state finished` != 3 ] \
+    || [ "`./ts -c 2`" != ring ]; then
+  echo "Error in the submission ring 1."
+  exit 1
+fi
+# The jobs run where --ring ran
+TS=`pwd`/ts
+(cd / && $TS --ring pwd)
+./ts -w 3
+if [ "`./ts -c 3`" != / ]; then
+  echo "Error in the submission ring 3."
+  exit 1
+fi
+./ts -K
+./ts -S 2
+if ./ts --ring true 2> /dev/null; then
+  echo "Error in the submission ring 2."
+  exit 1
+fi
+./ts -K
+
+# Test the timer wheel, on a clock of its own
+make -s ttimers > /dev/null
+if ! ./ttimers; then
+  echo "Error in the timer wheel."
+  exit 1
+fi
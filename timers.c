@@ -0,0 +1,457 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef __linux__
+  #include <sys/timerfd.h>
+#endif
+#include "main.h"
+
+/* Timers of the server, in a hierarchical timer wheel, as the classic one of
+ * the linux kernel. The first level has a slot for each of the next 256
+ * ticks. Each of the other four levels has 64 slots, each slot covering 64
+ * slots of the level below. A timer is placed in the level matching how far
+ * it expires, and moved down (cascaded) when the lower level reaches its
+ * slot. So adding and removing cost O(1), and a tick costs O(1) amortized,
+ * whatever the amount of timers. With ticks of 10ms, the wheel covers
+ * about 497 days.
+ * In linux the wheel is driven by a timerfd, armed for the next expiry or
+ * cascade, so the server loop only wakes up when something has to be done. */
+
+enum
+{
+    TV1_BITS = 8,
+    TVN_BITS = 6,
+    TV1_SIZE = 1 << TV1_BITS,
+    TVN_SIZE = 1 << TVN_BITS,
+    TV1_MASK = TV1_SIZE - 1,
+    TVN_MASK = TVN_SIZE - 1,
+    NLEVELS = 5,
+    RUNNING_LEVEL = NLEVELS /* The timers being fired */
+};
+
+static struct Timer *tv1[TV1_SIZE];
+static struct Timer *tvn[NLEVELS - 1][TVN_SIZE];
+static struct Timer *running_list;
+static int level_count[NLEVELS];
+static unsigned long current_tick; /* Next tick to be processed */
+static unsigned long armed_tick; /* Valid only if 'armed' */
+static int armed = 0;
+static int timerfd = -1;
+static struct timeval base_time;
+
+static unsigned long now_ticks()
+{
+    struct timeval now;
+    long ms;
+
+    /* The monotonic clock is not in SUSv2; we use it where we have
+     * the timerfd, that follows it */
+#ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now.tv_sec = ts.tv_sec;
+    now.tv_usec = ts.tv_nsec / 1000;
+#else
+    gettimeofday(&now, 0);
+#endif
+
+    ms = (now.tv_sec - base_time.tv_sec) * 1000 +
+        (now.tv_usec - base_time.tv_usec) / 1000;
+    return (unsigned long) ms / TICK_MS;
+}
+
+void timers_init()
+{
+#ifdef __linux__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    base_time.tv_sec = ts.tv_sec;
+    base_time.tv_usec = ts.tv_nsec / 1000;
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfd == -1)
+        warning("Cannot create the timerfd. Falling back to select timeouts");
+#else
+    gettimeofday(&base_time, 0);
+#endif
+    current_tick = now_ticks();
+}
+
+/* The current time, in ticks */
+unsigned long timers_now()
+{
+    return now_ticks();
+}
+
+int timers_fd()
+{
+    return timerfd;
+}
+
+void timer_init(struct Timer *t, void (*fire)(struct Timer *t), void *data)
+{
+    t->next = 0;
+    t->prev = 0;
+    t->pending = 0;
+    t->expires = 0;
+    t->level = 0;
+    t->index = 0;
+    t->fire = fire;
+    t->data = data;
+}
+
+int timer_pending(const struct Timer *t)
+{
+    return t->pending;
+}
+
+/* Ticks between two cascades of a level */
+static unsigned long level_granularity(int level)
+{
+    if (level == 0)
+        return 1;
+    return 1UL << (TV1_BITS + (level - 1) * TVN_BITS);
+}
+
+static struct Timer ** slot_head(int level, int index)
+{
+    if (level == RUNNING_LEVEL)
+        return &running_list;
+    if (level == 0)
+        return &tv1[index];
+    return &tvn[level - 1][index];
+}
+
+static void link_timer(struct Timer *t, int level, int index)
+{
+    struct Timer **head = slot_head(level, index);
+
+    t->level = level;
+    t->index = index;
+    t->prev = 0;
+    t->next = *head;
+    if (*head)
+        (*head)->prev = t;
+    *head = t;
+    if (level != RUNNING_LEVEL)
+        ++level_count[level];
+}
+
+static void unlink_timer(struct Timer *t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *slot_head(t->level, t->index) = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    t->next = 0;
+    t->prev = 0;
+    if (t->level != RUNNING_LEVEL)
+        --level_count[t->level];
+}
+
+/* Places the timer in the level matching how far it expires */
+static void internal_add(struct Timer *t)
+{
+    unsigned long expires = t->expires;
+    unsigned long idx = expires - current_tick;
+    int level;
+
+    if ((long) idx < 0)
+    {
+        /* Already expired: the next tick */
+        link_timer(t, 0, current_tick & TV1_MASK);
+        return;
+    }
+
+    if (idx < TV1_SIZE)
+    {
+        link_timer(t, 0, expires & TV1_MASK);
+        return;
+    }
+
+    /* Each level covers up to the granularity of the next one */
+    for (level = 1; level < NLEVELS - 1; ++level)
+        if (idx < level_granularity(level + 1))
+            break;
+
+    if (level == NLEVELS - 1 && idx > 0xffffffffUL)
+    {
+        /* Out of the wheel range. It will be cascaded earlier,
+         * and get placed again. */
+        expires = current_tick + 0xffffffffUL;
+    }
+
+    link_timer(t, level, (expires >> (TV1_BITS + (level - 1) * TVN_BITS))
+            & TVN_MASK);
+}
+
+/* Moves down the timers of a slot. Returns the slot index, as the next
+ * level only has to cascade when it's 0. */
+static int cascade(int level, int index)
+{
+    struct Timer *list;
+
+    list = *slot_head(level, index);
+    while (list != 0)
+    {
+        struct Timer *t = list;
+        list = t->next;
+        unlink_timer(t);
+        internal_add(t);
+    }
+
+    return index;
+}
+
+/* The tick where the next thing happens: a timer expiry, or a cascade that
+ * will bring timers closer. The earliest among the levels, as a cascade may
+ * bring a timer before the next one of the first level. Returns 0 if there
+ * is nothing pending. */
+static int next_event(unsigned long *tick)
+{
+    int level;
+    int found = 0;
+    unsigned long i;
+
+    if (level_count[0] > 0)
+    {
+        for (i = 0; i < TV1_SIZE; ++i)
+            if (tv1[(current_tick + i) & TV1_MASK] != 0)
+            {
+                *tick = current_tick + i;
+                found = 1;
+                break;
+            }
+    }
+
+    for (level = 1; level < NLEVELS; ++level)
+    {
+        int shift = TV1_BITS + (level - 1) * TVN_BITS;
+        unsigned long base = current_tick >> shift;
+        unsigned long first;
+
+        if (level_count[level] == 0)
+            continue;
+
+        /* On a boundary of the level, its slot there is still to cascade,
+         * in the tick current_tick */
+        first = (current_tick & ((1UL << shift) - 1)) == 0 ? 0 : 1;
+        for (i = first; i < first + TVN_SIZE; ++i)
+            if (tvn[level - 1][(base + i) & TVN_MASK] != 0)
+            {
+                if (!found || (base + i) << shift < *tick)
+                    *tick = (base + i) << shift;
+                found = 1;
+                break;
+            }
+    }
+
+    return found;
+}
+
+static void arm(unsigned long tick)
+{
+    armed = 1;
+    armed_tick = tick;
+
+#ifdef __linux__
+    if (timerfd != -1)
+    {
+        struct itimerspec its;
+        unsigned long now = now_ticks();
+        unsigned long ms;
+
+        if (tick > now)
+            ms = (tick - now) * TICK_MS;
+        else
+            ms = 1; /* Zero would disarm */
+
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+        if (timerfd_settime(timerfd, 0, &its, NULL) == -1)
+            warning("Cannot arm the timerfd");
+    }
+#endif
+}
+
+static void rearm()
+{
+    unsigned long tick;
+
+    if (next_event(&tick))
+        arm(tick);
+    else
+        armed = 0;
+}
+
+void timer_add(struct Timer *t, unsigned long ms)
+{
+    if (t->pending)
+        timer_del(t);
+
+    /* At least one tick, so it never fires in the tick it was added */
+    t->expires = now_ticks() + (ms + TICK_MS - 1) / TICK_MS;
+    internal_add(t);
+    t->pending = 1;
+
+    if (!armed || t->expires < armed_tick)
+        rearm();
+}
+
+void timer_del(struct Timer *t)
+{
+    if (!t->pending)
+        return;
+
+    unlink_timer(t);
+    t->pending = 0;
+    /* We don't rearm: at worst, we'll wake up once for nothing */
+}
+
+/* Where to jump from current_tick, if no timer can expire before:
+ * the next cascade of the lowest level with timers. */
+static unsigned long next_interesting_tick(unsigned long now)
+{
+    int level;
+
+    for (level = 1; level < NLEVELS; ++level)
+        if (level_count[level] > 0)
+        {
+            unsigned long g = level_granularity(level);
+            unsigned long next = (current_tick + g - 1) & ~(g - 1);
+            return next < now + 1 ? next : now + 1;
+        }
+
+    return now + 1;
+}
+
+/* Fires the expired timers. Call it on every loop of the server. */
+void timers_run()
+{
+    unsigned long now;
+
+#ifdef __linux__
+    if (timerfd != -1)
+    {
+        char buf[8];
+        /* Nonblocking. We only want to clear its readability. */
+        read(timerfd, buf, sizeof(buf));
+    }
+#endif
+
+    now = now_ticks();
+
+    while (now >= current_tick)
+    {
+        int index;
+
+        /* Nothing can expire in the first level: jump */
+        if (level_count[0] == 0)
+        {
+            current_tick = next_interesting_tick(now);
+            if (current_tick > now)
+                break;
+        }
+
+        index = current_tick & TV1_MASK;
+        if (index == 0)
+        {
+            int level = 1;
+            while (level < NLEVELS && cascade(level,
+                    (current_tick >> (TV1_BITS + (level - 1) * TVN_BITS))
+                    & TVN_MASK) == 0)
+                ++level;
+        }
+
+        ++current_tick;
+
+        /* We move the slot apart, as the handlers may add or remove
+         * timers */
+        while (tv1[index] != 0)
+        {
+            struct Timer *t = tv1[index];
+            unlink_timer(t);
+            link_timer(t, RUNNING_LEVEL, 0);
+        }
+        while (running_list != 0)
+        {
+            struct Timer *t = running_list;
+            unlink_timer(t);
+            t->pending = 0;
+            t->fire(t);
+        }
+    }
+
+    rearm();
+}
+
+/* For systems without timerfd. Returns the timeout to give select(), or
+ * NULL if it should block until some fd is ready. */
+struct timeval * timers_select_timeout(struct timeval *tv)
+{
+    unsigned long now;
+    unsigned long ms;
+
+    if (timerfd != -1 || !armed)
+        return NULL;
+
+    now = now_ticks();
+    if (armed_tick > now)
+        ms = (armed_tick - now) * TICK_MS;
+    else
+        ms = 0;
+
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+    return tv;
+}
+
+/* Returns the seconds, or -1 if the string cannot be parsed.
+ * Accepts plain seconds, or a s/m/h/d suffix: "90", "15m", "2h". */
+int parse_duration(const char *str)
+{
+    double val;
+    char *end;
+
+    val = strtod(str, &end);
+    if (end == str || val < 0)
+        return -1;
+
+    switch(tolower((unsigned char) *end))
+    {
+        case '\0':
+        case 's':
+            break;
+        case 'm':
+            val *= 60.;
+            break;
+        case 'h':
+            val *= 60. * 60.;
+            break;
+        case 'd':
+            val *= 24. * 60. * 60.;
+            break;
+        default:
+            return -1;
+    }
+
+    if (*end != '\0' && end[1] != '\0')
+        return -1;
+    if (val > 2147483647.)
+        return -1;
+    return (int) val;
+}
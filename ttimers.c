@@ -0,0 +1,155 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+
+/* Test of the timer wheel, on a clock of its own. It runs the wheel as the
+ * server does without a timerfd: sleeping for the timeout that the wheel
+ * asks, or less, when a client would wake it up, and checks that each
+ * timer fires in its tick. */
+
+#ifdef __linux__
+  #define clock_gettime fake_clock_gettime
+  #define timerfd_create fake_timerfd_create
+#else
+  #define gettimeofday fake_gettimeofday
+#endif
+#include "timers.c"
+
+static long fake_ms = 0; /* The time of the clock */
+static int failed = 0;
+
+#ifdef __linux__
+int fake_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    ts->tv_sec = fake_ms / 1000;
+    ts->tv_nsec = (fake_ms % 1000) * 1000000;
+    return 0;
+}
+
+/* Without it, the wheel gives the timeouts for select() */
+int fake_timerfd_create(int clock, int flags)
+{
+    return -1;
+}
+#else
+int fake_gettimeofday(struct timeval *tv, void *tz)
+{
+    tv->tv_sec = fake_ms / 1000;
+    tv->tv_usec = (fake_ms % 1000) * 1000;
+    return 0;
+}
+#endif
+
+/* timers.c warns that there is no timerfd */
+void warning(const char *str, ...)
+{
+}
+
+struct Check
+{
+    const char *name;
+    long due; /* In ms of the clock */
+    long fired; /* -1 until it fires */
+};
+
+static void fire_check(struct Timer *t)
+{
+    struct Check *c = (struct Check *) t->data;
+
+    c->fired = fake_ms;
+}
+
+static void add_check(struct Timer *t, struct Check *c, const char *name,
+        long ms)
+{
+    c->name = name;
+    c->due = fake_ms + ms;
+    c->fired = -1;
+    timer_init(t, fire_check, c);
+    timer_add(t, ms);
+}
+
+/* As the server loop, until the clock reaches 'ms' */
+static void run_until(long ms)
+{
+    while (1)
+    {
+        struct timeval tv;
+        long step;
+
+        timers_run();
+        if (fake_ms >= ms)
+            break;
+        if (timers_select_timeout(&tv) == NULL)
+            step = ms - fake_ms;
+        else
+            step = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        if (step < TICK_MS)
+            step = TICK_MS;
+        fake_ms += step;
+        if (fake_ms > ms)
+            fake_ms = ms;
+    }
+}
+
+static void expect(const struct Check *c)
+{
+    if (c->fired < c->due || c->fired > c->due + TICK_MS)
+    {
+        printf("Timer '%s' due at %lims fired at %lims\n", c->name, c->due,
+                c->fired);
+        failed = 1;
+    }
+}
+
+int main()
+{
+    struct Timer t1, t2, t3;
+    struct Check c1, c2, c3;
+
+    timers_init();
+
+    /* Woken up right before a boundary of the second level, the wheel
+     * stands on the boundary, with that slot still to cascade */
+    fake_ms = 100;
+    run_until(100);
+    add_check(&t1, &c1, "boundary", 2900);
+    run_until(2550);
+    run_until(200000);
+    expect(&c1);
+
+    /* A timer in the first level, after a cascade that brings another */
+    fake_ms = 300000;
+    run_until(300000);
+    add_check(&t2, &c2, "cascaded", 3000);
+    run_until(302000);
+    add_check(&t3, &c3, "first level", 2500);
+    run_until(400000);
+    expect(&c2);
+    expect(&c3);
+
+    /* Many, added at random times, up to an hour ahead, with the server
+     * woken up at random times too. In whole ticks, so they are due in a
+     * tick exactly. */
+    {
+        enum { N = 500 };
+        static struct Timer t[N];
+        static struct Check c[N];
+        int i;
+
+        srand(1);
+        for (i = 0; i < N; ++i)
+        {
+            run_until(fake_ms + rand() % 2000 * TICK_MS);
+            add_check(&t[i], &c[i], "random", rand() % 360000 * TICK_MS);
+        }
+        run_until(fake_ms + 3600000 + 1000);
+        for (i = 0; i < N; ++i)
+            expect(&c[i]);
+    }
+
+    return failed;
+}
@@ -0,0 +1,129 @@
+/*
+    Task Spooler - a task queue system for the unix user
+    Copyright (C) 2007-2013  Lluís Batlle i Rossell
+
+    Please find the license in the provided COPYING file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "main.h"
+
+/* The index of the jobs queued with --unique or --debounce, by their key,
+ * while they wait to run. So a new job can find its duplicate in O(1),
+ * whatever the length of the queue. A chained hash table, that doubles its
+ * buckets as it fills. */
+
+static struct Job **table = 0;
+static unsigned int table_size = 0;
+static unsigned int count = 0;
+
+static unsigned int hash_key(const char *str)
+{
+    unsigned int h = 5381;
+
+    for (; *str != '\0'; ++str)
+        h = h * 33 + (unsigned char) *str;
+    return h;
+}
+
+static void grow()
+{
+    struct Job **old = table;
+    unsigned int old_size = table_size;
+    unsigned int i;
+
+    table_size = table_size ? table_size * 2 : 64;
+    table = (struct Job **) malloc(table_size * sizeof(*table));
+    if (table == 0)
+        error("Cannot allocate the unique job index");
+    memset(table, 0, table_size * sizeof(*table));
+
+    for (i = 0; i < old_size; ++i)
+        while (old[i] != 0)
+        {
+            struct Job *p = old[i];
+            unsigned int b = hash_key(p->unique_key) & (table_size - 1);
+
+            old[i] = p->unique_next;
+            p->unique_next = table[b];
+            table[b] = p;
+        }
+    free(old);
+}
+
+/* The key of the job: the one given, or its label and command */
+void unique_set_key(struct Job *p, const char *key)
+{
+    int len;
+
+    if (key != 0 && key[0] != '\0')
+    {
+        len = strlen(key) + 2;
+        p->unique_key = (char *) malloc(len);
+        if (p->unique_key == 0)
+            error("Cannot allocate the unique key");
+        snprintf(p->unique_key, len, "k%s", key);
+        return;
+    }
+
+    len = strlen(p->command) + (p->label ? strlen(p->label) : 0) + 3;
+    p->unique_key = (char *) malloc(len);
+    if (p->unique_key == 0)
+        error("Cannot allocate the unique key");
+    snprintf(p->unique_key, len, "c%s\n%s", p->label ? p->label : "",
+            p->command);
+}
+
+/* The waiting job with that key, or 0 */
+struct Job * unique_find(const char *key)
+{
+    struct Job *p;
+
+    if (count == 0)
+        return 0;
+
+    for (p = table[hash_key(key) & (table_size - 1)]; p != 0;
+            p = p->unique_next)
+        if (strcmp(p->unique_key, key) == 0)
+            return p;
+    return 0;
+}
+
+void unique_insert(struct Job *p)
+{
+    unsigned int b;
+
+    if (count >= table_size)
+        grow();
+
+    b = hash_key(p->unique_key) & (table_size - 1);
+    p->unique_next = table[b];
+    table[b] = p;
+    p->unique_indexed = 1;
+    ++count;
+}
+
+/* The job does not wait anymore: it started, or it was removed */
+void unique_remove(struct Job *p)
+{
+    struct Job **pp;
+
+    if (p->unique_key == 0)
+        return;
+
+    if (p->unique_indexed)
+    {
+        pp = &table[hash_key(p->unique_key) & (table_size - 1)];
+        while (*pp != 0 && *pp != p)
+            pp = &(*pp)->unique_next;
+        if (*pp != 0)
+            *pp = p->unique_next;
+        p->unique_indexed = 0;
+        --count;
+    }
+
+    free(p->unique_key);
+    p->unique_key = 0;
+}